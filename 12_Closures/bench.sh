@@ -0,0 +1,31 @@
+#!/bin/sh
+# Times the VM build variants against each other in Release mode.
+# Usage: ./bench.sh [script.lox ...]   (defaults to bench/*.lox)
+set -e
+VARIANTS="switch:-DNO_COMPUTED_GOTO goto: goto+tos:-DCACHE_TOS goto+nan:-DNAN_BOXING"
+
+for variant in $VARIANTS; do
+  name=${variant%%:*}
+  flags=${variant#*:}
+  cmake -S . -B "build/bench-$name" -DCMAKE_BUILD_TYPE=Release \
+    -DCMAKE_C_FLAGS="$flags" > /dev/null
+  cmake --build "build/bench-$name" > /dev/null 2>&1
+done
+
+if [ $# -eq 0 ]; then
+  set -- bench/*.lox
+fi
+for script in "$@"; do
+  line="$script:"
+  for variant in $VARIANTS; do
+    name=${variant%%:*}
+    seconds=$("./build/bench-$name/clox" "$script" | tail -n 1)
+    line="$line $name ${seconds}s"
+  done
+  seconds=$(./build/bench-goto/clox --jit "$script" | tail -n 1)
+  line="$line goto+jit ${seconds}s"
+  seconds=$(./build/bench-goto/clox -O "$script" | tail -n 1)
+  line="$line goto-O ${seconds}s"
+  seconds=$(./build/bench-goto/clox --registers "$script" | tail -n 1)
+  echo "$line goto-regs ${seconds}s"
+done
@@ -0,0 +1,23 @@
+#ifndef COPY_CLOX_BATCH_H
+#define COPY_CLOX_BATCH_H
+
+#include "common.h"
+#include "vm.h"
+
+#define BATCH_DEFAULT_TIMEOUT 10.0 // Seconds a script may run in batch mode.
+
+// Runs the script at `path` on `vm` and returns clox's exit status for it:
+// RunFile() in main.c.
+typedef int (*BatchRunFn)(VM *vm, const char *path);
+
+// Runs every .lox file in `dir` on a pool of `jobs` worker processes (one per
+// CPU if `jobs` is 0) forked from the already initialized `vm`. Each script
+// gets a fresh copy-on-write copy of that VM, so scripts cannot see each
+// other's globals, and is killed after `timeout` seconds unless that is 0.
+// Prints every script's status, run time and output, in path order, followed
+// by throughput statistics. Returns the exit status for clox: 0 if every
+// script succeeded, 70 otherwise.
+int RunBatch(VM *vm, const char *dir, int jobs, double timeout,
+             BatchRunFn run);
+
+#endif // COPY_CLOX_BATCH_H
@@ -10,9 +10,9 @@ typedef enum {
   OP_TRUE,
   OP_FALSE,
   OP_POP,
-  OP_DEFINE_GLOBAL,
-  OP_GET_GLOBAL,
-  OP_SET_GLOBAL,
+  OP_DEFINE_GLOBAL_SLOT,
+  OP_GET_GLOBAL_SLOT,
+  OP_SET_GLOBAL_SLOT,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
   OP_GET_UPVALUE,
@@ -31,25 +31,160 @@ typedef enum {
   OP_JUMP,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+  // Wide forms, with a 24-bit operand for indexes and jumps past the short
+  // forms' reach. A chunk only keeps them where the short form cannot hold the
+  // operand, and DecodeFunction() turns them back into the short forms, so
+  // they never run.
+  OP_CONSTANT_LONG,
+  OP_CLOSURE_LONG,
+  OP_DEFINE_GLOBAL_SLOT_LONG,
+  OP_GET_GLOBAL_SLOT_LONG,
+  OP_SET_GLOBAL_SLOT_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_JUMP_LONG,
+  OP_JUMP_IF_FALSE_LONG,
+  OP_LOOP_LONG,
+  // Superinstructions, formed from the sequences above after compilation.
+  OP_GET_LOCAL_GET_LOCAL,
+  OP_GET_LOCAL_CONSTANT,
+  OP_SET_LOCAL_POP,
+  OP_INCREMENT_LOCAL,
+  OP_LESS_JUMP_IF_FALSE,
+  OP_GREATER_JUMP_IF_FALSE,
+  // Register forms, for clox --registers. Their operands name stack slots and
+  // constants directly instead of working on the top of the stack: each
+  // writes register `a` from sources `b` and `c` and then leaves the stack
+  // top at `top`. The compare-and-jump forms jump forward when the comparison
+  // gives `a`, which is 0 or 1. In Chunk.code each operand takes a byte, in
+  // that order, with no `b` or `c` where the form has none, and a
+  // compare-and-jump ends in a three-byte offset like OP_JUMP_LONG's.
+  OP_MOVE,
+  OP_NEGATE_R,
+  OP_NOT_R,
+  OP_EQUAL_R,
+  OP_GREATER_R,
+  OP_LESS_R,
+  OP_ADD_R,
+  OP_SUBTRACT_R,
+  OP_MULTIPLY_R,
+  OP_DIVIDE_R,
+  OP_EQUAL_JUMP_R,
+  OP_GREATER_JUMP_R,
+  OP_LESS_JUMP_R,
+  // Quickened forms. Run() rewrites decoded instructions to these once they
+  // have seen operands of one type; they never appear in Chunk.code.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_LESS_NUM,
+  OP_GREATER_NUM,
+  // An OP_LOOP whose loop has been compiled to a native trace.
+  OP_LOOP_TRACE,
 } OpCode;
 
+#define OPCODE_COUNT (OP_LOOP_TRACE + 1) // Keep in step with the last opcode.
+
+#define UINT24_MAX 0xffffff // The largest operand of the wide forms.
+
+// Set in a register form's source operand when it names a constant rather
+// than a slot. Either way the index takes the other seven bits.
+#define RK_CONSTANT 0x80
+
+// Reads a wide form's operand. Like every multi-byte operand it is stored
+// most significant byte first.
+static inline int ReadWideOperand(uint8_t *operand) {
+  return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+// Whether `opcode` is one of the register forms.
+static inline bool IsRegisterForm(uint8_t opcode) {
+  return opcode >= OP_MOVE && opcode <= OP_LESS_JUMP_R;
+}
+
+// A run of bytes in Chunk.code compiled from the same source line. It lasts
+// until the next run's offset.
+typedef struct {
+  int offset;
+  int line;
+} LineRun;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
-  int *lines;
+  LineRun *lines; // In order of offset. Empty once the chunk is stripped.
+  int line_count;
+  int line_capacity;
   ValueArray constants;
+  // Whether `constants` is a view of the pool another chunk owns and frees:
+  // clox --share-constants gives a whole compilation unit one pool.
+  bool borrows_constants;
 } Chunk;
 
+// An instruction after load-time decoding. Run() executes these instead of
+// the bytes in Chunk.code, so operands arrive already widened: constants as
+// pointers into the pool and jumps as absolute targets.
+typedef struct Instruction {
+#ifdef COMPUTED_GOTO
+  void *handler;
+#endif
+  union {
+    Value *constant;
+    struct Instruction *target;
+    struct Trace *trace;
+    int index;
+    struct {
+      int32_t jump; // Of a compare-and-jump, counted from the next one.
+      uint8_t a;
+      uint8_t b;
+      uint8_t c;
+      uint8_t top;
+    } regs;
+  } as;
+  int offset; // Of the instruction's first byte in Chunk.code.
+  uint8_t opcode;
+  // Second operand of superinstructions. OP_LOOP counts its backedges here
+  // until the loop is hot enough to trace, and OP_CLOSURE keeps the distance
+  // from its opcode to its captures.
+  uint16_t arg;
+} Instruction;
+
 void InitChunk(Chunk *chunk);
 
 void FreeChunk(Chunk *chunk);
 
 void WriteChunk(Chunk *chunk, uint8_t byte, int line);
 
+// Drops the code from `count` on, with its line information.
+void TruncateChunk(Chunk *chunk, int count);
+
+// Records that the bytes from `offset` on come from `line`. Offsets must
+// arrive in order.
+void AddLine(Chunk *chunk, int offset, int line);
+
+// The source line of the byte at `offset`, or 0 if the chunk has no line
+// information. Safe to call from a signal handler.
+int GetLine(Chunk *chunk, int offset);
+
+// Drops the chunk's line information.
+void StripLines(Chunk *chunk);
+
 int AddConstant(Chunk *chunk, Value value);
 
+int InstructionLength(Chunk *chunk, int offset);
+
+// Whether `opcode` jumps, in either form, including the fused compare-and-jump
+// superinstructions and register forms.
+bool IsJump(uint8_t opcode);
+
+// The offset the jump at `offset` goes to.
+int JumpTarget(Chunk *chunk, int offset);
+
 #endif // COPY_CLOX_CHUNK_H
@@ -11,4 +11,44 @@
 #include <time.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+
+// Defined in vm.h. Everything that allocates objects or runs code takes one.
+typedef struct VM VM;
+
+#if !defined(NDEBUG) && !defined(DEBUG_PRINT_CODE)
+#define DEBUG_PRINT_CODE
+#endif
+
+// Direct-threaded dispatch needs the labels-as-values extension; build with
+// -DNO_COMPUTED_GOTO to fall back to the portable switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// The baseline JIT emits x86-64 code into mmap'd memory. It is compiled in on
+// x86-64 Linux unless -DNO_JIT is given, and only used when clox runs with
+// --jit.
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+// The event loop natives (setTimeout, read, write, runLoop...) are built on
+// epoll and timerfd, so they are only defined on Linux, and not with
+// -DNO_EVENT_LOOP.
+#if defined(__linux__) && !defined(NO_EVENT_LOOP)
+#define EVENT_LOOP
+#endif
+
+// Build with -DCACHE_TOS to keep the top of the VM stack in a local inside
+// Run() instead of in vm.stack.
+
+// Build with -DNAN_BOXING to pack every Value into 8 bytes inside the payload
+// of a quiet NaN, instead of a 16-byte tagged union.
+
+// -DNO_SUPERINSTRUCTIONS leaves compiled chunks unfused, and -DPROFILE_OPS
+// lets clox --profile-ops count every opcode, pair and triple the VM
+// dispatches, and time them with --profile-cycles. Without it Run() carries
+// no profiling code at all. tools/superinstructions.sh combines the two to
+// pick fusion candidates.
+
 #endif // COPY_CLOX_COMMON_H
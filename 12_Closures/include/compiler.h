@@ -5,6 +5,6 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction *Compile(const char *source);
+ObjFunction *Compile(VM *vm, const char *source);
 
 #endif // COPY_CLOX_COMPILER_H
@@ -3,7 +3,8 @@
 
 #include "chunk.h"
 
-void DisassembleChunk(Chunk* chunk, const char* name);
-int DisassembleInstruction(Chunk* chunk, int offset);
+void DisassembleChunk(VM *vm, Chunk* chunk, const char* name);
+int DisassembleInstruction(VM *vm, Chunk* chunk, int offset);
+const char *OpcodeName(uint8_t opcode);
 
 #endif // COPY_CLOX_DEBUG_H
\ No newline at end of file
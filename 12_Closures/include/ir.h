@@ -0,0 +1,90 @@
+#ifndef COPY_CLOX_IR_H
+#define COPY_CLOX_IR_H
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+// The form the optimizer and the register backend rewrite code in: one Node
+// per instruction, in which a jump names the node it lands on rather than a
+// distance, so code can be deleted and inserted without re-encoding anything.
+// Lift() builds it from a chunk and Lower() lays it out as bytecode again.
+
+typedef struct {
+  uint8_t opcode; // The short form, apart from jumps, which stay wide.
+  int operand; // Index, slot or argument count, or the node a jump lands on.
+  int line;
+  int captures; // Of an OP_CLOSURE, at Ir.captures[captures].
+  bool dead;
+  // The operands of a register form, from EmitRegisterCode(). A
+  // compare-and-jump keeps the node it lands on in `operand`.
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
+  uint8_t top;
+} Node;
+
+typedef struct {
+  Chunk *chunk;
+  int arity;
+  Node *nodes;
+  int count;
+  int capacity;
+  uint8_t *captures; // Each OP_CLOSURE's (is_local, index) pairs.
+  int capture_count;
+  int capture_capacity;
+  // Filled in for the live nodes by Analyze().
+  int *heights; // Of the stack before each node, counting the callee's slot.
+  int *incoming; // Jumps landing on each node.
+  int *first_source; // The lowest and highest node jumping to each node.
+  int *last_source;
+  int max_height;
+} Ir;
+
+static inline bool IsWideJump(uint8_t opcode) {
+  return opcode == OP_JUMP_LONG || opcode == OP_JUMP_IF_FALSE_LONG ||
+         opcode == OP_LOOP_LONG;
+}
+
+static inline bool FallsThrough(Node *node) {
+  return node->opcode != OP_JUMP_LONG && node->opcode != OP_LOOP_LONG &&
+         node->opcode != OP_RETURN;
+}
+
+// The first live node after `index`, or Ir.count.
+static inline int NextLive(Ir *ir, int index) {
+  do {
+    index++;
+  } while (index < ir->count && ir->nodes[index].dead);
+  return index;
+}
+
+static inline int CaptureCount(Ir *ir, Node *node) {
+  return AS_FUNCTION(ir->chunk->constants.values[node->operand])
+      ->upvalue_count;
+}
+
+// An OP_CLOSURE's (is_local, index) pairs, or NULL if it captures nothing.
+static inline uint8_t *CapturePairs(Ir *ir, Node *node) {
+  return node->captures >= 0 ? &ir->captures[node->captures] : NULL;
+}
+
+// `arity` is the function's, to know which slots hold its arguments. The
+// chunk must not have been through RelaxJumps() or the superinstruction pass
+// yet.
+void Lift(Ir *ir, Chunk *chunk, int arity);
+
+// How a node moves the stack height.
+int NodeEffect(Node *node);
+
+// Points jumps at deleted nodes on to the next live one, and works out the
+// stack heights and which jumps land where.
+void Analyze(Ir *ir);
+void FreeAnalysis(Ir *ir);
+
+// Lays the live nodes out as the chunk's new code and line table.
+void Lower(Ir *ir);
+
+void FreeIr(Ir *ir);
+
+#endif // COPY_CLOX_IR_H
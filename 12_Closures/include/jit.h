@@ -0,0 +1,28 @@
+#ifndef COPY_CLOX_JIT_H
+#define COPY_CLOX_JIT_H
+
+#include "common.h"
+#include "object.h"
+#include "trace.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Translates the function's decoded instructions into x86-64 machine code,
+// stored in function->jit_code. Returns false if no executable memory could
+// be mapped.
+bool JitCompile(ObjFunction *function);
+
+// Runs a freshly pushed frame whose function has been compiled, until that
+// frame returns.
+InterpretResult JitRun(VM *vm, CallFrame *frame);
+
+// Compiles a recorded loop iteration into trace->code. Returns false if the
+// trace uses more values than there are registers to hold them.
+bool JitCompileTrace(Trace *trace, TraceStep *steps, int step_count);
+
+void JitFree(ObjFunction *function);
+
+#endif
+
+#endif // COPY_CLOX_JIT_H
@@ -0,0 +1,31 @@
+#ifndef COPY_CLOX_LOOP_H
+#define COPY_CLOX_LOOP_H
+
+#include "common.h"
+#include "vm.h"
+
+#ifdef EVENT_LOOP
+
+// Defines the event loop natives. Their callbacks are Lox functions, run by
+// runLoop() as their events arrive:
+//   setTimeout(fn, ms)  Calls fn() once, `ms` milliseconds from now. Returns
+//                       an id for clearTimeout(id), which cancels it.
+//   read(fd, fn)        Calls fn(data) once, with a string as soon as the file
+//                       descriptor has data, or nil at its end or on an error.
+//   write(fd, data, fn) Writes the string, then calls fn(true), or fn(false) if
+//                       the write failed. `fn` may be nil.
+//   close(fd)           Closes the file descriptor. Its read or write in
+//                       progress never calls back.
+//   pipe(fn)            Calls fn(readFd, writeFd) at once with a new pipe.
+//   socketPair(fn)      Calls fn(fd1, fd2) at once with a connected pair of
+//                       Unix stream sockets.
+//   runLoop()           Runs callbacks until no timer, read or write is left.
+// A file descriptor has at most one read and one write in progress, and is
+// made non-blocking once it has been used by read() or write().
+void DefineLoopNatives(VM *vm);
+
+void FreeLoop(VM *vm);
+
+#endif
+
+#endif // COPY_CLOX_LOOP_H
@@ -19,6 +19,6 @@
 
 void *reallocate(void *pointer, size_t old_size, size_t new_size);
 
-void FreeObjects();
+void FreeObjects(VM *vm);
 
 #endif // COPY_CLOX_MEMORY_H
\ No newline at end of file
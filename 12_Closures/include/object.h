@@ -10,11 +10,13 @@
 #define IS_FUNCTION(value) IsObjType(value, OBJ_FUNCTION)
 #define IS_CLOSURE(value) IsObjType(value, OBJ_CLOSURE)
 #define IS_NATIVE(value) IsObjType(value, OBJ_NATIVE)
+#define IS_FIBER(value) IsObjType(value, OBJ_FIBER)
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
 
 typedef enum {
   OBJ_STRING,
@@ -22,6 +24,7 @@ typedef enum {
   OBJ_CLOSURE,
   OBJ_NATIVE,
   OBJ_UPVALUE,
+  OBJ_FIBER,
 } ObjType;
 
 struct Object {
@@ -34,6 +37,13 @@ typedef struct {
   int arity;
   int upvalue_count;
   Chunk chunk;
+  Instruction *instructions;
+  int instruction_count;
+  int stack_size; // Most values the function's frame holds at once.
+  int call_count;
+  void *jit_code; // Machine code from JitCompile(), or NULL.
+  size_t jit_size;
+  struct Trace *traces; // Compiled loops, linked through Trace.next.
   ObjString *name;
 } ObjFunction;
 
@@ -51,13 +61,37 @@ typedef struct {
   int upvalue_count;
 } ObjClosure;
 
-typedef Value (*NativeFn)(int arg_count, Value *args);
+// Natives store their result in args[-1], the callee's slot, and return true,
+// or report a runtime error and return false.
+typedef bool (*NativeFn)(VM *vm, int arg_count, Value *args);
 
 typedef struct {
   Object obj;
   NativeFn function;
 } ObjNative;
 
+typedef enum {
+  FIBER_SUSPENDED, // Not started yet, or stopped in yield().
+  FIBER_RUNNING,   // Running, or waiting in resume() for another fiber.
+  FIBER_DONE,
+} FiberState;
+
+// A coroutine: a function call with a value stack and frames of its own. The
+// running fiber's stacks live in the VM, which swaps them with these fields
+// on every switch, so the fields are only up to date while it is not running.
+typedef struct ObjFiber {
+  Object obj;
+  struct CallFrame *frames;
+  int frame_count;
+  int frame_capacity;
+  Value *stack;
+  Value *stack_top;
+  int stack_capacity;
+  ObjUpvalue *open_upvalues;
+  struct ObjFiber *caller; // The fiber that resumed this one, while it runs.
+  FiberState state;
+} ObjFiber;
+
 struct ObjString {
   Object object;
   int length;
@@ -65,17 +99,21 @@ struct ObjString {
   uint32_t hash;
 };
 
-ObjFunction *NewFunction();
+ObjFunction *NewFunction(VM *vm);
+
+ObjClosure *NewClosure(VM *vm, ObjFunction* function);
 
-ObjClosure *NewClosure(ObjFunction* function);
+ObjNative *NewNative(VM *vm, NativeFn function);
 
-ObjNative *NewNative(NativeFn function);
+ObjString *GetString(VM *vm, char *chars, int length);
 
-ObjString *GetString(char *chars, int length);
+ObjString *CopyString(VM *vm, const char *chars, int length);
 
-ObjString *CopyString(const char *chars, int length);
+ObjUpvalue *NewUpvalue(VM *vm, Value *slot);
 
-ObjUpvalue *NewUpvalue(Value *slot);
+// A fiber that will call `closure` when first resumed. The main fiber has no
+// closure and no stacks of its own until another fiber runs.
+ObjFiber *NewFiber(VM *vm, ObjClosure *closure);
 
 static inline bool IsObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
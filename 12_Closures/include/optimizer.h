@@ -0,0 +1,13 @@
+#ifndef COPY_CLOX_OPTIMIZER_H
+#define COPY_CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+#include "common.h"
+
+// Rewrites a function's freshly compiled chunk into equivalent, faster code,
+// for clox -O. `arity` is the function's, to know which slots hold its
+// arguments. The chunk must not have been through RelaxJumps() or the
+// superinstruction pass yet: every jump is still wide, and stays so.
+void OptimizeChunk(Chunk *chunk, int arity);
+
+#endif // COPY_CLOX_OPTIMIZER_H
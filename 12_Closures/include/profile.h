@@ -0,0 +1,112 @@
+#ifndef COPY_CLOX_PROFILE_H
+#define COPY_CLOX_PROFILE_H
+
+#include "chunk.h"
+#include "common.h"
+
+#ifdef PROFILE_OPS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define PROFILE_NO_OPCODE OPCODE_COUNT // Before the first instruction of a run.
+#define PROFILE_TOP 20 // Pairs and triples listed in the text report.
+
+// What Run() dispatched for one VM: how often each opcode ran, and each
+// dynamic sequence of two and three opcodes. With `time` set, every dispatch
+// also reads the time stamp counter and charges the cycles since the previous
+// dispatch to that instruction's opcode. Code compiled by the JIT, traces
+// included, runs without dispatching and is not counted.
+typedef struct {
+  uint64_t counts[OPCODE_COUNT + 1];
+  uint64_t cycles[OPCODE_COUNT + 1];
+  uint64_t pairs[OPCODE_COUNT + 1][OPCODE_COUNT + 1];
+  uint64_t triples[OPCODE_COUNT + 1][OPCODE_COUNT + 1][OPCODE_COUNT + 1];
+  uint8_t previous[2]; // The last two opcodes dispatched, latest first.
+  bool time;
+  uint64_t last_tick;
+  uint64_t tick_overhead; // Cycles taken by reading the counter itself.
+  const char *json_path; // NULL to report to stderr as text.
+} OpProfile;
+
+static inline uint64_t ReadTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  // Nanoseconds stand in for cycles elsewhere.
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Called by Run() as it dispatches each instruction.
+static inline void ProfileOp(OpProfile *profile, uint8_t opcode) {
+  uint8_t previous = profile->previous[0];
+  profile->counts[opcode]++;
+  profile->pairs[previous][opcode]++;
+  profile->triples[profile->previous[1]][previous][opcode]++;
+  profile->previous[1] = previous;
+  profile->previous[0] = opcode;
+  if (profile->time) {
+    uint64_t now = ReadTicks();
+    profile->cycles[previous] += now - profile->last_tick;
+    profile->last_tick = now;
+  }
+}
+
+OpProfile *NewOpProfile(bool time, const char *json_path);
+
+// Starts a new sequence, so that a script's first instructions are not
+// counted as following the last ones of the script before.
+void RestartOpProfile(OpProfile *profile);
+
+// Prints every opcode by how often it ran, with its mean cycles if timed,
+// followed by the most frequent pairs and triples. A JSON report lists every
+// pair and triple that ran.
+void ReportOpProfile(OpProfile *profile);
+
+void FreeOpProfile(OpProfile *profile);
+
+// Instructions Run() dispatched per source line, and with `time` set the
+// cycles spent on them, measured like OpProfile's. Lines are those of the
+// one script clox runs, as recorded in Chunk.lines.
+typedef struct {
+  uint64_t *counts; // Indexed by line.
+  uint64_t *cycles;
+  int capacity;
+  bool time;
+  int previous_line;
+  uint64_t last_tick;
+} LineProfile;
+
+void GrowLineProfile(LineProfile *profile, int line);
+
+// Called by Run() as it dispatches an instruction from `line`.
+static inline void ProfileLine(LineProfile *profile, int line) {
+  if (line >= profile->capacity) {
+    GrowLineProfile(profile, line);
+  }
+  profile->counts[line]++;
+  if (profile->time) {
+    uint64_t now = ReadTicks();
+    profile->cycles[profile->previous_line] += now - profile->last_tick;
+    profile->previous_line = line;
+    profile->last_tick = now;
+  }
+}
+
+LineProfile *NewLineProfile(bool time);
+
+// Writes `source` to `path` with every line's instruction count, and share
+// of the cycles if timed, in front of it. Lines that hold code which never
+// ran are marked "#####", like gcov does, and a coverage summary follows.
+void WriteLineProfile(VM *vm, LineProfile *profile, const char *source,
+                      const char *path);
+
+void FreeLineProfile(LineProfile *profile);
+
+#endif
+
+#endif // COPY_CLOX_PROFILE_H
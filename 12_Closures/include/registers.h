@@ -0,0 +1,15 @@
+#ifndef COPY_CLOX_REGISTERS_H
+#define COPY_CLOX_REGISTERS_H
+
+#include "chunk.h"
+#include "common.h"
+
+// Rewrites a function's freshly compiled chunk for clox --registers:
+// arithmetic, comparisons and local moves become register forms that name
+// their operand slots and constants directly, and the rest stays stack code
+// around them. Leaves the chunk alone if its stack is too deep for one-byte
+// registers. The chunk must not have been through RelaxJumps() or the
+// superinstruction pass yet.
+void EmitRegisterCode(Chunk *chunk, int arity);
+
+#endif // COPY_CLOX_REGISTERS_H
@@ -0,0 +1,37 @@
+#ifndef COPY_CLOX_SAMPLER_H
+#define COPY_CLOX_SAMPLER_H
+
+#include "common.h"
+#include "vm.h"
+
+#include <signal.h>
+
+#define SAMPLE_DEFAULT_HZ 1000 // Samples per second of CPU time.
+#define SAMPLE_DEPTH 64 // Innermost frames kept from each sample.
+#define SAMPLE_STACKS 8192 // Distinct stacks kept; a power of two.
+#define SAMPLE_FRAMES 131072 // Frames kept across all distinct stacks.
+
+// Code that changes the frame chain in ways a sample must not see half done,
+// by freeing or swapping the frame arrays, runs between these. Samples that
+// land in between are counted as dropped.
+#define BEGIN_FRAME_CHANGE(vm)                                                 \
+  ((vm)->frames_changing++, __atomic_signal_fence(__ATOMIC_SEQ_CST))
+#define END_FRAME_CHANGE(vm)                                                   \
+  (__atomic_signal_fence(__ATOMIC_SEQ_CST), (vm)->frames_changing--)
+
+// Samples the Lox call stack of `vm` `hz` times a second of CPU time, from a
+// SIGPROF handler. Each sample walks vm->frames and the fibers waiting in
+// resume() below them, recording every function, and for every frame but the
+// innermost the line it is calling from. The innermost frame's ip lives in a
+// register inside Run(), so it is recorded by function alone. Samples are
+// counted per distinct stack in tables allocated up front, so the handler
+// neither allocates nor locks. Only one VM in the process can be sampled at a
+// time. Returns false if the timer could not be set.
+bool StartSampling(VM *vm, int hz);
+
+// Stops sampling and writes what was collected to `path` as folded stacks:
+// one "outer;...;inner count" line per distinct stack, as taken by
+// flamegraph.pl and most flame graph viewers.
+void StopSampling(const char *path);
+
+#endif // COPY_CLOX_SAMPLER_H
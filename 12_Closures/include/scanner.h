@@ -56,8 +56,15 @@ typedef struct {
   int line;
 } Token;
 
-void InitScanner(const char *source);
+// Each compilation scans with its own Scanner, so several can run at once.
+typedef struct {
+  const char *start;
+  const char *current;
+  int line;
+} Scanner;
+
+void InitScanner(Scanner *scanner, const char *source);
 
-Token ScanToken();
+Token ScanToken(Scanner *scanner);
 
 #endif // COPY_CLOX_SCANNER_H
\ No newline at end of file
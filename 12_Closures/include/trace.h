@@ -0,0 +1,44 @@
+#ifndef COPY_CLOX_TRACE_H
+#define COPY_CLOX_TRACE_H
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#define TRACE_MAX 256 // Longest loop body, in instructions, worth tracing.
+
+typedef struct {
+  Instruction *instruction;
+  bool taken; // Whether a branch jumped on the recorded iteration.
+} TraceStep;
+
+// A hot loop compiled from one recorded iteration: the straight-line path
+// from the loop header back to its OP_LOOP, as a list of TraceSteps. Every
+// value the iteration touched was a number, apart from the booleans its
+// branches tested.
+typedef struct Trace {
+  Instruction *header;
+  int entry_height; // Stack slots in use at the header, counted from slots.
+  void *code;
+  size_t code_size;
+  struct Trace *next;
+} Trace;
+
+// Compiled traces run the loop until a guard fails. They write the stack top
+// back through `stack_top` and return the instruction to resume at.
+typedef Instruction *(*TraceCode)(Value *slots, Value **stack_top,
+                                  Value *globals);
+
+// Called by Run() when `loop` turns hot, with the frame's ip at the loop
+// header. Executes and records one iteration, then tries to compile it. The
+// frame and vm->stack_top are left wherever recording stopped: back at `loop`
+// if it succeeded. Returns NULL if the loop cannot be traced.
+Trace *RecordTrace(VM *vm, CallFrame *frame, Instruction *loop);
+
+void FreeTraces(ObjFunction *function);
+
+#endif
+
+#endif // COPY_CLOX_TRACE_H
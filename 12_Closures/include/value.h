@@ -3,17 +3,66 @@
 
 #include "common.h"
 
+typedef struct Object Object;
+
+typedef struct ObjString ObjString;
+
+#ifdef NAN_BOXING
+
+// A Value is a 64-bit double. Every other type is packed into the payload of
+// a quiet NaN: singletons as small tags, objects as a pointer with the sign
+// bit set.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NULL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4 // Marks a global slot that has no definition yet.
+
+typedef uint64_t Value;
+
+#define IS_NULL(value) ((value) == NULL_VAL)
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define ARE_NUMBERS(a, b) (IS_NUMBER(a) && IS_NUMBER(b))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) ValueToNum(value)
+#define AS_OBJ(value) ((Object *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define NULL_VAL ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(num) NumToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+static inline double ValueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value NumToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_NULL,
   VAL_BOOL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_UNDEFINED, // Marks a global slot that has no definition yet.
 } ValueType;
 
-typedef struct Object Object;
-
-typedef struct ObjString ObjString;
-
 typedef struct {
   ValueType type;
   union {
@@ -27,6 +76,9 @@ typedef struct {
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define ARE_NUMBERS(a, b)                                                      \
+  ((((a).type ^ VAL_NUMBER) | ((b).type ^ VAL_NUMBER)) == 0)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -36,6 +88,9 @@ typedef struct {
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(obj) ((Value){VAL_OBJ, {.object = (Object *)obj}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
 
 typedef struct {
   int capacity;
@@ -4,31 +4,66 @@
 #include "chunk.h"
 #include "common.h"
 #include "object.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
+#include <signal.h>
 #include <stdint.h>
 
-#define FRAME_MAX 64
-#define STACK_MAX (FRAME_MAX * UINT8_COUNT)
+#define FRAME_MAX 10000 // Default call depth limit; see VM.frame_max.
+#define TRACE_FRAMES 10 // Frames a stack trace prints from each end.
+#define STACK_INITIAL 256
+#define FIBER_STACK_INITIAL 16
+#define JIT_THRESHOLD 100
+#define TRACE_THRESHOLD 50
 
-typedef struct {
+typedef struct CallFrame {
   ObjClosure *closure;
-  uint8_t *ip;
+  Instruction *ip;
   Value *slots;
 } CallFrame;
 
-typedef struct {
-  Chunk *chunk;
-  uint8_t *ip;
-  CallFrame frames[FRAME_MAX];
+// All of one interpreter's state. Separate VMs share nothing, so each can
+// run on a thread of its own; objects belong to the VM that made them.
+struct VM {
+  // The running fiber's stacks. Both start small and grow as calls need them,
+  // so nothing may hold a pointer into either across a call.
+  CallFrame *frames;
   int frame_count;
-  Value stack[STACK_MAX];
+  int frame_capacity;
+  int frame_max; // A call any deeper is a stack overflow.
+  // Nonzero while the frame arrays are being swapped or moved; see
+  // BEGIN_FRAME_CHANGE() in sampler.h.
+  volatile sig_atomic_t frames_changing;
+  Value *stack;
   Value *stack_top;
+  int stack_capacity;
   Table strings;
-  Table globals;
+  Table global_slots; // Name -> index into global_values.
+  ValueArray global_values;
+  ValueArray global_names;
   ObjUpvalue* open_upvalues;
+  ObjFiber *fiber; // The running one; the fields above are its stacks.
+  ObjFiber *spare_fiber; // Kept by RunCallback() for the next callback.
   Object *objects;
-} VM;
+  bool jit_enabled;
+  int jit_threshold; // Calls before a function is compiled to machine code.
+  int trace_threshold; // Backedges before a loop is traced.
+  bool strip_lines; // Compile without line information, to save memory.
+  bool share_constants; // One constant pool per script, not per function.
+  bool optimize; // Run the optimizer over each compiled function (-O).
+  bool register_code; // Compile to register forms (--registers).
+#ifdef PROFILE_OPS
+  OpProfile *profile; // NULL unless clox runs with --profile-ops.
+  LineProfile *line_profile; // NULL unless clox runs with --line-profile.
+#endif
+#ifdef EVENT_LOOP
+  struct EventLoop *loop; // Made by the first native that needs it.
+#endif
+#ifdef COMPUTED_GOTO
+  void **handlers; // Run()'s dispatch table, for DecodeFunction().
+#endif
+};
 
 typedef enum {
   INTERPRET_OK,
@@ -36,12 +71,37 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+// Returned by nested Run() and JitRun() calls, never by Interpret(), when a
+// fiber switch has suspended the frames they were running. They unwind to the
+// outermost Run(), which carries on in the new fiber; the suspended frames
+// are interpreted from their saved ip when their fiber is resumed.
+#define INTERPRET_SWITCHED (INTERPRET_RUNTIME_ERROR + 1)
 
-void InitVM();
-void FreeVM();
-InterpretResult Interpret(const char *source);
-void Push(Value value);
-Value Pop();
+void InitVM(VM *vm);
+void FreeVM(VM *vm);
+InterpretResult Interpret(VM *vm, const char *source);
+int GlobalSlot(VM *vm, ObjString *name);
+void DefineNative(VM *vm, const char *name, NativeFn function);
+void Push(VM *vm, Value value);
+Value Pop(VM *vm);
+
+// The interpreter's calling convention, shared with the JIT.
+bool CallValue(VM *vm, Value callee, int arg_count);
+// Replaces the topmost frame with a call to the closure below the top
+// `arg_count` values, for `return f(...)`. Returns false, with nothing done,
+// unless the callee is a closure taking exactly that many arguments.
+bool TailCall(VM *vm, int arg_count);
+InterpretResult Run(VM *vm, int exit_depth);
+void RuntimeError(VM *vm, const char *format, ...);
+void Concatenate(VM *vm);
+ObjUpvalue *CaptureUpvalue(VM *vm, Value *local);
+void CloseUpvalues(VM *vm, Value *last);
+// Ends the running fiber, whose function has returned `result`, and goes back
+// to the fiber that resumed it.
+void FinishFiber(VM *vm, Value result);
+// Calls `closure` from a native and runs it to completion, in a fiber of its
+// own: it can resume other fibers but not yield. Returns false after a
+// runtime error, which also ends the fiber that called the native.
+bool RunCallback(VM *vm, ObjClosure *closure, int arg_count, Value *args);
 
 #endif // COPY_CLOX_VM_H
@@ -1,11 +1,14 @@
+#include "batch.h"
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "sampler.h"
 #include "vm.h"
+#include <limits.h>
 
 #define REPL_MAX 1024
 
-static void Repl() {
+static void Repl(VM *vm) {
   char line[REPL_MAX];
   while (true) {
     printf("> ");
@@ -13,7 +16,7 @@ static void Repl() {
       printf("\n");
       break;
     }
-    Interpret(line);
+    Interpret(vm, line);
   }
 }
 
@@ -41,26 +44,178 @@ static char *ReadFile(const char *path) {
   return buffer;
 }
 
-static void RunFile(const char *path) {
+static int RunFile(VM *vm, const char *path) {
   char *source = ReadFile(path);
-  InterpretResult result = Interpret(source);
+  InterpretResult result = Interpret(vm, source);
   free(source);
   if (result == INTERPRET_COMPILE_ERROR)
-    exit(65);
+    return 65;
   if (result == INTERPRET_RUNTIME_ERROR)
-    exit(70);
+    return 70;
+  return 0;
+}
+
+static void Usage() {
+  fprintf(stderr, "Usage: clox [--jit | --no-jit] [--jit-threshold=N]\n"
+                  "            [--trace-threshold=N] [--max-depth=N]\n"
+                  "            [--strip-lines] [--share-constants] [-O]"
+                  " [--registers]\n"
+                  "            [--profile-ops[=file.json]] [--profile-cycles]\n"
+                  "            [--line-profile[=file]] [--line-cycles]\n"
+                  "            [--sample=file.folded] [--sample-hz=N]\n"
+                  "            [path | --batch dir [-j N] [--timeout=S]]\n");
+  exit(64);
+}
+
+// Reads the number of an option that counts something: a whole number from 1
+// to `max`.
+static int ParseCount(const char *text, int max) {
+  char *end;
+  long count = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || count < 1 || count > max) {
+    Usage();
+  }
+  return (int)count;
 }
 
 int main(int argc, const char *argv[]) {
-  InitVM();
-  if (argc == 1) {
-    Repl();
-  } else if (argc == 2) {
-    RunFile(argv[1]);
+  VM vm;
+  InitVM(&vm);
+  const char *path = NULL;
+  const char *batch_dir = NULL;
+  int jobs = 0;
+  double timeout = BATCH_DEFAULT_TIMEOUT;
+#ifdef PROFILE_OPS
+  bool profile_ops = false;
+  bool profile_cycles = false;
+  const char *profile_json = NULL;
+  bool line_profile = false;
+  bool line_cycles = false;
+  const char *line_profile_path = NULL;
+#endif
+  const char *sample_path = NULL;
+  int sample_hz = SAMPLE_DEFAULT_HZ;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--jit") == 0) {
+      vm.jit_enabled = true;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      vm.jit_enabled = false;
+    } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+      vm.jit_threshold = ParseCount(argv[i] + 16, INT_MAX);
+    } else if (strncmp(argv[i], "--trace-threshold=", 18) == 0) {
+      // Loops count their backedges in a uint16_t.
+      vm.trace_threshold = ParseCount(argv[i] + 18, UINT16_MAX);
+    } else if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+      vm.frame_max = ParseCount(argv[i] + 12, INT_MAX);
+    } else if (strcmp(argv[i], "--strip-lines") == 0) {
+      vm.strip_lines = true;
+    } else if (strcmp(argv[i], "--share-constants") == 0) {
+      vm.share_constants = true;
+    } else if (strcmp(argv[i], "-O") == 0) {
+      vm.optimize = true;
+    } else if (strcmp(argv[i], "--registers") == 0) {
+      vm.register_code = true;
+#ifdef PROFILE_OPS
+    } else if (strcmp(argv[i], "--profile-ops") == 0) {
+      profile_ops = true;
+    } else if (strncmp(argv[i], "--profile-ops=", 14) == 0) {
+      profile_ops = true;
+      profile_json = argv[i] + 14;
+    } else if (strcmp(argv[i], "--profile-cycles") == 0) {
+      profile_ops = true;
+      profile_cycles = true;
+    } else if (strcmp(argv[i], "--line-profile") == 0) {
+      line_profile = true;
+    } else if (strncmp(argv[i], "--line-profile=", 15) == 0) {
+      line_profile = true;
+      line_profile_path = argv[i] + 15;
+    } else if (strcmp(argv[i], "--line-cycles") == 0) {
+      line_profile = true;
+      line_cycles = true;
+#else
+    } else if (strncmp(argv[i], "--profile-", 10) == 0 ||
+               strncmp(argv[i], "--line-", 7) == 0) {
+      fprintf(stderr, "clox: this build has no profilers; "
+                      "rebuild with -DPROFILE_OPS.\n");
+      exit(64);
+#endif
+    } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+      sample_path = argv[i] + 9;
+    } else if (strncmp(argv[i], "--sample-hz=", 12) == 0) {
+      sample_hz = atoi(argv[i] + 12);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_dir = argv[++i];
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      jobs = ParseCount(argv[++i], INT_MAX);
+    } else if (strncmp(argv[i], "-j", 2) == 0) {
+      jobs = ParseCount(argv[i] + 2, INT_MAX);
+    } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+      timeout = atof(argv[i] + 10);
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      Usage();
+    }
+  }
+  if (batch_dir != NULL && (path != NULL || sample_path != NULL)) {
+    Usage();
+  }
+#ifdef PROFILE_OPS
+  if (line_profile && (path == NULL || vm.strip_lines)) {
+    Usage();
+  }
+#endif
+#ifndef JIT
+  if (vm.jit_enabled) {
+    fprintf(stderr, "clox: this build has no JIT; interpreting instead.\n");
+    vm.jit_enabled = false;
+  }
+#endif
+  if (vm.jit_enabled && vm.register_code) {
+    fprintf(stderr, "clox: the JIT runs stack code only; interpreting the "
+                    "register code instead.\n");
+    vm.jit_enabled = false;
+  }
+#ifdef PROFILE_OPS
+  if (profile_ops) {
+    vm.profile = NewOpProfile(profile_cycles, profile_json);
+  }
+  if (line_profile) {
+    vm.line_profile = NewLineProfile(line_cycles);
+  }
+#endif
+  if (batch_dir != NULL) {
+    int status = RunBatch(&vm, batch_dir, jobs, timeout, RunFile);
+    FreeVM(&vm);
+    return status;
+  }
+  if (sample_path != NULL && !StartSampling(&vm, sample_hz)) {
+    sample_path = NULL;
+  }
+  int status = 0;
+  if (path == NULL) {
+    Repl(&vm);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    status = RunFile(&vm, path);
   }
-  FreeVM();
-  return 0;
+#ifdef PROFILE_OPS
+  if (vm.line_profile != NULL) {
+    char *out_path = NULL;
+    if (line_profile_path == NULL) {
+      size_t size = strlen(path) + sizeof(".lines");
+      out_path = (char *)malloc(size);
+      snprintf(out_path, size, "%s.lines", path);
+    }
+    char *source = ReadFile(path);
+    WriteLineProfile(&vm, vm.line_profile, source,
+                     out_path != NULL ? out_path : line_profile_path);
+    free(source);
+    free(out_path);
+  }
+#endif
+  if (sample_path != NULL) {
+    StopSampling(sample_path);
+  }
+  FreeVM(&vm);
+  return status;
 }
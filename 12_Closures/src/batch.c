@@ -0,0 +1,298 @@
+#include "batch.h"
+#include "common.h"
+#include "memory.h"
+#include "vm.h"
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The parent lists the scripts and forks the workers, which inherit its
+// initialized VM. The work queue is a counter in shared memory: a worker
+// claims a script by incrementing it. To run the script the worker forks
+// again, so the child starts from the worker's untouched copy of the VM, with
+// its stdout and stderr appended to the worker's output file and a real-time
+// interval timer as its deadline. The worker records how the child ended in
+// shared memory, and the parent reports once every worker has exited.
+
+typedef enum {
+  JOB_NOT_RUN, // Its worker could not fork.
+  JOB_EXITED,
+  JOB_TIMED_OUT,
+  JOB_KILLED,
+} JobState;
+
+typedef struct {
+  JobState state;
+  int status; // The exit status, or the signal that killed the script.
+  double seconds;
+  int worker; // Whose output file holds the output, between these offsets.
+  off_t output_start;
+  off_t output_end;
+} JobResult;
+
+typedef struct {
+  int next_job;
+  JobResult results[];
+} SharedState;
+
+static double Now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static int ComparePaths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static char **ListScripts(const char *dir, int *count) {
+  DIR *directory = opendir(dir);
+  if (directory == NULL) {
+    fprintf(stderr, "Could not open directory \"%s\".\n", dir);
+    exit(74);
+  }
+  char **paths = NULL;
+  int capacity = 0;
+  *count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL) {
+    size_t length = strlen(entry->d_name);
+    if (length <= 4 || strcmp(entry->d_name + length - 4, ".lox") != 0) {
+      continue;
+    }
+    size_t size = strlen(dir) + 1 + length + 1;
+    char *path = ALLOCATE(char, size);
+    snprintf(path, size, "%s/%s", dir, entry->d_name);
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+      FREE_ARRAY(char, path, size);
+      continue;
+    }
+    if (capacity < *count + 1) {
+      int old_capacity = capacity;
+      capacity = GROW_CAPACITY(old_capacity);
+      paths = GROW_ARRAY(char *, paths, old_capacity, capacity);
+    }
+    paths[(*count)++] = path;
+  }
+  closedir(directory);
+  if (*count > 0) {
+    qsort(paths, *count, sizeof(char *), ComparePaths);
+  }
+  return paths;
+}
+
+static void RunJob(VM *vm, BatchRunFn run, const char *path, double timeout,
+                   int output, JobResult *result) {
+  result->output_start = lseek(output, 0, SEEK_END);
+  double start = Now();
+  pid_t child = fork();
+  if (child == 0) {
+    dup2(output, STDOUT_FILENO);
+    dup2(output, STDERR_FILENO);
+    // Keep what a script printed before it was killed.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (timeout > 0) {
+      struct itimerval deadline = {0};
+      deadline.it_value.tv_sec = (time_t)timeout;
+      deadline.it_value.tv_usec =
+          (suseconds_t)((timeout - (double)(time_t)timeout) * 1e6);
+      if (deadline.it_value.tv_sec == 0 && deadline.it_value.tv_usec == 0) {
+        deadline.it_value.tv_usec = 1;
+      }
+      setitimer(ITIMER_REAL, &deadline, NULL);
+    }
+    int status = run(vm, path);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+  }
+  int status;
+  if (child < 0 || waitpid(child, &status, 0) < 0) {
+    result->state = JOB_NOT_RUN;
+    return;
+  }
+  result->seconds = Now() - start;
+  result->output_end = lseek(output, 0, SEEK_END);
+  if (WIFEXITED(status)) {
+    result->state = JOB_EXITED;
+    result->status = WEXITSTATUS(status);
+  } else if (WTERMSIG(status) == SIGALRM) {
+    result->state = JOB_TIMED_OUT;
+  } else {
+    result->state = JOB_KILLED;
+    result->status = WTERMSIG(status);
+  }
+}
+
+static void Work(VM *vm, BatchRunFn run, char **paths, int count,
+                 double timeout, int worker, int output,
+                 SharedState *shared) {
+  while (true) {
+    int job = __atomic_fetch_add(&shared->next_job, 1, __ATOMIC_RELAXED);
+    if (job >= count) {
+      break;
+    }
+    shared->results[job].worker = worker;
+    RunJob(vm, run, paths[job], timeout, output, &shared->results[job]);
+  }
+  // Skip the parent's exit handlers and stdio buffers.
+  _exit(0);
+}
+
+static void CopyOutput(FILE *output, off_t start, off_t end) {
+  char buffer[4096];
+  while (start < end) {
+    size_t size = sizeof(buffer);
+    if ((off_t)size > end - start) {
+      size = (size_t)(end - start);
+    }
+    ssize_t bytes_read = pread(fileno(output), buffer, size, start);
+    if (bytes_read <= 0) {
+      break;
+    }
+    fwrite(buffer, 1, (size_t)bytes_read, stdout);
+    start += bytes_read;
+  }
+}
+
+// Prints one script's result and output. Returns whether it succeeded.
+static bool ReportJob(const char *path, JobResult *result, FILE **outputs) {
+  char status[64];
+  switch (result->state) {
+  case JOB_NOT_RUN:
+    printf("== %s: not run\n", path);
+    return false;
+  case JOB_EXITED:
+    if (result->status == 0) {
+      snprintf(status, sizeof(status), "ok");
+    } else if (result->status == 65) {
+      snprintf(status, sizeof(status), "compile error");
+    } else if (result->status == 70) {
+      snprintf(status, sizeof(status), "runtime error");
+    } else {
+      snprintf(status, sizeof(status), "exit %d", result->status);
+    }
+    break;
+  case JOB_TIMED_OUT:
+    snprintf(status, sizeof(status), "timed out");
+    break;
+  case JOB_KILLED:
+    snprintf(status, sizeof(status), "killed by signal %d", result->status);
+    break;
+  }
+  printf("== %s: %s (%.4fs)\n", path, status, result->seconds);
+  CopyOutput(outputs[result->worker], result->output_start,
+             result->output_end);
+  return result->state == JOB_EXITED && result->status == 0;
+}
+
+static void ReportStatistics(char **paths, int count, JobResult *results,
+                             int jobs, double wall) {
+  int ok = 0, failed = 0, timed_out = 0, not_run = 0;
+  double busy = 0, slowest = 0;
+  int slowest_job = -1;
+  for (int job = 0; job < count; job++) {
+    JobResult *result = &results[job];
+    if (result->state == JOB_NOT_RUN) {
+      not_run++;
+      continue;
+    }
+    if (result->state == JOB_TIMED_OUT) {
+      timed_out++;
+    } else if (result->state == JOB_EXITED && result->status == 0) {
+      ok++;
+    } else {
+      failed++;
+    }
+    busy += result->seconds;
+    if (result->seconds > slowest) {
+      slowest = result->seconds;
+      slowest_job = job;
+    }
+  }
+  int run = count - not_run;
+  printf("\n%d scripts: %d ok, %d failed, %d timed out, %d not run\n", count,
+         ok, failed, timed_out, not_run);
+  printf("%.3fs on %d workers: %.1f scripts/s, workers busy %.0f%%\n", wall,
+         jobs, wall > 0 ? run / wall : 0,
+         wall > 0 && jobs > 0 ? 100 * busy / (wall * jobs) : 0);
+  if (slowest_job != -1) {
+    printf("Per script: mean %.4fs, max %.4fs (%s)\n", busy / run, slowest,
+           paths[slowest_job]);
+  }
+}
+
+int RunBatch(VM *vm, const char *dir, int jobs, double timeout,
+             BatchRunFn run) {
+  int count;
+  char **paths = ListScripts(dir, &count);
+  if (count == 0) {
+    fprintf(stderr, "No .lox files in \"%s\".\n", dir);
+    return 0;
+  }
+  if (jobs <= 0) {
+    jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (jobs > count) {
+    jobs = count;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  size_t shared_size = sizeof(SharedState) + sizeof(JobResult) * count;
+  SharedState *shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    fprintf(stderr, "Not enough memory to run a batch.\n");
+    exit(74);
+  }
+  FILE **outputs = ALLOCATE(FILE *, jobs);
+  fflush(stdout);
+  fflush(stderr);
+  double start = Now();
+  int workers = 0;
+  for (; workers < jobs; workers++) {
+    outputs[workers] = tmpfile();
+    if (outputs[workers] == NULL) {
+      fprintf(stderr, "Could not create an output file for a worker.\n");
+      break;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      Work(vm, run, paths, count, timeout, workers, fileno(outputs[workers]),
+           shared);
+    }
+    if (pid < 0) {
+      fprintf(stderr, "Could not fork a batch worker.\n");
+      fclose(outputs[workers]);
+      break;
+    }
+  }
+  while (wait(NULL) > 0) {
+  }
+  double wall = Now() - start;
+
+  bool all_ok = true;
+  for (int job = 0; job < count; job++) {
+    all_ok &= ReportJob(paths[job], &shared->results[job], outputs);
+  }
+  ReportStatistics(paths, count, shared->results, workers, wall);
+
+  for (int i = 0; i < workers; i++) {
+    fclose(outputs[i]);
+  }
+  FREE_ARRAY(FILE *, outputs, jobs);
+  munmap(shared, shared_size);
+  for (int job = 0; job < count; job++) {
+    FREE_ARRAY(char, paths[job], strlen(paths[job]) + 1);
+  }
+  FREE_ARRAY(char *, paths, count);
+  return all_ok ? 0 : 70;
+}
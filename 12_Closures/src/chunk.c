@@ -1,36 +1,190 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 
 void InitChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
   InitValueArray(&chunk->constants);
+  chunk->borrows_constants = false;
 }
 
 void FreeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  FreeValueArray(&chunk->constants);
+  FREE_ARRAY(LineRun, chunk->lines, chunk->line_capacity);
+  if (!chunk->borrows_constants) {
+    FreeValueArray(&chunk->constants);
+  }
   InitChunk(chunk);
 }
 
 void WriteChunk(Chunk *chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
-    int old_apacity = chunk->capacity;
-    chunk->capacity = GROW_CAPACITY(old_apacity);
+    int old_capacity = chunk->capacity;
+    chunk->capacity = GROW_CAPACITY(old_capacity);
     chunk->code =
-        GROW_ARRAY(uint8_t, chunk->code, old_apacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, old_apacity, chunk->capacity);
+        GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
   }
 
+  AddLine(chunk, chunk->count, line);
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
 }
 
+void TruncateChunk(Chunk *chunk, int count) {
+  chunk->count = count;
+  while (chunk->line_count > 0 &&
+         chunk->lines[chunk->line_count - 1].offset >= count) {
+    chunk->line_count--;
+  }
+}
+
+void AddLine(Chunk *chunk, int offset, int line) {
+  if (chunk->line_count > 0 &&
+      chunk->lines[chunk->line_count - 1].line == line) {
+    return;
+  }
+  if (chunk->line_capacity < chunk->line_count + 1) {
+    int old_capacity = chunk->line_capacity;
+    chunk->line_capacity = GROW_CAPACITY(old_capacity);
+    chunk->lines = GROW_ARRAY(LineRun, chunk->lines, old_capacity,
+                              chunk->line_capacity);
+  }
+  chunk->lines[chunk->line_count].offset = offset;
+  chunk->lines[chunk->line_count].line = line;
+  chunk->line_count++;
+}
+
+int GetLine(Chunk *chunk, int offset) {
+  // Find the last run starting at or before `offset`.
+  int low = 0;
+  int high = chunk->line_count - 1;
+  int line = 0;
+  while (low <= high) {
+    int middle = low + (high - low) / 2;
+    if (chunk->lines[middle].offset <= offset) {
+      line = chunk->lines[middle].line;
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return line;
+}
+
+void StripLines(Chunk *chunk) {
+  FREE_ARRAY(LineRun, chunk->lines, chunk->line_capacity);
+  chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
+}
+
 int AddConstant(Chunk *chunk, Value value) {
   WriteValueArray(&chunk->constants, value);
   return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int InstructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_SET_LOCAL_POP:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_DEFINE_GLOBAL_SLOT:
+  case OP_GET_GLOBAL_SLOT:
+  case OP_SET_GLOBAL_SLOT:
+  case OP_GET_LOCAL_GET_LOCAL:
+  case OP_GET_LOCAL_CONSTANT:
+  case OP_INCREMENT_LOCAL:
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+    return 3;
+  case OP_CONSTANT_LONG:
+  case OP_DEFINE_GLOBAL_SLOT_LONG:
+  case OP_GET_GLOBAL_SLOT_LONG:
+  case OP_SET_GLOBAL_SLOT_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL_LONG:
+  case OP_JUMP_LONG:
+  case OP_JUMP_IF_FALSE_LONG:
+  case OP_LOOP_LONG:
+  case OP_MOVE:
+  case OP_NEGATE_R:
+  case OP_NOT_R:
+    return 4;
+  case OP_EQUAL_R:
+  case OP_GREATER_R:
+  case OP_LESS_R:
+  case OP_ADD_R:
+  case OP_SUBTRACT_R:
+  case OP_MULTIPLY_R:
+  case OP_DIVIDE_R:
+    return 5;
+  case OP_EQUAL_JUMP_R:
+  case OP_GREATER_JUMP_R:
+  case OP_LESS_JUMP_R:
+    return 8;
+  case OP_CLOSURE: {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + function->upvalue_count * 2;
+  }
+  case OP_CLOSURE_LONG: {
+    int constant = ReadWideOperand(&chunk->code[offset + 1]);
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    return 4 + function->upvalue_count * 2;
+  }
+  default:
+    return 1;
+  }
+}
+
+bool IsJump(uint8_t opcode) {
+  switch (opcode) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+  case OP_JUMP_LONG:
+  case OP_JUMP_IF_FALSE_LONG:
+  case OP_LOOP_LONG:
+  case OP_EQUAL_JUMP_R:
+  case OP_GREATER_JUMP_R:
+  case OP_LESS_JUMP_R:
+    return true;
+  default:
+    return false;
+  }
+}
+
+int JumpTarget(Chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_LOOP:
+    return offset + 3 - ((code[1] << 8) | code[2]);
+  case OP_JUMP_LONG:
+  case OP_JUMP_IF_FALSE_LONG:
+    return offset + 4 + ReadWideOperand(&code[1]);
+  case OP_LOOP_LONG:
+    return offset + 4 - ReadWideOperand(&code[1]);
+  case OP_EQUAL_JUMP_R:
+  case OP_GREATER_JUMP_R:
+  case OP_LESS_JUMP_R:
+    return offset + 8 + ReadWideOperand(&code[5]);
+  default:
+    return offset + 3 + ((code[1] << 8) | code[2]);
+  }
+}
@@ -1,16 +1,13 @@
 #include "compiler.h"
 #include "common.h"
 #include "debug.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
+#include "registers.h"
 #include "scanner.h"
 #include "value.h"
 
-typedef struct {
-  Token current;
-  Token previous;
-  bool had_error;
-  bool panic_mode;
-} Parser;
 
 typedef struct {
   Token name;
@@ -28,14 +25,44 @@ typedef enum {
   TYPE_SCRIPT,
 } FunctionType;
 
+// Maps each value in a constant pool to its index, so a literal used many
+// times takes one slot. Strings are interned, so they match by identity, and
+// numbers match by their bits, which keeps 0 and -0 apart.
+typedef struct {
+  Value key;
+  int index; // -1 for an empty entry.
+} ConstantEntry;
+
+typedef struct {
+  ConstantEntry *entries;
+  int count;
+  int capacity;
+} ConstantMap;
+
+// A constant the compiler has just loaded onto the stack, with OP_CONSTANT,
+// OP_TRUE, OP_FALSE or OP_NULL. Operators whose operands are all such loads
+// are folded into one.
+typedef struct {
+  int start; // Of the load's code.
+  int end;
+  Value value;
+} ConstantLoad;
+
 typedef struct Compiler {
   struct Compiler *enclosing;
   ObjFunction *function;
   FunctionType type;
-  Local locals[UINT8_COUNT];
+  Local *locals; // Grown as needed, up to UINT24_MAX + 1 of them.
   int local_count;
+  int local_capacity;
   Upvalue upvalues[UINT8_COUNT];
+  ConstantMap constants; // Of this function's chunk, if it owns its pool.
   int scope_depth;
+  int last_call; // Offset of the latest OP_CALL, to spot tail calls.
+  ConstantLoad *loads; // The latest run of back-to-back constant loads.
+  int load_count;
+  int load_capacity;
+  int last_target; // The furthest offset a forward jump has been patched to.
 } Compiler;
 
 typedef enum {
@@ -52,7 +79,19 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool can_assign);
+// Everything one compilation works on. Compile() keeps it in a local, so
+// any number of compilations can run at once.
+typedef struct {
+  VM *vm; // Owns the functions and strings the compiler creates.
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool had_error;
+  bool panic_mode;
+  Compiler *compiler; // Of the innermost function being compiled.
+} Parser;
+
+typedef void (*ParseFn)(Parser *parser, bool can_assign);
 
 typedef struct {
   ParseFn prefix;
@@ -60,21 +99,21 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
-static void Grouping(bool can_assign);
-static void Unary(bool can_assign);
-static void Number(bool can_assign);
-static void String(bool can_assign);
-static void Literal(bool can_assign);
-static void Binary(bool can_assign);
-static void Call(bool can_assign);
-static void Variable(bool can_assign);
-static void And_(bool can_assign);
-static void Or_(bool can_assign);
-static void ParsePrecedence(Precedence precedence);
-static void Declaration();
-static void VarDeclaration();
-static void Statement();
-static void DefineVariable(uint8_t global);
+static void Grouping(Parser *parser, bool can_assign);
+static void Unary(Parser *parser, bool can_assign);
+static void Number(Parser *parser, bool can_assign);
+static void String(Parser *parser, bool can_assign);
+static void Literal(Parser *parser, bool can_assign);
+static void Binary(Parser *parser, bool can_assign);
+static void Call(Parser *parser, bool can_assign);
+static void Variable(Parser *parser, bool can_assign);
+static void And_(Parser *parser, bool can_assign);
+static void Or_(Parser *parser, bool can_assign);
+static void ParsePrecedence(Parser *parser, Precedence precedence);
+static void Declaration(Parser *parser);
+static void VarDeclaration(Parser *parser);
+static void Statement(Parser *parser);
+static void DefineVariable(Parser *parser, int global);
 
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {Grouping, Call, PREC_CALL},
@@ -121,35 +160,56 @@ ParseRule rules[] = {
 
 static ParseRule *GetRule(TokenType type) { return &rules[type]; }
 
-Parser parser;
-Compiler *current = NULL;
-Chunk *compiling_chunk;
+static Local *PushLocal(Compiler *compiler) {
+  if (compiler->local_capacity < compiler->local_count + 1) {
+    int old_capacity = compiler->local_capacity;
+    compiler->local_capacity = GROW_CAPACITY(old_capacity);
+    compiler->locals = GROW_ARRAY(Local, compiler->locals, old_capacity,
+                                  compiler->local_capacity);
+  }
+  return &compiler->locals[compiler->local_count++];
+}
 
-static void InitCompiler(Compiler *compiler, FunctionType type) {
-  compiler->enclosing = current;
+static void InitCompiler(Parser *parser, Compiler *compiler,
+                         FunctionType type) {
+  compiler->enclosing = parser->compiler;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->local_count = 0;
+  compiler->local_capacity = 0;
+  compiler->constants.entries = NULL;
+  compiler->constants.count = 0;
+  compiler->constants.capacity = 0;
   compiler->scope_depth = 0;
-  compiler->function = NewFunction();
-  current = compiler;
+  compiler->last_call = -1;
+  compiler->loads = NULL;
+  compiler->load_count = 0;
+  compiler->load_capacity = 0;
+  compiler->last_target = 0;
+  compiler->function = NewFunction(parser->vm);
+  compiler->function->chunk.borrows_constants =
+      parser->vm->share_constants && type != TYPE_SCRIPT;
+  parser->compiler = compiler;
   if (type != TYPE_SCRIPT) {
-    current->function->name =
-        CopyString(parser.previous.start, parser.previous.length);
+    compiler->function->name = CopyString(parser->vm, parser->previous.start,
+                                          parser->previous.length);
   }
-  Local *local = &current->locals[current->local_count++];
+  Local *local = PushLocal(compiler);
   local->depth = 0;
   local->is_captured = false;
   local->name.start = "";
   local->name.length = 0;
 }
 
-static Chunk *CurrentChunk() { return &current->function->chunk; }
+static Chunk *CurrentChunk(Parser *parser) {
+  return &parser->compiler->function->chunk;
+}
 
-static void ErrorAt(Token *token, const char *message) {
-  if (parser.panic_mode)
+static void ErrorAt(Parser *parser, Token *token, const char *message) {
+  if (parser->panic_mode)
     return;
-  parser.panic_mode = true;
+  parser->panic_mode = true;
   fprintf(stderr, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
@@ -161,92 +221,400 @@ static void ErrorAt(Token *token, const char *message) {
   }
 
   fprintf(stderr, ": %s\n", message);
-  parser.had_error = true;
+  parser->had_error = true;
 }
 
-static void Error(const char *message) { ErrorAt(&parser.previous, message); }
+static void Error(Parser *parser, const char *message) {
+  ErrorAt(parser, &parser->previous, message);
+}
 
-static void ErrorAtCurrent(const char *message) {
-  ErrorAt(&parser.current, message);
+static void ErrorAtCurrent(Parser *parser, const char *message) {
+  ErrorAt(parser, &parser->current, message);
 }
 
-static void Advance() {
-  parser.previous = parser.current;
+static void Advance(Parser *parser) {
+  parser->previous = parser->current;
 
   while (true) {
-    parser.current = ScanToken();
-    if (parser.current.type != TOKEN_ERROR)
+    parser->current = ScanToken(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR)
       break;
 
-    ErrorAtCurrent(parser.current.start);
+    ErrorAtCurrent(parser, parser->current.start);
   }
 }
 
-static void Consume(TokenType type, const char *message) {
-  if (parser.current.type == type) {
-    Advance();
+static void Consume(Parser *parser, TokenType type, const char *message) {
+  if (parser->current.type == type) {
+    Advance(parser);
     return;
   }
 
-  ErrorAtCurrent(message);
+  ErrorAtCurrent(parser, message);
 }
 
-static bool Check(TokenType type) { return parser.current.type == type; }
+static bool Check(Parser *parser, TokenType type) {
+  return parser->current.type == type;
+}
 
-static bool Match(TokenType type) {
-  if (!Check(type)) {
+static bool Match(Parser *parser, TokenType type) {
+  if (!Check(parser, type)) {
     return false;
   }
-  Advance();
+  Advance(parser);
   return true;
 }
 
-static void EmitByte(uint8_t byte) {
-  WriteChunk(CurrentChunk(), byte, parser.previous.line);
+static void EmitByte(Parser *parser, uint8_t byte) {
+  WriteChunk(CurrentChunk(parser), byte, parser->previous.line);
+}
+
+static void EmitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+  EmitByte(parser, byte1);
+  EmitByte(parser, byte2);
+}
+
+static void EmitReturn(Parser *parser) {
+  EmitByte(parser, OP_NULL);
+  EmitByte(parser, OP_RETURN);
+}
+
+static uint8_t ShortJump(uint8_t opcode) {
+  switch (opcode) {
+  case OP_JUMP_LONG:
+    return OP_JUMP;
+  case OP_JUMP_IF_FALSE_LONG:
+    return OP_JUMP_IF_FALSE;
+  default:
+    return OP_LOOP;
+  }
+}
+
+// Where the byte at `offset` moves to once the jumps before it that fit in
+// the short form are shortened, each by a byte. `short_before[i]` counts the
+// short jumps among the first i.
+static int RelaxedOffset(int *jumps, int *short_before, int jump_count,
+                         int offset) {
+  int low = 0;
+  int high = jump_count;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (jumps[middle] < offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return offset - short_before[low];
+}
+
+// Gives every jump the short form if its distance fits in 16 bits. The
+// compiler emits every jump in the wide form, since a forward jump is emitted
+// before the code it skips. Laying the chunk out with every jump short, then
+// widening the ones that do not fit until none is left, finds the shortest
+// layout: widening a jump only ever lengthens the others.
+static void RelaxJumps(Chunk *chunk) {
+  int jump_count = 0;
+  int jump_capacity = 0;
+  int *jumps = NULL;
+  for (int offset = 0; offset < chunk->count;
+       offset += InstructionLength(chunk, offset)) {
+    if (IsJump(chunk->code[offset])) {
+      if (jump_capacity < jump_count + 1) {
+        int old_capacity = jump_capacity;
+        jump_capacity = GROW_CAPACITY(old_capacity);
+        jumps = GROW_ARRAY(int, jumps, old_capacity, jump_capacity);
+      }
+      jumps[jump_count++] = offset;
+    }
+  }
+  if (jump_count == 0) {
+    return;
+  }
+  int *targets = ALLOCATE(int, jump_count);
+  bool *wide = ALLOCATE(bool, jump_count);
+  int *short_before = ALLOCATE(int, jump_count + 1);
+  for (int i = 0; i < jump_count; i++) {
+    targets[i] = JumpTarget(chunk, jumps[i]);
+    wide[i] = false;
+  }
+  bool changed = true;
+  while (changed) {
+    short_before[0] = 0;
+    for (int i = 0; i < jump_count; i++) {
+      short_before[i + 1] = short_before[i] + !wide[i];
+    }
+    changed = false;
+    for (int i = 0; i < jump_count; i++) {
+      if (wide[i]) {
+        continue;
+      }
+      int from =
+          RelaxedOffset(jumps, short_before, jump_count, jumps[i]) + 3;
+      int to = RelaxedOffset(jumps, short_before, jump_count, targets[i]);
+      if (abs(to - from) > UINT16_MAX) {
+        wide[i] = true;
+        changed = true;
+      }
+    }
+  }
+
+  uint8_t *code = ALLOCATE(uint8_t, chunk->capacity);
+  int out = 0;
+  int copied = 0; // Of the original code.
+  for (int i = 0; i < jump_count; i++) {
+    memcpy(&code[out], &chunk->code[copied], jumps[i] - copied);
+    out += jumps[i] - copied;
+    uint8_t op = chunk->code[jumps[i]];
+    int length = wide[i] ? 4 : 3;
+    int distance =
+        RelaxedOffset(jumps, short_before, jump_count, targets[i]) -
+        (out + length);
+    if (op == OP_LOOP_LONG) {
+      distance = -distance;
+    }
+    if (wide[i]) {
+      code[out] = op;
+      code[out + 1] = (distance >> 16) & 0xff;
+      code[out + 2] = (distance >> 8) & 0xff;
+      code[out + 3] = distance & 0xff;
+    } else {
+      code[out] = ShortJump(op);
+      code[out + 1] = (distance >> 8) & 0xff;
+      code[out + 2] = distance & 0xff;
+    }
+    out += length;
+    copied = jumps[i] + 4;
+  }
+  memcpy(&code[out], &chunk->code[copied], chunk->count - copied);
+  out += chunk->count - copied;
+  // Runs start at instructions, so they keep their order.
+  for (int i = 0; i < chunk->line_count; i++) {
+    chunk->lines[i].offset = RelaxedOffset(jumps, short_before, jump_count,
+                                           chunk->lines[i].offset);
+  }
+
+  FREE_ARRAY(int, jumps, jump_capacity);
+  FREE_ARRAY(int, targets, jump_count);
+  FREE_ARRAY(bool, wide, jump_count);
+  FREE_ARRAY(int, short_before, jump_count + 1);
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  chunk->code = code;
+  chunk->count = out;
 }
 
-static void EmitBytes(uint8_t byte1, uint8_t byte2) {
-  EmitByte(byte1);
-  EmitByte(byte2);
+#ifndef NO_SUPERINSTRUCTIONS
+typedef struct {
+  int operand; // Offset of the jump operand in the rewritten code.
+  int target;  // Offset of the jump target in the original code.
+  bool backward;
+  bool skip_pop;
+  bool wide;
+} PendingJump;
+
+// Matches one superinstruction at `offset`. Writes it to `out`, stores its
+// length in `written` and returns the number of original bytes it replaces,
+// or 0 if nothing matches. Only the first instruction of a sequence may be a
+// jump target.
+static int MatchSuperinstruction(Chunk *chunk, int offset, bool *is_target,
+                                 uint8_t *out, int *written) {
+  uint8_t *code = &chunk->code[offset];
+  int remaining = chunk->count - offset;
+  if (remaining >= 8 && code[0] == OP_GET_LOCAL && code[2] == OP_CONSTANT &&
+      code[4] == OP_ADD && code[5] == OP_SET_LOCAL && code[6] == code[1] &&
+      code[7] == OP_POP && !is_target[offset + 2] &&
+      !is_target[offset + 4] && !is_target[offset + 5] &&
+      !is_target[offset + 7]) {
+    out[0] = OP_INCREMENT_LOCAL;
+    out[1] = code[1];
+    out[2] = code[3];
+    *written = 3;
+    return 8;
+  }
+  if (remaining >= 5 && (code[0] == OP_LESS || code[0] == OP_GREATER) &&
+      code[1] == OP_JUMP_IF_FALSE && code[4] == OP_POP &&
+      chunk->code[JumpTarget(chunk, offset + 1)] == OP_POP &&
+      !is_target[offset + 1] && !is_target[offset + 4]) {
+    out[0] = code[0] == OP_LESS ? OP_LESS_JUMP_IF_FALSE
+                                : OP_GREATER_JUMP_IF_FALSE;
+    *written = 3;
+    return 5;
+  }
+  if (remaining >= 4 && code[0] == OP_GET_LOCAL &&
+      (code[2] == OP_GET_LOCAL || code[2] == OP_CONSTANT) &&
+      !is_target[offset + 2]) {
+    out[0] = code[2] == OP_GET_LOCAL ? OP_GET_LOCAL_GET_LOCAL
+                                     : OP_GET_LOCAL_CONSTANT;
+    out[1] = code[1];
+    out[2] = code[3];
+    *written = 3;
+    return 4;
+  }
+  if (remaining >= 3 && code[0] == OP_SET_LOCAL && code[2] == OP_POP &&
+      !is_target[offset + 2]) {
+    out[0] = OP_SET_LOCAL_POP;
+    out[1] = code[1];
+    *written = 2;
+    return 3;
+  }
+  return 0;
 }
 
-static void EmitReturn() {
-  EmitByte(OP_NULL);
-  EmitByte(OP_RETURN);
+// Rewrites frequent instruction sequences into the fused opcodes and
+// compacts the chunk, re-encoding every jump for the new layout.
+static void FuseSuperinstructions(Chunk *chunk) {
+  int count = chunk->count;
+  bool *is_target = ALLOCATE(bool, count + 1);
+  memset(is_target, 0, sizeof(bool) * (count + 1));
+  int jump_capacity = 0;
+  for (int offset = 0; offset < count;
+       offset += InstructionLength(chunk, offset)) {
+    if (IsJump(chunk->code[offset])) {
+      is_target[JumpTarget(chunk, offset)] = true;
+      jump_capacity++;
+    }
+  }
+
+  uint8_t *code = ALLOCATE(uint8_t, chunk->capacity);
+  LineRun *old_lines = chunk->lines;
+  int old_line_count = chunk->line_count;
+  int old_line_capacity = chunk->line_capacity;
+  int run = 0; // The old run holding `offset`.
+  chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
+  int *new_offset = ALLOCATE(int, count + 1);
+  PendingJump *jumps = ALLOCATE(PendingJump, jump_capacity);
+  int jump_count = 0;
+  int out = 0;
+  for (int offset = 0; offset < count;) {
+    new_offset[offset] = out;
+    int new_length;
+    int length = MatchSuperinstruction(chunk, offset, is_target, &code[out],
+                                       &new_length);
+    if (length == 0) {
+      length = InstructionLength(chunk, offset);
+      new_length = length;
+      memcpy(&code[out], &chunk->code[offset], length);
+    }
+    uint8_t op = code[out];
+    if (IsJump(op)) {
+      int jump_offset = op == OP_LESS_JUMP_IF_FALSE ||
+                                op == OP_GREATER_JUMP_IF_FALSE
+                            ? offset + 1
+                            : offset;
+      PendingJump *jump = &jumps[jump_count++];
+      jump->operand = out + 1;
+      jump->target = JumpTarget(chunk, jump_offset);
+      jump->backward = op == OP_LOOP || op == OP_LOOP_LONG;
+      jump->skip_pop = jump_offset != offset;
+      jump->wide = op == OP_JUMP_LONG || op == OP_JUMP_IF_FALSE_LONG ||
+                   op == OP_LOOP_LONG;
+    }
+    while (run + 1 < old_line_count && old_lines[run + 1].offset <= offset) {
+      run++;
+    }
+    AddLine(chunk, out, old_lines[run].line);
+    out += new_length;
+    offset += length;
+  }
+  new_offset[count] = out;
+
+  // Fusing only shortens the code, so every jump still fits its form.
+  for (int i = 0; i < jump_count; i++) {
+    PendingJump *jump = &jumps[i];
+    int target = new_offset[jump->target] + (jump->skip_pop ? 1 : 0);
+    int end = jump->operand + (jump->wide ? 3 : 2);
+    int distance = jump->backward ? end - target : target - end;
+    uint8_t *operand = &code[jump->operand];
+    if (jump->wide) {
+      *operand++ = (distance >> 16) & 0xff;
+    }
+    operand[0] = (distance >> 8) & 0xff;
+    operand[1] = distance & 0xff;
+  }
+
+  FREE_ARRAY(bool, is_target, count + 1);
+  FREE_ARRAY(int, new_offset, count + 1);
+  FREE_ARRAY(PendingJump, jumps, jump_capacity);
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineRun, old_lines, old_line_capacity);
+  chunk->code = code;
+  chunk->count = out;
+}
+#endif
+
+// The compiler whose chunk holds the current function's constants: its own,
+// or the script's with --share-constants.
+static Compiler *PoolOwner(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  while (parser->vm->share_constants && compiler->enclosing != NULL) {
+    compiler = compiler->enclosing;
+  }
+  return compiler;
 }
 
-static ObjFunction *EndCompiler() {
-  EmitReturn();
-  ObjFunction *function = current->function;
-  if (!parser.had_error) {
-    DisassembleChunk(CurrentChunk(), function->name != NULL
+static ObjFunction *EndCompiler(Parser *parser) {
+  EmitReturn(parser);
+  ObjFunction *function = parser->compiler->function;
+  if (function->chunk.borrows_constants) {
+    // The pool may have grown since; Compile() points at it again at the end.
+    function->chunk.constants = PoolOwner(parser)->function->chunk.constants;
+  }
+  if (!parser->had_error && parser->vm->optimize) {
+    OptimizeChunk(CurrentChunk(parser), function->arity);
+  }
+  if (!parser->had_error && parser->vm->register_code) {
+    // Register forms keep every jump wide and take no superinstructions.
+    EmitRegisterCode(CurrentChunk(parser), function->arity);
+  } else if (!parser->had_error) {
+    RelaxJumps(CurrentChunk(parser));
+#ifndef NO_SUPERINSTRUCTIONS
+    FuseSuperinstructions(CurrentChunk(parser));
+#endif
+  }
+#ifdef DEBUG_PRINT_CODE
+  if (!parser->had_error) {
+    DisassembleChunk(parser->vm, CurrentChunk(parser), function->name != NULL
                                          ? function->name->chars
                                          : "<script>");
   }
-  current = current->enclosing;
+#endif
+  if (parser->vm->strip_lines) {
+    StripLines(CurrentChunk(parser));
+  }
+  FREE_ARRAY(Local, parser->compiler->locals,
+             parser->compiler->local_capacity);
+  FREE_ARRAY(ConstantEntry, parser->compiler->constants.entries,
+             parser->compiler->constants.capacity);
+  FREE_ARRAY(ConstantLoad, parser->compiler->loads,
+             parser->compiler->load_capacity);
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
-static void Expression() { ParsePrecedence(PREC_ASSIGNMENT); }
+static void Expression(Parser *parser) {
+  ParsePrecedence(parser, PREC_ASSIGNMENT);
+}
 
-static void ExpressionStatement() {
-  Expression();
-  Consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  EmitByte(OP_POP);
+static void ExpressionStatement(Parser *parser) {
+  Expression(parser);
+  Consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  EmitByte(parser, OP_POP);
 }
 
-static void PrintStatement() {
-  Expression();
-  Consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  EmitByte(OP_PRINT);
+static void PrintStatement(Parser *parser) {
+  Expression(parser);
+  Consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  EmitByte(parser, OP_PRINT);
 }
 
-static void Synchronize() {
-  parser.panic_mode = false;
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON)
+static void Synchronize(Parser *parser) {
+  parser->panic_mode = false;
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON)
       return;
-    switch (parser.current.type) {
+    switch (parser->current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
     case TOKEN_VAR:
@@ -258,178 +626,389 @@ static void Synchronize() {
       return;
     default:;
     }
-    Advance();
+    Advance(parser);
   }
 }
 
-static void Block() {
-  while (!Check(TOKEN_RIGHT_BRACE) && !Check(TOKEN_EOF)) {
-    Declaration();
+static void Block(Parser *parser) {
+  while (!Check(parser, TOKEN_RIGHT_BRACE) && !Check(parser, TOKEN_EOF)) {
+    Declaration(parser);
   }
-  Consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  Consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void BeginScope() { current->scope_depth++; }
+static void BeginScope(Parser *parser) { parser->compiler->scope_depth++; }
 
-static void EndScope() {
+static void EndScope(Parser *parser) {
+  Compiler *current = parser->compiler;
   current->scope_depth--;
   while (current->local_count > 0 &&
          current->locals[current->local_count - 1].depth >
              current->scope_depth) {
     if (current->locals[current->local_count - 1].is_captured) {
-      EmitByte(OP_CLOSE_UPVALUE);
+      EmitByte(parser, OP_CLOSE_UPVALUE);
     } else {
-      EmitByte(OP_POP);
+      EmitByte(parser, OP_POP);
     }
     current->local_count--;
   }
 }
 
-static int EmitJump(uint8_t instruction) {
-  EmitByte(instruction);
-  EmitByte(0xff);
-  EmitByte(0xff);
-  return CurrentChunk()->count - 2;
+// Records the constant load just emitted from `start`. A load that does not
+// directly follow the previous one starts a new run, since no operator can
+// fold across the code between them.
+static void PushLoad(Parser *parser, int start, Value value) {
+  Compiler *current = parser->compiler;
+  if (current->load_count > 0 &&
+      current->loads[current->load_count - 1].end != start) {
+    current->load_count = 0;
+  }
+  if (current->load_capacity < current->load_count + 1) {
+    int old_capacity = current->load_capacity;
+    current->load_capacity = GROW_CAPACITY(old_capacity);
+    current->loads = GROW_ARRAY(ConstantLoad, current->loads, old_capacity,
+                                current->load_capacity);
+  }
+  ConstantLoad *load = &current->loads[current->load_count++];
+  load->start = start;
+  load->end = CurrentChunk(parser)->count;
+  load->value = value;
+}
+
+// The last `count` constant loads, if they are the last code emitted and no
+// jump lands after the first one starts, or NULL. A jump landing among them
+// would mean some of the values on the stack came from elsewhere.
+static ConstantLoad *TrailingLoads(Parser *parser, int count) {
+  Compiler *current = parser->compiler;
+  if (current->load_count < count ||
+      current->loads[current->load_count - 1].end !=
+          CurrentChunk(parser)->count) {
+    return NULL;
+  }
+  ConstantLoad *first = &current->loads[current->load_count - count];
+  return current->last_target <= first->start ? first : NULL;
 }
 
-static void PatchJump(int offset) {
-  // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = CurrentChunk()->count - offset - 2;
-  if (jump > UINT16_MAX) {
-    Error("Too much code to jump over.");
+// Drops the code from `offset` on. It must hold whole expressions or
+// statements, so every jump inside it lands inside it too.
+static void DiscardCode(Parser *parser, int offset) {
+  Compiler *current = parser->compiler;
+  TruncateChunk(CurrentChunk(parser), offset);
+  while (current->load_count > 0 &&
+         current->loads[current->load_count - 1].end > offset) {
+    current->load_count--;
   }
-  CurrentChunk()->code[offset] = (jump >> 8) & 0xff;
-  CurrentChunk()->code[offset + 1] = jump & 0xff;
+  if (current->last_call >= offset) {
+    current->last_call = -1;
+  }
+  if (current->last_target > offset) {
+    current->last_target = offset;
+  }
+}
+
+// Jumps start out in the wide form, which RelaxJumps() shortens where it can.
+static int EmitJump(Parser *parser, uint8_t instruction) {
+  EmitByte(parser, instruction);
+  EmitByte(parser, 0xff);
+  EmitByte(parser, 0xff);
+  EmitByte(parser, 0xff);
+  return CurrentChunk(parser)->count - 3;
 }
 
-static void IfStatement() {
-  Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  Expression();
-  Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  int then_jump = EmitJump(OP_JUMP_IF_FALSE);
-  EmitByte(OP_POP);
-  Statement();
-  int else_jump = EmitJump(OP_JUMP);
-  PatchJump(then_jump);
-  EmitByte(OP_POP);
-  if (Match(TOKEN_ELSE)) {
-    Statement();
+static void PatchJump(Parser *parser, int offset) {
+  // -3 to adjust for the bytecode for the jump offset itself.
+  int jump = CurrentChunk(parser)->count - offset - 3;
+  if (jump > UINT24_MAX) {
+    Error(parser, "Too much code to jump over.");
   }
-  PatchJump(else_jump);
+  CurrentChunk(parser)->code[offset] = (jump >> 16) & 0xff;
+  CurrentChunk(parser)->code[offset + 1] = (jump >> 8) & 0xff;
+  CurrentChunk(parser)->code[offset + 2] = jump & 0xff;
+  parser->compiler->last_target = CurrentChunk(parser)->count;
+}
+
+// Whether a condition with this value holds, as OP_JUMP_IF_FALSE sees it.
+static bool IsTruthy(Value value) {
+  return !IS_NULL(value) && !(IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void EmitLoop(int loop_start) {
-  EmitByte(OP_LOOP);
-  int offset = CurrentChunk()->count - loop_start + 2;
-  if (offset > UINT16_MAX) {
-    Error("Loop body too large.");
+static void IfStatement(Parser *parser) {
+  Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  Expression(parser);
+  Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  ConstantLoad *condition = TrailingLoads(parser, 1);
+  if (condition != NULL) {
+    // Only one branch can run. The other is still compiled, to report its
+    // errors, and then dropped.
+    bool truthy = IsTruthy(condition->value);
+    DiscardCode(parser, condition->start);
+    int start = CurrentChunk(parser)->count;
+    Statement(parser);
+    if (!truthy) {
+      DiscardCode(parser, start);
+    }
+    if (Match(parser, TOKEN_ELSE)) {
+      start = CurrentChunk(parser)->count;
+      Statement(parser);
+      if (truthy) {
+        DiscardCode(parser, start);
+      }
+    }
+    return;
+  }
+  int then_jump = EmitJump(parser, OP_JUMP_IF_FALSE_LONG);
+  EmitByte(parser, OP_POP);
+  Statement(parser);
+  int else_jump = EmitJump(parser, OP_JUMP_LONG);
+  PatchJump(parser, then_jump);
+  EmitByte(parser, OP_POP);
+  if (Match(parser, TOKEN_ELSE)) {
+    Statement(parser);
   }
-  EmitByte((offset >> 8) & 0xff);
-  EmitByte(offset & 0xff);
+  PatchJump(parser, else_jump);
 }
 
-static void WhileStatement() {
-  int loop_start = CurrentChunk()->count;
-  Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  Expression();
-  Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  int exit_jump = EmitJump(OP_JUMP_IF_FALSE);
-  EmitByte(OP_POP);
-  Statement();
-  EmitLoop(loop_start);
-  PatchJump(exit_jump);
-  EmitByte(OP_POP);
+static void EmitLoop(Parser *parser, int loop_start) {
+  EmitByte(parser, OP_LOOP_LONG);
+  int offset = CurrentChunk(parser)->count - loop_start + 3;
+  if (offset > UINT24_MAX) {
+    Error(parser, "Loop body too large.");
+  }
+  EmitByte(parser, (offset >> 16) & 0xff);
+  EmitByte(parser, (offset >> 8) & 0xff);
+  EmitByte(parser, offset & 0xff);
 }
 
-static void ForStatement() {
-  BeginScope();
-  Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (Match(TOKEN_SEMICOLON)) {
+static void WhileStatement(Parser *parser) {
+  int loop_start = CurrentChunk(parser)->count;
+  Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  Expression(parser);
+  Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  ConstantLoad *condition = TrailingLoads(parser, 1);
+  if (condition != NULL) {
+    // The loop runs forever, needing no test, or never.
+    bool truthy = IsTruthy(condition->value);
+    DiscardCode(parser, loop_start);
+    Statement(parser);
+    if (truthy) {
+      EmitLoop(parser, loop_start);
+    } else {
+      DiscardCode(parser, loop_start);
+    }
+    return;
+  }
+  int exit_jump = EmitJump(parser, OP_JUMP_IF_FALSE_LONG);
+  EmitByte(parser, OP_POP);
+  Statement(parser);
+  EmitLoop(parser, loop_start);
+  PatchJump(parser, exit_jump);
+  EmitByte(parser, OP_POP);
+}
+
+static void ForStatement(Parser *parser) {
+  BeginScope(parser);
+  Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (Match(parser, TOKEN_SEMICOLON)) {
     // No initializer.
-  } else if (Match(TOKEN_VAR)) {
-    VarDeclaration();
+  } else if (Match(parser, TOKEN_VAR)) {
+    VarDeclaration(parser);
   } else {
-    ExpressionStatement();
+    ExpressionStatement(parser);
   }
-  int loop_start = CurrentChunk()->count;
+  int loop_start = CurrentChunk(parser)->count;
+  int condition_start = loop_start;
   int exit_jump = -1;
-  if (!Match(TOKEN_SEMICOLON)) {
-    Expression();
-    Consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-    exit_jump = EmitJump(OP_JUMP_IF_FALSE);
-    EmitByte(OP_POP);
-  }
-  if (!Match(TOKEN_RIGHT_PAREN)) {
-    int body_jump = EmitJump(OP_JUMP);
-    int increment_start = CurrentChunk()->count;
-    Expression();
-    EmitByte(OP_POP);
-    Consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-    EmitLoop(loop_start);
+  bool runs = true;
+  if (!Match(parser, TOKEN_SEMICOLON)) {
+    Expression(parser);
+    Consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    ConstantLoad *condition = TrailingLoads(parser, 1);
+    if (condition != NULL) {
+      // Either no test is needed, or the loop never runs and its clauses and
+      // body are dropped once compiled.
+      runs = IsTruthy(condition->value);
+      DiscardCode(parser, condition_start);
+    } else {
+      exit_jump = EmitJump(parser, OP_JUMP_IF_FALSE_LONG);
+      EmitByte(parser, OP_POP);
+    }
+  }
+  if (!Match(parser, TOKEN_RIGHT_PAREN)) {
+    int body_jump = EmitJump(parser, OP_JUMP_LONG);
+    int increment_start = CurrentChunk(parser)->count;
+    Expression(parser);
+    EmitByte(parser, OP_POP);
+    Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    EmitLoop(parser, loop_start);
     loop_start = increment_start;
-    PatchJump(body_jump);
+    PatchJump(parser, body_jump);
   }
-  Statement();
-  EmitLoop(loop_start);
+  Statement(parser);
+  EmitLoop(parser, loop_start);
   if (exit_jump != -1) {
-    PatchJump(exit_jump);
-    EmitByte(OP_POP);
+    PatchJump(parser, exit_jump);
+    EmitByte(parser, OP_POP);
   }
-  EndScope();
+  if (!runs) {
+    DiscardCode(parser, condition_start);
+  }
+  EndScope(parser);
 }
 
-static void ReturnStatement() {
+static void ReturnStatement(Parser *parser) {
+  Compiler *current = parser->compiler;
   if (current->type == TYPE_SCRIPT) {
-    Error("Can't return from top-level code.");
+    Error(parser, "Can't return from top-level code.");
+  }
+  if (Match(parser, TOKEN_SEMICOLON)) {
+    EmitReturn(parser);
+  } else {
+    Expression(parser);
+    Consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // The value is a call's result if the call was the last thing emitted.
+    // Jumps that skip the call land on the OP_RETURN, which stays.
+    if (current->last_call == CurrentChunk(parser)->count - 2) {
+      CurrentChunk(parser)->code[current->last_call] = OP_TAIL_CALL;
+    }
+    EmitByte(parser, OP_RETURN);
   }
-  if (Match(TOKEN_SEMICOLON)) {
-    EmitReturn();
+}
+
+static void Statement(Parser *parser) {
+  if (Match(parser, TOKEN_PRINT)) {
+    PrintStatement(parser);
+  } else if (Match(parser, TOKEN_RETURN)) {
+    ReturnStatement(parser);
+  } else if (Match(parser, TOKEN_IF)) {
+    IfStatement(parser);
+  } else if (Match(parser, TOKEN_WHILE)) {
+    WhileStatement(parser);
+  } else if (Match(parser, TOKEN_FOR)) {
+    ForStatement(parser);
+  } else if (Match(parser, TOKEN_LEFT_BRACE)) {
+    BeginScope(parser);
+    Block(parser);
+    EndScope(parser);
   } else {
-    Expression();
-    Consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    EmitByte(OP_RETURN);
-  }
-}
-
-static void Statement() {
-  if (Match(TOKEN_PRINT)) {
-    PrintStatement();
-  } else if (Match(TOKEN_RETURN)) {
-    ReturnStatement();
-  } else if (Match(TOKEN_IF)) {
-    IfStatement();
-  } else if (Match(TOKEN_WHILE)) {
-    WhileStatement();
-  } else if (Match(TOKEN_FOR)) {
-    ForStatement();
-  } else if (Match(TOKEN_LEFT_BRACE)) {
-    BeginScope();
-    Block();
-    EndScope();
+    ExpressionStatement(parser);
+  }
+}
+
+static uint64_t ConstantBits(Value value) {
+#ifdef NAN_BOXING
+  return value;
+#else
+  if (IS_NUMBER(value)) {
+    uint64_t bits;
+    memcpy(&bits, &value.as.number, sizeof(bits));
+    return bits;
+  }
+  return (uint64_t)(uintptr_t)AS_OBJ(value);
+#endif
+}
+
+static ConstantEntry *FindConstant(ConstantEntry *entries, int capacity,
+                                   Value value) {
+  uint64_t bits = ConstantBits(value);
+  uint64_t hash = (bits ^ (bits >> 32)) * 0x9e3779b97f4a7c15u;
+  int index = (int)((hash >> 32) & (uint64_t)(capacity - 1));
+  while (true) {
+    ConstantEntry *entry = &entries[index];
+    if (entry->index == -1 ||
+        (IS_NUMBER(entry->key) == IS_NUMBER(value) &&
+         ConstantBits(entry->key) == bits)) {
+      return entry;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void GrowConstantMap(ConstantMap *map) {
+  int capacity = GROW_CAPACITY(map->capacity);
+  ConstantEntry *entries = ALLOCATE(ConstantEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].index = -1;
+  }
+  for (int i = 0; i < map->capacity; i++) {
+    ConstantEntry *entry = &map->entries[i];
+    if (entry->index != -1) {
+      *FindConstant(entries, capacity, entry->key) = *entry;
+    }
+  }
+  FREE_ARRAY(ConstantEntry, map->entries, map->capacity);
+  map->entries = entries;
+  map->capacity = capacity;
+}
+
+// Returns the index of `value` in the pool, adding it the first time.
+static int MakeConstant(Parser *parser, Value value) {
+  Compiler *owner = PoolOwner(parser);
+  ConstantMap *map = &owner->constants;
+  if (map->count + 1 > map->capacity * 3 / 4) {
+    GrowConstantMap(map);
+  }
+  ConstantEntry *entry = FindConstant(map->entries, map->capacity, value);
+  if (entry->index == -1) {
+    entry->key = value;
+    entry->index = AddConstant(&owner->function->chunk, value);
+    map->count++;
+  }
+  if (entry->index > UINT24_MAX) {
+    Error(parser, "Too many constants in one chunk.");
+    return 0;
+  }
+  return entry->index;
+}
+
+static void EmitWideOperand(Parser *parser, int operand) {
+  EmitByte(parser, (operand >> 16) & 0xff);
+  EmitByte(parser, (operand >> 8) & 0xff);
+  EmitByte(parser, operand & 0xff);
+}
+
+// Emits `instruction` with a one-byte operand, or `wide_instruction` if the
+// operand does not fit in a byte.
+static void EmitOperandOp(Parser *parser, uint8_t instruction,
+                          uint8_t wide_instruction, int operand) {
+  if (operand <= UINT8_MAX) {
+    EmitBytes(parser, instruction, (uint8_t)operand);
   } else {
-    ExpressionStatement();
+    EmitByte(parser, wide_instruction);
+    EmitWideOperand(parser, operand);
   }
 }
 
-static uint8_t MakeConstant(Value value) {
-  int constant = AddConstant(CurrentChunk(), value);
-  if (constant > UINT8_MAX) {
-    Error("Too many constants in one chunk.");
+static int GlobalVariable(Parser *parser, Token *name) {
+  int slot =
+      GlobalSlot(parser->vm, CopyString(parser->vm, name->start, name->length));
+  if (slot > UINT24_MAX) {
+    Error(parser, "Too many global variables.");
     return 0;
   }
-  return (uint8_t)constant;
+  return slot;
 }
 
-static uint8_t IdentifierConstant(Token *name) {
-  return MakeConstant(OBJ_VAL(CopyString(name->start, name->length)));
+// Emits `instruction` with a two-byte global slot, or `wide_instruction` if
+// the slot does not fit in two bytes.
+static void EmitGlobalOp(Parser *parser, uint8_t instruction,
+                         uint8_t wide_instruction, int slot) {
+  if (slot <= UINT16_MAX) {
+    EmitByte(parser, instruction);
+    EmitByte(parser, (slot >> 8) & 0xff);
+    EmitByte(parser, slot & 0xff);
+  } else {
+    EmitByte(parser, wide_instruction);
+    EmitWideOperand(parser, slot);
+  }
 }
 
-static void AddLocal(Token name) {
-  if (current->local_count == UINT8_COUNT) {
-    Error("Too many local variables in function.");
+static void AddLocal(Parser *parser, Token name) {
+  Compiler *current = parser->compiler;
+  if (current->local_count > UINT24_MAX) {
+    Error(parser, "Too many local variables in function.");
     return;
   }
-  Local *local = &current->locals[current->local_count++];
+  Local *local = PushLocal(current);
   local->name = name;
   local->depth = -1;
   local->is_captured = false;
@@ -442,145 +1021,166 @@ static bool IdentifiersEqual(Token *a, Token *b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void DeclareVariable() {
+static void DeclareVariable(Parser *parser) {
+  Compiler *current = parser->compiler;
   if (current->scope_depth == 0) {
     return;
   }
-  Token *name = &parser.previous;
+  Token *name = &parser->previous;
   for (int i = current->local_count - 1; i >= 0; i--) {
     Local *local = &current->locals[i];
     if (local->depth != -1 && local->depth < current->scope_depth) {
       break;
     }
     if (IdentifiersEqual(name, &local->name)) {
-      Error("Already a variable with this name in this scope.");
+      Error(parser, "Already a variable with this name in this scope.");
     }
   }
-  AddLocal(*name);
+  AddLocal(parser, *name);
 }
 
-static uint8_t ParseVariable(const char *error_message) {
-  Consume(TOKEN_IDENTIFIER, error_message);
-  DeclareVariable();
-  if (current->scope_depth > 0) {
+static int ParseVariable(Parser *parser, const char *error_message) {
+  Consume(parser, TOKEN_IDENTIFIER, error_message);
+  DeclareVariable(parser);
+  if (parser->compiler->scope_depth > 0) {
     return 0;
   }
-  return IdentifierConstant(&parser.previous);
+  return GlobalVariable(parser, &parser->previous);
 }
 
-static void MarkInitialized() {
+static void MarkInitialized(Parser *parser) {
+  Compiler *current = parser->compiler;
   if (current->scope_depth == 0) {
     return;
   }
   current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void Function(FunctionType type) {
+static void Function(Parser *parser, FunctionType type) {
   Compiler compiler;
-  InitCompiler(&compiler, type);
-  BeginScope();
-  Consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!Check(TOKEN_RIGHT_PAREN)) {
+  InitCompiler(parser, &compiler, type);
+  BeginScope(parser);
+  Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!Check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        ErrorAtCurrent("Can't have more than 255 parameters.");
+      compiler.function->arity++;
+      if (compiler.function->arity > 255) {
+        ErrorAtCurrent(parser, "Can't have more than 255 parameters.");
       }
-      uint8_t constant = ParseVariable("Expect parameter name.");
-      DefineVariable(constant);
-    } while (Match(TOKEN_COMMA));
-  }
-  Consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-  Consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  Block();
-  ObjFunction *function = EndCompiler();
-  EmitBytes(OP_CLOSURE, MakeConstant(OBJ_VAL(function)));
+      int global = ParseVariable(parser, "Expect parameter name.");
+      DefineVariable(parser, global);
+    } while (Match(parser, TOKEN_COMMA));
+  }
+  Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  Consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  Block(parser);
+  ObjFunction *function = EndCompiler(parser);
+  EmitOperandOp(parser, OP_CLOSURE, OP_CLOSURE_LONG,
+                MakeConstant(parser, OBJ_VAL(function)));
   for (int i = 0; i < function->upvalue_count; i++) {
-    EmitByte(compiler.upvalues[i].is_local ? 1 : 0);
-    EmitByte(compiler.upvalues[i].index);
+    EmitByte(parser, compiler.upvalues[i].is_local ? 1 : 0);
+    EmitByte(parser, compiler.upvalues[i].index);
   }
-  EmitBytes(OP_CONSTANT, MakeConstant(OBJ_VAL(function)));
 }
 
-static void DefineVariable(uint8_t global) {
-  if (current->scope_depth > 0) {
-    MarkInitialized();
+static void DefineVariable(Parser *parser, int global) {
+  if (parser->compiler->scope_depth > 0) {
+    MarkInitialized(parser);
     return;
   }
-  EmitBytes(OP_DEFINE_GLOBAL, global);
+  EmitGlobalOp(parser, OP_DEFINE_GLOBAL_SLOT, OP_DEFINE_GLOBAL_SLOT_LONG,
+               global);
 }
 
-static void VarDeclaration() {
-  uint8_t global = ParseVariable("Expect variable name.");
-  if (Match(TOKEN_EQUAL)) {
-    Expression();
+static void VarDeclaration(Parser *parser) {
+  int global = ParseVariable(parser, "Expect variable name.");
+  if (Match(parser, TOKEN_EQUAL)) {
+    Expression(parser);
   } else {
-    EmitByte(OP_NULL);
+    EmitByte(parser, OP_NULL);
   }
-  Consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-  DefineVariable(global);
+  Consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  DefineVariable(parser, global);
 }
 
-static void FunDeclaration() {
-  uint8_t global = ParseVariable("Expect function name.");
-  MarkInitialized();
-  Function(TYPE_FUNCTION);
-  DefineVariable(global);
+static void FunDeclaration(Parser *parser) {
+  int global = ParseVariable(parser, "Expect function name.");
+  MarkInitialized(parser);
+  Function(parser, TYPE_FUNCTION);
+  DefineVariable(parser, global);
 }
 
-static void Declaration() {
-  if (Match(TOKEN_VAR)) {
-    VarDeclaration();
-  } else if (Match(TOKEN_FUN)) {
-    FunDeclaration();
+static void Declaration(Parser *parser) {
+  if (Match(parser, TOKEN_VAR)) {
+    VarDeclaration(parser);
+  } else if (Match(parser, TOKEN_FUN)) {
+    FunDeclaration(parser);
   } else {
-    Statement();
+    Statement(parser);
   }
-  if (parser.panic_mode)
-    Synchronize();
+  if (parser->panic_mode)
+    Synchronize(parser);
 }
 
-static void Grouping(bool can_assign) {
-  Expression();
-  Consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void Grouping(Parser *parser, bool can_assign) {
+  Expression(parser);
+  Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void EmitConstant(Value value) {
-  EmitBytes(OP_CONSTANT, MakeConstant(value));
+static void EmitConstant(Parser *parser, Value value) {
+  int start = CurrentChunk(parser)->count;
+  EmitOperandOp(parser, OP_CONSTANT, OP_CONSTANT_LONG,
+                MakeConstant(parser, value));
+  PushLoad(parser, start, value);
 }
 
-static void Literal(bool can_assign) {
-  switch (parser.previous.type) {
+// Loads `value`, with the one-byte instruction for true, false and nil.
+static void EmitValue(Parser *parser, Value value) {
+  int start = CurrentChunk(parser)->count;
+  if (IS_BOOL(value)) {
+    EmitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else if (IS_NULL(value)) {
+    EmitByte(parser, OP_NULL);
+  } else {
+    EmitConstant(parser, value);
+    return;
+  }
+  PushLoad(parser, start, value);
+}
+
+static void Literal(Parser *parser, bool can_assign) {
+  switch (parser->previous.type) {
   case TOKEN_FALSE:
-    EmitByte(OP_FALSE);
+    EmitValue(parser, BOOL_VAL(false));
     break;
   case TOKEN_NULL:
-    EmitByte(OP_NULL);
+    EmitValue(parser, NULL_VAL);
     break;
   case TOKEN_TRUE:
-    EmitByte(OP_TRUE);
+    EmitValue(parser, BOOL_VAL(true));
     break;
   default:
     return;
   }
 }
 
-static void Number(bool can_assign) {
-  double value = strtod(parser.previous.start, NULL);
-  EmitConstant(NUMBER_VAL(value));
+static void Number(Parser *parser, bool can_assign) {
+  double value = strtod(parser->previous.start, NULL);
+  EmitConstant(parser, NUMBER_VAL(value));
 }
 
-static void String(bool can_assign) {
-  EmitConstant(OBJ_VAL(
-      CopyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void String(Parser *parser, bool can_assign) {
+  ObjString *string = CopyString(parser->vm, parser->previous.start + 1,
+                                 parser->previous.length - 2);
+  EmitConstant(parser, OBJ_VAL(string));
 }
 
-static int ResolveLocal(Compiler *compiler, Token *name) {
+static int ResolveLocal(Parser *parser, Compiler *compiler, Token *name) {
   for (int i = compiler->local_count - 1; i >= 0; i--) {
     Local *local = &compiler->locals[i];
     if (IdentifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
-        Error("Can't read local variable in its own initializer.");
+        Error(parser, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -588,7 +1188,7 @@ static int ResolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static int AddUpvalue(Compiler *compiler, uint8_t index,
+static int AddUpvalue(Parser *parser, Compiler *compiler, uint8_t index,
                       bool is_local) {
   int upvalue_count = compiler->function->upvalue_count;
   for (int i = 0; i < upvalue_count; i++) {
@@ -598,7 +1198,7 @@ static int AddUpvalue(Compiler *compiler, uint8_t index,
     }
   }
   if (upvalue_count == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+    Error(parser, "Too many closure variables in function.");
     return 0;
   }
   compiler->upvalues[upvalue_count].is_local = is_local;
@@ -606,169 +1206,320 @@ static int AddUpvalue(Compiler *compiler, uint8_t index,
   return compiler->function->upvalue_count++;
 }
 
-static int ResolveUpvalue(Compiler *compiler, Token *name) {
+static int ResolveUpvalue(Parser *parser, Compiler *compiler, Token *name) {
   if (compiler->enclosing == NULL)
     return -1;
 
-  int local = ResolveLocal(compiler->enclosing, name);
+  int local = ResolveLocal(parser, compiler->enclosing, name);
+  if (local > UINT8_MAX) {
+    // Captures keep their slot in one byte.
+    Error(parser, "Can't capture a local variable past slot 255.");
+    return -1;
+  }
   if (local != -1) {
     compiler->enclosing->locals[local].is_captured = true;
-    return AddUpvalue(compiler, (uint8_t)local, true);
+    return AddUpvalue(parser, compiler, (uint8_t)local, true);
   }
-  int upvalue = ResolveUpvalue(compiler->enclosing, name);
+  int upvalue = ResolveUpvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return AddUpvalue(compiler, (uint8_t)upvalue, false);
+    return AddUpvalue(parser, compiler, (uint8_t)upvalue, false);
   }
   return -1;
 }
 
-static void NamedVariable(Token name, bool can_assign) {
-  uint8_t get_op, set_op;
-  int arg = ResolveLocal(current, &name);
+static void NamedVariable(Parser *parser, Token name, bool can_assign) {
+  uint8_t get_op, set_op, wide_get_op, wide_set_op;
+  int arg = ResolveLocal(parser, parser->compiler, &name);
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
     set_op = OP_SET_LOCAL;
-  } else if ((arg = ResolveUpvalue(current, &name)) != -1) {
-    get_op = OP_GET_UPVALUE;
-    set_op = OP_SET_UPVALUE;
+    wide_get_op = OP_GET_LOCAL_LONG;
+    wide_set_op = OP_SET_LOCAL_LONG;
+  } else if ((arg = ResolveUpvalue(parser, parser->compiler, &name)) != -1) {
+    // A function has at most UINT8_COUNT upvalues, so these are never wide.
+    get_op = wide_get_op = OP_GET_UPVALUE;
+    set_op = wide_set_op = OP_SET_UPVALUE;
   } else {
-    arg = IdentifierConstant(&name);
-    get_op = OP_GET_GLOBAL;
-    set_op = OP_SET_GLOBAL;
+    arg = GlobalVariable(parser, &name);
+    if (can_assign && Match(parser, TOKEN_EQUAL)) {
+      Expression(parser);
+      EmitGlobalOp(parser, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL_SLOT_LONG, arg);
+    } else {
+      EmitGlobalOp(parser, OP_GET_GLOBAL_SLOT, OP_GET_GLOBAL_SLOT_LONG, arg);
+    }
+    return;
   }
-  if (can_assign && Match(TOKEN_EQUAL)) {
-    Expression();
-    EmitBytes(set_op, (uint8_t)arg);
+  if (can_assign && Match(parser, TOKEN_EQUAL)) {
+    Expression(parser);
+    EmitOperandOp(parser, set_op, wide_set_op, arg);
   } else {
-    EmitBytes(get_op, (uint8_t)arg);
+    EmitOperandOp(parser, get_op, wide_get_op, arg);
+  }
+}
+
+static void And_(Parser *parser, bool can_assign) {
+  ConstantLoad *left = TrailingLoads(parser, 1);
+  if (left != NULL) {
+    // A false left operand is the result, and a true one is dropped.
+    if (IsTruthy(left->value)) {
+      DiscardCode(parser, left->start);
+      ParsePrecedence(parser, PREC_AND);
+    } else {
+      int start = CurrentChunk(parser)->count;
+      ParsePrecedence(parser, PREC_AND);
+      DiscardCode(parser, start);
+    }
+    return;
   }
+  int end_jump = EmitJump(parser, OP_JUMP_IF_FALSE_LONG);
+  EmitByte(parser, OP_POP);
+  ParsePrecedence(parser, PREC_AND);
+  PatchJump(parser, end_jump);
 }
 
-static void And_(bool can_assign) {
-  int end_jump = EmitJump(OP_JUMP_IF_FALSE);
-  EmitByte(OP_POP);
-  ParsePrecedence(PREC_AND);
-  PatchJump(end_jump);
+static void Or_(Parser *parser, bool can_assign) {
+  ConstantLoad *left = TrailingLoads(parser, 1);
+  if (left != NULL) {
+    // A true left operand is the result, and a false one is dropped.
+    if (IsTruthy(left->value)) {
+      int start = CurrentChunk(parser)->count;
+      ParsePrecedence(parser, PREC_OR);
+      DiscardCode(parser, start);
+    } else {
+      DiscardCode(parser, left->start);
+      ParsePrecedence(parser, PREC_OR);
+    }
+    return;
+  }
+  int else_jump = EmitJump(parser, OP_JUMP_IF_FALSE_LONG);
+  int end_jump = EmitJump(parser, OP_JUMP_LONG);
+  PatchJump(parser, else_jump);
+  EmitByte(parser, OP_POP);
+  ParsePrecedence(parser, PREC_OR);
+  PatchJump(parser, end_jump);
 }
 
-static void Or_(bool can_assign) {
-  int else_jump = EmitJump(OP_JUMP_IF_FALSE);
-  int end_jump = EmitJump(OP_JUMP);
-  PatchJump(else_jump);
-  EmitByte(OP_POP);
-  ParsePrecedence(PREC_OR);
-  PatchJump(end_jump);
+static void Variable(Parser *parser, bool can_assign) {
+  NamedVariable(parser, parser->previous, can_assign);
 }
 
-static void Variable(bool can_assign) {
-  NamedVariable(parser.previous, can_assign);
+// Computes what the unary operator would at runtime. Returns false, leaving
+// the operator to run, if it would report an error instead.
+static bool FoldUnary(TokenType operator_type, Value operand, Value *result) {
+  switch (operator_type) {
+  case TOKEN_MINUS:
+    if (!IS_NUMBER(operand)) {
+      return false;
+    }
+    *result = NUMBER_VAL(-AS_NUMBER(operand));
+    return true;
+  case TOKEN_BANG:
+    if (!IS_BOOL(operand)) {
+      return false;
+    }
+    *result = BOOL_VAL(!AS_BOOL(operand));
+    return true;
+  default:
+    return false;
+  }
 }
 
-static void Unary(bool can_assign) {
-  TokenType operator_type = parser.previous.type;
-  ParsePrecedence(PREC_UNARY);
+static void Unary(Parser *parser, bool can_assign) {
+  TokenType operator_type = parser->previous.type;
+  ParsePrecedence(parser, PREC_UNARY);
+  ConstantLoad *operand = TrailingLoads(parser, 1);
+  Value result;
+  if (operand != NULL && FoldUnary(operator_type, operand->value, &result)) {
+    DiscardCode(parser, operand->start);
+    EmitValue(parser, result);
+    return;
+  }
   switch (operator_type) {
   case TOKEN_MINUS:
-    EmitByte(OP_NEGATE);
+    EmitByte(parser, OP_NEGATE);
     break;
   case TOKEN_BANG:
-    EmitByte(OP_NOT);
+    EmitByte(parser, OP_NOT);
     break;
   default:
     return;
   }
 }
 
-static void Binary(bool can_assign) {
-  TokenType operator_type = parser.previous.type;
+// Computes what the binary operator would at runtime, following the
+// instructions Binary() emits for it: `a >= b` is `!(a < b)`, which differs
+// for NaN. Returns false, leaving the operator to run, if it would report an
+// error instead.
+static bool FoldBinary(Parser *parser, TokenType operator_type, Value a,
+                       Value b, Value *result) {
+  if (operator_type == TOKEN_EQUAL_EQUAL) {
+    *result = BOOL_VAL(ValueEqual(a, b));
+    return true;
+  }
+  if (operator_type == TOKEN_BANG_EQUAL) {
+    *result = BOOL_VAL(!ValueEqual(a, b));
+    return true;
+  }
+  if (operator_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    ObjString *first = AS_STRING(a);
+    ObjString *second = AS_STRING(b);
+    int length = first->length + second->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, first->chars, first->length);
+    memcpy(chars + first->length, second->chars, second->length);
+    chars[length] = '\0';
+    *result = OBJ_VAL(GetString(parser->vm, chars, length));
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (operator_type) {
+  case TOKEN_GREATER:
+    *result = BOOL_VAL(x > y);
+    return true;
+  case TOKEN_GREATER_EQUAL:
+    *result = BOOL_VAL(!(x < y));
+    return true;
+  case TOKEN_LESS:
+    *result = BOOL_VAL(x < y);
+    return true;
+  case TOKEN_LESS_EQUAL:
+    *result = BOOL_VAL(!(x > y));
+    return true;
+  case TOKEN_PLUS:
+    *result = NUMBER_VAL(x + y);
+    return true;
+  case TOKEN_MINUS:
+    *result = NUMBER_VAL(x - y);
+    return true;
+  case TOKEN_STAR:
+    *result = NUMBER_VAL(x * y);
+    return true;
+  case TOKEN_SLASH:
+    *result = NUMBER_VAL(x / y);
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void Binary(Parser *parser, bool can_assign) {
+  TokenType operator_type = parser->previous.type;
   ParseRule *rule = GetRule(operator_type);
-  ParsePrecedence((Precedence)(rule->precedence + 1));
+  ParsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+  ConstantLoad *operands = TrailingLoads(parser, 2);
+  Value result;
+  if (operands != NULL && FoldBinary(parser, operator_type, operands[0].value,
+                                     operands[1].value, &result)) {
+    DiscardCode(parser, operands[0].start);
+    EmitValue(parser, result);
+    return;
+  }
 
   switch (operator_type) {
   case TOKEN_BANG_EQUAL:
-    EmitBytes(OP_EQUAL, OP_NOT);
+    EmitBytes(parser, OP_EQUAL, OP_NOT);
     break;
   case TOKEN_EQUAL_EQUAL:
-    EmitByte(OP_EQUAL);
+    EmitByte(parser, OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    EmitByte(OP_GREATER);
+    EmitByte(parser, OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    EmitBytes(OP_LESS, OP_NOT);
+    EmitBytes(parser, OP_LESS, OP_NOT);
     break;
   case TOKEN_LESS:
-    EmitByte(OP_LESS);
+    EmitByte(parser, OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    EmitBytes(OP_GREATER, OP_NOT);
+    EmitBytes(parser, OP_GREATER, OP_NOT);
     break;
   case TOKEN_PLUS:
-    EmitByte(OP_ADD);
+    EmitByte(parser, OP_ADD);
     break;
   case TOKEN_MINUS:
-    EmitByte(OP_SUBTRACT);
+    EmitByte(parser, OP_SUBTRACT);
     break;
   case TOKEN_STAR:
-    EmitByte(OP_MULTIPLY);
+    EmitByte(parser, OP_MULTIPLY);
     break;
   case TOKEN_SLASH:
-    EmitByte(OP_DIVIDE);
+    EmitByte(parser, OP_DIVIDE);
     break;
   default:
     return;
   }
 }
 
-static uint8_t ArgumentList() {
+static uint8_t ArgumentList(Parser *parser) {
   uint8_t arg_count = 0;
-  if (!Check(TOKEN_RIGHT_PAREN)) {
+  if (!Check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      Expression();
+      Expression(parser);
       if (arg_count == 255) {
-        Error("Can't have more than 255 arguments.");
+        Error(parser, "Can't have more than 255 arguments.");
       }
       arg_count++;
-    } while (Match(TOKEN_COMMA));
+    } while (Match(parser, TOKEN_COMMA));
   }
-  Consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return arg_count;
 }
 
-static void Call(bool canAssign) {
-  uint8_t arg_count = ArgumentList();
-  EmitBytes(OP_CALL, arg_count);
+static void Call(Parser *parser, bool canAssign) {
+  uint8_t arg_count = ArgumentList(parser);
+  parser->compiler->last_call = CurrentChunk(parser)->count;
+  EmitBytes(parser, OP_CALL, arg_count);
 }
 
-static void ParsePrecedence(Precedence precedence) {
-  Advance();
-  ParseFn prefix_rule = GetRule(parser.previous.type)->prefix;
+static void ParsePrecedence(Parser *parser, Precedence precedence) {
+  Advance(parser);
+  ParseFn prefix_rule = GetRule(parser->previous.type)->prefix;
   if (prefix_rule == NULL) {
-    Error("Expect expression.");
+    Error(parser, "Expect expression.");
     return;
   }
   bool can_assign = precedence <= PREC_ASSIGNMENT;
-  prefix_rule(can_assign);
-  while (precedence <= GetRule(parser.current.type)->precedence) {
-    Advance();
-    ParseFn infix_rule = GetRule(parser.previous.type)->infix;
-    infix_rule(can_assign);
+  prefix_rule(parser, can_assign);
+  while (precedence <= GetRule(parser->current.type)->precedence) {
+    Advance(parser);
+    ParseFn infix_rule = GetRule(parser->previous.type)->infix;
+    infix_rule(parser, can_assign);
   }
-  if (can_assign && Match(TOKEN_EQUAL)) {
-    Error("Invalid assignment target.");
+  if (can_assign && Match(parser, TOKEN_EQUAL)) {
+    Error(parser, "Invalid assignment target.");
   }
 }
 
-ObjFunction *Compile(const char *source) {
+ObjFunction *Compile(VM *vm, const char *source) {
+  Parser parser;
+  parser.vm = vm;
   parser.had_error = false;
   parser.panic_mode = false;
-  InitScanner(source);
+  parser.compiler = NULL;
+  InitScanner(&parser.scanner, source);
+  Object *older_objects = vm->objects;
   Compiler compiler;
-  InitCompiler(&compiler, TYPE_SCRIPT);
-  Advance();
-  while (!Match(TOKEN_EOF)) {
-    Declaration();
+  InitCompiler(&parser, &compiler, TYPE_SCRIPT);
+  Advance(&parser);
+  while (!Match(&parser, TOKEN_EOF)) {
+    Declaration(&parser);
+  }
+  ObjFunction *function = EndCompiler(&parser);
+  // Every object since `older_objects` was made by this compilation, and
+  // the functions among them that share the script's pool have to see all
+  // of it.
+  for (Object *object = vm->objects; object != older_objects;
+       object = object->next) {
+    if (object->type == OBJ_FUNCTION &&
+        ((ObjFunction *)object)->chunk.borrows_constants) {
+      ((ObjFunction *)object)->chunk.constants = function->chunk.constants;
+    }
   }
-  ObjFunction *function = EndCompiler();
   return parser.had_error ? NULL : function;
 }
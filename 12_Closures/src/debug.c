@@ -1,11 +1,90 @@
 #include "debug.h"
 #include "object.h"
+#include "vm.h"
 
-void DisassembleChunk(Chunk *chunk, const char *name) {
+static const char *opcode_names[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NULL] = "OP_NULL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL_SLOT] = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_DEFINE_GLOBAL_SLOT_LONG] = "OP_DEFINE_GLOBAL_SLOT_LONG",
+    [OP_GET_GLOBAL_SLOT_LONG] = "OP_GET_GLOBAL_SLOT_LONG",
+    [OP_SET_GLOBAL_SLOT_LONG] = "OP_SET_GLOBAL_SLOT_LONG",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+    [OP_GET_LOCAL_GET_LOCAL] = "OP_GET_LOCAL_GET_LOCAL",
+    [OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_INCREMENT_LOCAL] = "OP_INCREMENT_LOCAL",
+    [OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+    [OP_GREATER_JUMP_IF_FALSE] = "OP_GREATER_JUMP_IF_FALSE",
+    [OP_MOVE] = "OP_MOVE",
+    [OP_NEGATE_R] = "OP_NEGATE_R",
+    [OP_NOT_R] = "OP_NOT_R",
+    [OP_EQUAL_R] = "OP_EQUAL_R",
+    [OP_GREATER_R] = "OP_GREATER_R",
+    [OP_LESS_R] = "OP_LESS_R",
+    [OP_ADD_R] = "OP_ADD_R",
+    [OP_SUBTRACT_R] = "OP_SUBTRACT_R",
+    [OP_MULTIPLY_R] = "OP_MULTIPLY_R",
+    [OP_DIVIDE_R] = "OP_DIVIDE_R",
+    [OP_EQUAL_JUMP_R] = "OP_EQUAL_JUMP_R",
+    [OP_GREATER_JUMP_R] = "OP_GREATER_JUMP_R",
+    [OP_LESS_JUMP_R] = "OP_LESS_JUMP_R",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LOOP_TRACE] = "OP_LOOP_TRACE",
+};
+
+const char *OpcodeName(uint8_t opcode) {
+  if (opcode >= sizeof(opcode_names) / sizeof(opcode_names[0]) ||
+      opcode_names[opcode] == NULL) {
+    return "OP_UNKNOWN";
+  }
+  return opcode_names[opcode];
+}
+
+void DisassembleChunk(VM *vm, Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
 
   for (int offset = 0; offset < chunk->count;) {
-    offset = DisassembleInstruction(chunk, offset);
+    offset = DisassembleInstruction(vm, chunk, offset);
   }
 }
 
@@ -22,26 +101,131 @@ static int ConstantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int WideConstantInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  int constant = ReadWideOperand(&chunk->code[offset + 1]);
+  printf("%-16s %4d '", name, constant);
+  PrintValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
 static int ByteInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t slot = chunk->code[offset + 1];
   printf("%-16s %4d\n", name, slot);
   return offset + 2;
 }
 
-static int JumpInstruction(const char *name, int sign, Chunk *chunk,
-                           int offset) {
-  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-  jump |= chunk->code[offset + 2];
-  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+static int WideSlotInstruction(const char *name, Chunk *chunk, int offset) {
+  int slot = ReadWideOperand(&chunk->code[offset + 1]);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 4;
+}
+
+static int LocalPairInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+static int LocalConstantInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  PrintValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int GlobalInstruction(VM *vm, const char *name, Chunk *chunk,
+                             int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '%s'\n", name, slot,
+         AS_CSTRING(vm->global_names.values[slot]));
   return offset + 3;
 }
 
-int DisassembleInstruction(Chunk *chunk, int offset) {
+static int WideGlobalInstruction(VM *vm, const char *name, Chunk *chunk,
+                                 int offset) {
+  int slot = ReadWideOperand(&chunk->code[offset + 1]);
+  printf("%-16s %4d '%s'\n", name, slot,
+         AS_CSTRING(vm->global_names.values[slot]));
+  return offset + 4;
+}
+
+static int ClosureInstruction(const char *name, Chunk *chunk, int offset) {
+  int constant;
+  if (chunk->code[offset] == OP_CLOSURE_LONG) {
+    constant = ReadWideOperand(&chunk->code[offset + 1]);
+    offset += 4;
+  } else {
+    constant = chunk->code[offset + 1];
+    offset += 2;
+  }
+  printf("%-16s %4d ", name, constant);
+  PrintValue(chunk->constants.values[constant]);
+  printf("\n");
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int j = 0; j < function->upvalue_count; j++) {
+    int is_local = chunk->code[offset++];
+    int index = chunk->code[offset++];
+    printf("%04d      |                     %s %d\n", offset - 2,
+           is_local ? "local" : "upvalue", index);
+  }
+  return offset;
+}
+
+static int JumpInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d -> %d\n", name, offset, JumpTarget(chunk, offset));
+  return offset + InstructionLength(chunk, offset);
+}
+
+static void PrintRegisterOperand(Chunk *chunk, uint8_t operand) {
+  if (operand & RK_CONSTANT) {
+    int constant = operand & ~RK_CONSTANT;
+    printf(" k%d '", constant);
+    PrintValue(chunk->constants.values[constant]);
+    printf("'");
+  } else {
+    printf(" r%d", operand);
+  }
+}
+
+// Prints a register form as its destination, its sources and, in brackets,
+// the stack top it leaves.
+static int RegisterInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code[offset];
+  int length = InstructionLength(chunk, offset);
+  printf("%-16s r%d =", name, code[1]);
+  PrintRegisterOperand(chunk, code[2]);
+  if (length == 5) {
+    PrintRegisterOperand(chunk, code[3]);
+  }
+  printf(" [%d]\n", code[length - 1]);
+  return offset + length;
+}
+
+static int RegisterJumpInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint8_t *code = &chunk->code[offset];
+  printf("%-16s", name);
+  PrintRegisterOperand(chunk, code[2]);
+  PrintRegisterOperand(chunk, code[3]);
+  printf(" [%d] %s -> %d\n", code[4], code[1] ? "true" : "false",
+         JumpTarget(chunk, offset));
+  return offset + 8;
+}
+
+int DisassembleInstruction(VM *vm, Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = GetLine(chunk, offset);
+  if (offset > 0 && line == GetLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -56,12 +240,12 @@ int DisassembleInstruction(Chunk *chunk, int offset) {
     return SimpleInstruction("OP_FALSE", offset);
   case OP_POP:
     return SimpleInstruction("OP_POP", offset);
-  case OP_DEFINE_GLOBAL:
-    return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-  case OP_GET_GLOBAL:
-    return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
-  case OP_SET_GLOBAL:
-    return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_DEFINE_GLOBAL_SLOT:
+    return GlobalInstruction(vm, "OP_DEFINE_GLOBAL_SLOT", chunk, offset);
+  case OP_GET_GLOBAL_SLOT:
+    return GlobalInstruction(vm, "OP_GET_GLOBAL_SLOT", chunk, offset);
+  case OP_SET_GLOBAL_SLOT:
+    return GlobalInstruction(vm, "OP_SET_GLOBAL_SLOT", chunk, offset);
   case OP_GET_LOCAL:
     return ByteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_LOCAL:
@@ -91,32 +275,82 @@ int DisassembleInstruction(Chunk *chunk, int offset) {
   case OP_PRINT:
     return SimpleInstruction("OP_PRINT", offset);
   case OP_JUMP:
-    return JumpInstruction("OP_JUMP", 1, chunk, offset);
+    return JumpInstruction("OP_JUMP", chunk, offset);
   case OP_JUMP_IF_FALSE:
-    return JumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    return JumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
   case OP_LOOP:
-    return JumpInstruction("OP_LOOP", -1, chunk, offset);
+    return JumpInstruction("OP_LOOP", chunk, offset);
   case OP_CALL:
     return ByteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return ByteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_CLOSURE:
-    offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
-    PrintValue(chunk->constants.values[constant]);
-    printf("\n");
-    ObjFunction *function = AS_FUNCTION(
-        chunk->constants.values[constant]);
-    for (int j = 0; j < function->upvalue_count; j++) {
-      int is_local = chunk->code[offset++];
-      int index = chunk->code[offset++];
-      printf("%04d      |                     %s %d\n",
-             offset - 2, is_local ? "local" : "upvalue", index);
-    }
-    return offset;
+    return ClosureInstruction("OP_CLOSURE", chunk, offset);
   case OP_CLOSE_UPVALUE:
     return SimpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_RETURN:
     return SimpleInstruction("OP_RETURN", offset);
+  case OP_CONSTANT_LONG:
+    return WideConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_CLOSURE_LONG:
+    return ClosureInstruction("OP_CLOSURE_LONG", chunk, offset);
+  case OP_DEFINE_GLOBAL_SLOT_LONG:
+    return WideGlobalInstruction(vm, "OP_DEFINE_GLOBAL_SLOT_LONG", chunk,
+                                 offset);
+  case OP_GET_GLOBAL_SLOT_LONG:
+    return WideGlobalInstruction(vm, "OP_GET_GLOBAL_SLOT_LONG", chunk,
+                                 offset);
+  case OP_SET_GLOBAL_SLOT_LONG:
+    return WideGlobalInstruction(vm, "OP_SET_GLOBAL_SLOT_LONG", chunk,
+                                 offset);
+  case OP_GET_LOCAL_LONG:
+    return WideSlotInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+  case OP_SET_LOCAL_LONG:
+    return WideSlotInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+  case OP_JUMP_LONG:
+    return JumpInstruction("OP_JUMP_LONG", chunk, offset);
+  case OP_JUMP_IF_FALSE_LONG:
+    return JumpInstruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
+  case OP_LOOP_LONG:
+    return JumpInstruction("OP_LOOP_LONG", chunk, offset);
+  case OP_GET_LOCAL_GET_LOCAL:
+    return LocalPairInstruction("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+  case OP_GET_LOCAL_CONSTANT:
+    return LocalConstantInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return ByteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_INCREMENT_LOCAL:
+    return LocalConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+  case OP_LESS_JUMP_IF_FALSE:
+    return JumpInstruction("OP_LESS_JUMP_IF_FALSE", chunk, offset);
+  case OP_GREATER_JUMP_IF_FALSE:
+    return JumpInstruction("OP_GREATER_JUMP_IF_FALSE", chunk, offset);
+  case OP_MOVE:
+    return RegisterInstruction("OP_MOVE", chunk, offset);
+  case OP_NEGATE_R:
+    return RegisterInstruction("OP_NEGATE_R", chunk, offset);
+  case OP_NOT_R:
+    return RegisterInstruction("OP_NOT_R", chunk, offset);
+  case OP_EQUAL_R:
+    return RegisterInstruction("OP_EQUAL_R", chunk, offset);
+  case OP_GREATER_R:
+    return RegisterInstruction("OP_GREATER_R", chunk, offset);
+  case OP_LESS_R:
+    return RegisterInstruction("OP_LESS_R", chunk, offset);
+  case OP_ADD_R:
+    return RegisterInstruction("OP_ADD_R", chunk, offset);
+  case OP_SUBTRACT_R:
+    return RegisterInstruction("OP_SUBTRACT_R", chunk, offset);
+  case OP_MULTIPLY_R:
+    return RegisterInstruction("OP_MULTIPLY_R", chunk, offset);
+  case OP_DIVIDE_R:
+    return RegisterInstruction("OP_DIVIDE_R", chunk, offset);
+  case OP_EQUAL_JUMP_R:
+    return RegisterJumpInstruction("OP_EQUAL_JUMP_R", chunk, offset);
+  case OP_GREATER_JUMP_R:
+    return RegisterJumpInstruction("OP_GREATER_JUMP_R", chunk, offset);
+  case OP_LESS_JUMP_R:
+    return RegisterJumpInstruction("OP_LESS_JUMP_R", chunk, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
@@ -0,0 +1,406 @@
+#include "ir.h"
+#include "memory.h"
+
+// The form a node keeps `opcode` in: operands in their short form, jumps in
+// their wide one.
+static uint8_t NodeForm(uint8_t opcode) {
+  switch (opcode) {
+  case OP_CONSTANT_LONG:
+    return OP_CONSTANT;
+  case OP_CLOSURE_LONG:
+    return OP_CLOSURE;
+  case OP_DEFINE_GLOBAL_SLOT_LONG:
+    return OP_DEFINE_GLOBAL_SLOT;
+  case OP_GET_GLOBAL_SLOT_LONG:
+    return OP_GET_GLOBAL_SLOT;
+  case OP_SET_GLOBAL_SLOT_LONG:
+    return OP_SET_GLOBAL_SLOT;
+  case OP_GET_LOCAL_LONG:
+    return OP_GET_LOCAL;
+  case OP_SET_LOCAL_LONG:
+    return OP_SET_LOCAL;
+  case OP_JUMP:
+    return OP_JUMP_LONG;
+  case OP_JUMP_IF_FALSE:
+    return OP_JUMP_IF_FALSE_LONG;
+  case OP_LOOP:
+    return OP_LOOP_LONG;
+  default:
+    return opcode;
+  }
+}
+
+static uint8_t WideForm(uint8_t opcode) {
+  switch (opcode) {
+  case OP_CONSTANT:
+    return OP_CONSTANT_LONG;
+  case OP_CLOSURE:
+    return OP_CLOSURE_LONG;
+  case OP_DEFINE_GLOBAL_SLOT:
+    return OP_DEFINE_GLOBAL_SLOT_LONG;
+  case OP_GET_GLOBAL_SLOT:
+    return OP_GET_GLOBAL_SLOT_LONG;
+  case OP_SET_GLOBAL_SLOT:
+    return OP_SET_GLOBAL_SLOT_LONG;
+  case OP_GET_LOCAL:
+    return OP_GET_LOCAL_LONG;
+  default:
+    return OP_SET_LOCAL_LONG;
+  }
+}
+
+// The operand of the instruction at `offset`, other than a jump's.
+static int DecodeOperand(Chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CLOSURE:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return code[1];
+  case OP_DEFINE_GLOBAL_SLOT:
+  case OP_GET_GLOBAL_SLOT:
+  case OP_SET_GLOBAL_SLOT:
+    return (code[1] << 8) | code[2];
+  case OP_CONSTANT_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_DEFINE_GLOBAL_SLOT_LONG:
+  case OP_GET_GLOBAL_SLOT_LONG:
+  case OP_SET_GLOBAL_SLOT_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL_LONG:
+    return ReadWideOperand(&code[1]);
+  default:
+    return 0;
+  }
+}
+
+void Lift(Ir *ir, Chunk *chunk, int arity) {
+  ir->chunk = chunk;
+  ir->arity = arity;
+  ir->captures = NULL;
+  ir->capture_count = 0;
+  ir->capture_capacity = 0;
+  ir->heights = NULL;
+  ir->incoming = NULL;
+  ir->first_source = NULL;
+  ir->last_source = NULL;
+  ir->max_height = 0;
+
+  int *index_of = ALLOCATE(int, chunk->count + 1);
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += InstructionLength(chunk, offset)) {
+    index_of[offset] = count++;
+  }
+  index_of[chunk->count] = count;
+  ir->nodes = ALLOCATE(Node, count);
+  ir->count = count;
+  ir->capacity = count;
+
+  int index = 0;
+  int run = 0; // Of the line table, which is in order of offset too.
+  for (int offset = 0; offset < chunk->count;
+       offset += InstructionLength(chunk, offset)) {
+    Node *node = &ir->nodes[index++];
+    uint8_t opcode = chunk->code[offset];
+    while (run + 1 < chunk->line_count &&
+           chunk->lines[run + 1].offset <= offset) {
+      run++;
+    }
+    node->opcode = NodeForm(opcode);
+    node->operand = IsJump(opcode) ? index_of[JumpTarget(chunk, offset)]
+                                   : DecodeOperand(chunk, offset);
+    node->line = run < chunk->line_count ? chunk->lines[run].line : 0;
+    node->captures = -1;
+    node->dead = false;
+    // A closure with no upvalues has no pairs, and `captures` may still be
+    // NULL.
+    int length = node->opcode == OP_CLOSURE ? 2 * CaptureCount(ir, node) : 0;
+    if (length > 0) {
+      if (ir->capture_capacity < ir->capture_count + length) {
+        int old_capacity = ir->capture_capacity;
+        ir->capture_capacity = GROW_CAPACITY(old_capacity);
+        while (ir->capture_capacity < ir->capture_count + length) {
+          ir->capture_capacity = GROW_CAPACITY(ir->capture_capacity);
+        }
+        ir->captures = GROW_ARRAY(uint8_t, ir->captures, old_capacity,
+                                  ir->capture_capacity);
+      }
+      memcpy(&ir->captures[ir->capture_count],
+             &chunk->code[offset + InstructionLength(chunk, offset) - length],
+             length);
+      node->captures = ir->capture_count;
+      ir->capture_count += length;
+    }
+  }
+  FREE_ARRAY(int, index_of, chunk->count + 1);
+}
+
+int NodeEffect(Node *node) {
+  switch (node->opcode) {
+  case OP_CONSTANT:
+  case OP_NULL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_GLOBAL_SLOT:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL_SLOT:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+    return -1;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -node->operand;
+  default:
+    return 0;
+  }
+}
+
+void FreeAnalysis(Ir *ir) {
+  FREE_ARRAY(int, ir->heights, ir->capacity + 1);
+  FREE_ARRAY(int, ir->incoming, ir->capacity + 1);
+  FREE_ARRAY(int, ir->first_source, ir->capacity + 1);
+  FREE_ARRAY(int, ir->last_source, ir->capacity + 1);
+  ir->heights = NULL;
+  ir->incoming = NULL;
+  ir->first_source = NULL;
+  ir->last_source = NULL;
+}
+
+// Points jumps at deleted nodes on to the next live one, and works out the
+// stack heights and which jumps land where. Heights travel along forward
+// jumps the way StackSize() in vm.c finds them.
+void Analyze(Ir *ir) {
+  FreeAnalysis(ir);
+  int count = ir->count;
+  ir->heights = ALLOCATE(int, ir->capacity + 1);
+  ir->incoming = ALLOCATE(int, ir->capacity + 1);
+  ir->first_source = ALLOCATE(int, ir->capacity + 1);
+  ir->last_source = ALLOCATE(int, ir->capacity + 1);
+  for (int i = 0; i <= count; i++) {
+    ir->heights[i] = -1;
+    ir->incoming[i] = 0;
+    ir->first_source[i] = -1;
+    ir->last_source[i] = -1;
+  }
+  for (int i = 0; i < count; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead || !IsWideJump(node->opcode)) {
+      continue;
+    }
+    while (node->operand < count && ir->nodes[node->operand].dead) {
+      node->operand++;
+    }
+    ir->incoming[node->operand]++;
+    if (ir->first_source[node->operand] == -1) {
+      ir->first_source[node->operand] = i;
+    }
+    ir->last_source[node->operand] = i;
+  }
+
+  int height = ir->arity + 1;
+  ir->max_height = height;
+  bool falls_through = true;
+  for (int i = 0; i < count; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead) {
+      continue;
+    }
+    if (ir->heights[i] > height || (ir->heights[i] >= 0 && !falls_through)) {
+      height = ir->heights[i];
+    }
+    ir->heights[i] = height;
+    height += NodeEffect(node);
+    if (height > ir->max_height) {
+      ir->max_height = height;
+    }
+    if (node->opcode == OP_JUMP_LONG || node->opcode == OP_JUMP_IF_FALSE_LONG) {
+      if (ir->heights[node->operand] < height) {
+        ir->heights[node->operand] = height;
+      }
+    }
+    falls_through = FallsThrough(node);
+  }
+}
+
+static int NodeLength(Ir *ir, Node *node) {
+  switch (node->opcode) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+    return node->operand <= UINT8_MAX ? 2 : 4;
+  case OP_CLOSURE:
+    return (node->operand <= UINT8_MAX ? 2 : 4) + 2 * CaptureCount(ir, node);
+  case OP_DEFINE_GLOBAL_SLOT:
+  case OP_GET_GLOBAL_SLOT:
+  case OP_SET_GLOBAL_SLOT:
+    return node->operand <= UINT16_MAX ? 3 : 4;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return 2;
+  case OP_JUMP_LONG:
+  case OP_JUMP_IF_FALSE_LONG:
+  case OP_LOOP_LONG:
+  case OP_MOVE:
+  case OP_NEGATE_R:
+  case OP_NOT_R:
+    return 4;
+  case OP_EQUAL_R:
+  case OP_GREATER_R:
+  case OP_LESS_R:
+  case OP_ADD_R:
+  case OP_SUBTRACT_R:
+  case OP_MULTIPLY_R:
+  case OP_DIVIDE_R:
+    return 5;
+  case OP_EQUAL_JUMP_R:
+  case OP_GREATER_JUMP_R:
+  case OP_LESS_JUMP_R:
+    return 8;
+  default:
+    return 1;
+  }
+}
+
+static void WriteWide(uint8_t *code, int operand) {
+  code[0] = (operand >> 16) & 0xff;
+  code[1] = (operand >> 8) & 0xff;
+  code[2] = operand & 0xff;
+}
+
+// Lays the live nodes out as the chunk's new code and line table.
+void Lower(Ir *ir) {
+  Chunk *chunk = ir->chunk;
+  int *offsets = ALLOCATE(int, ir->count + 1);
+  int size = 0;
+  for (int i = 0; i < ir->count; i++) {
+    offsets[i] = size;
+    if (!ir->nodes[i].dead) {
+      size += NodeLength(ir, &ir->nodes[i]);
+    }
+  }
+  offsets[ir->count] = size;
+
+  uint8_t *code = ALLOCATE(uint8_t, size);
+  FREE_ARRAY(LineRun, chunk->lines, chunk->line_capacity);
+  chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
+  for (int i = 0; i < ir->count; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead) {
+      continue;
+    }
+    uint8_t *out = &code[offsets[i]];
+    AddLine(chunk, offsets[i], node->line);
+    switch (node->opcode) {
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG: {
+      int end = offsets[i] + 4;
+      int target = offsets[node->operand];
+      out[0] = node->opcode;
+      WriteWide(&out[1],
+                node->opcode == OP_LOOP_LONG ? end - target : target - end);
+      break;
+    }
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CLOSURE: {
+      int length = 2;
+      if (node->operand <= UINT8_MAX) {
+        out[0] = node->opcode;
+        out[1] = (uint8_t)node->operand;
+      } else {
+        out[0] = WideForm(node->opcode);
+        WriteWide(&out[1], node->operand);
+        length = 4;
+      }
+      if (node->opcode == OP_CLOSURE && CaptureCount(ir, node) > 0) {
+        memcpy(&out[length], &ir->captures[node->captures],
+               2 * CaptureCount(ir, node));
+      }
+      break;
+    }
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+      if (node->operand <= UINT16_MAX) {
+        out[0] = node->opcode;
+        out[1] = (node->operand >> 8) & 0xff;
+        out[2] = node->operand & 0xff;
+      } else {
+        out[0] = WideForm(node->opcode);
+        WriteWide(&out[1], node->operand);
+      }
+      break;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      out[0] = node->opcode;
+      out[1] = (uint8_t)node->operand;
+      break;
+    case OP_MOVE:
+    case OP_NEGATE_R:
+    case OP_NOT_R:
+      out[0] = node->opcode;
+      out[1] = node->a;
+      out[2] = node->b;
+      out[3] = node->top;
+      break;
+    case OP_EQUAL_JUMP_R:
+    case OP_GREATER_JUMP_R:
+    case OP_LESS_JUMP_R:
+      WriteWide(&out[5], offsets[node->operand] - (offsets[i] + 8));
+      // Fall through.
+    case OP_EQUAL_R:
+    case OP_GREATER_R:
+    case OP_LESS_R:
+    case OP_ADD_R:
+    case OP_SUBTRACT_R:
+    case OP_MULTIPLY_R:
+    case OP_DIVIDE_R:
+      out[0] = node->opcode;
+      out[1] = node->a;
+      out[2] = node->b;
+      out[3] = node->c;
+      out[4] = node->top;
+      break;
+    default:
+      out[0] = node->opcode;
+      break;
+    }
+  }
+  FREE_ARRAY(int, offsets, ir->count + 1);
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  chunk->code = code;
+  chunk->count = size;
+  chunk->capacity = size;
+}
+
+void FreeIr(Ir *ir) {
+  FreeAnalysis(ir);
+  FREE_ARRAY(Node, ir->nodes, ir->capacity);
+  FREE_ARRAY(uint8_t, ir->captures, ir->capture_capacity);
+}
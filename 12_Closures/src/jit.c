@@ -0,0 +1,1461 @@
+#include "jit.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+// A baseline compiler: every decoded instruction becomes a fixed template of
+// x86-64 code. Stack traffic, locals, globals, upvalues, number arithmetic
+// and branches are emitted inline; everything else calls a C helper that
+// works on the VM exactly like Run() does. Compiled code keeps the VM stack
+// in vm->stack, so frames move freely between it and the interpreter.
+//
+// Register use inside compiled code:
+//   rbx  stack top           r12  frame->slots
+//   r13  the CallFrame       r15  the VM
+// rax, rcx, rdx, xmm0 and xmm1 are scratch.
+
+typedef enum {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+} Register;
+
+#define XMM0 0
+#define XMM1 1
+
+typedef enum {
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_P = 0xa, // An unordered comparison: one operand was NaN.
+  CC_ALWAYS = -1,
+} Condition;
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#define TOP (-VALUE_SIZE)
+#define SECOND (-2 * VALUE_SIZE)
+
+#ifdef NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int32_t)offsetof(Value, as.number))
+#define TYPE_OFFSET ((int32_t)offsetof(Value, type))
+#define BOOL_OFFSET ((int32_t)offsetof(Value, as.boolean))
+#endif
+
+#define STACK_TOP_OFFSET ((int32_t)offsetof(VM, stack_top))
+#define FRAMES_OFFSET ((int32_t)offsetof(VM, frames))
+#define FRAME_COUNT_OFFSET ((int32_t)offsetof(VM, frame_count))
+#define GLOBALS_OFFSET                                                         \
+  ((int32_t)(offsetof(VM, global_values) + offsetof(ValueArray, values)))
+
+typedef struct {
+  int at;     // Offset of the rel32 to fill in.
+  int target; // Instruction index.
+} Fixup;
+
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+  int *labels; // Native offset of each instruction.
+  Fixup *fixups;
+  int fixup_count;
+  int fixup_capacity;
+  int *errors; // Jumps to the runtime error exit.
+  int error_count;
+  int error_capacity;
+} Assembler;
+
+typedef InterpretResult (*JitCode)(VM *vm, CallFrame *frame);
+
+// Returned by compiled code whose frame now belongs to a tail-called
+// function, which JitRun() then runs in its place.
+#define JIT_TAIL_CALL (INTERPRET_SWITCHED + 1)
+
+// Helpers called from compiled code. The instruction before them has stored
+// the stack top in vm->stack_top and the next instruction in frame->ip, so
+// they see the same state Run() would. Those that can fail return nonzero
+// after reporting the error.
+
+static int JitArithmetic(VM *vm, int opcode) {
+  Value b = vm->stack_top[-1];
+  Value a = vm->stack_top[-2];
+  if (opcode == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    Concatenate(vm);
+    return 0;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    RuntimeError(vm, opcode == OP_ADD
+                     ? "Operands must be two numbers or two strings."
+                     : "Operands must be numbers.");
+    return 1;
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  Value result;
+  switch (opcode) {
+  case OP_ADD:
+    result = NUMBER_VAL(x + y);
+    break;
+  case OP_SUBTRACT:
+    result = NUMBER_VAL(x - y);
+    break;
+  case OP_MULTIPLY:
+    result = NUMBER_VAL(x * y);
+    break;
+  case OP_DIVIDE:
+    result = NUMBER_VAL(x / y);
+    break;
+  case OP_LESS:
+    result = BOOL_VAL(x < y);
+    break;
+  default:
+    result = BOOL_VAL(x > y);
+    break;
+  }
+  vm->stack_top--;
+  vm->stack_top[-1] = result;
+  return 0;
+}
+
+static int JitComparisonError(VM *vm) {
+  RuntimeError(vm, "Operands must be numbers.");
+  return 1;
+}
+
+static int JitNot(VM *vm) {
+  Value value = vm->stack_top[-1];
+  if (!IS_BOOL(value)) {
+    RuntimeError(vm, "Operand must be a boolean.");
+    return 1;
+  }
+  vm->stack_top[-1] = BOOL_VAL(!AS_BOOL(value));
+  return 0;
+}
+
+static int JitNegate(VM *vm) {
+  Value value = vm->stack_top[-1];
+  if (!IS_NUMBER(value)) {
+    RuntimeError(vm, "Operand must be a number.");
+    return 1;
+  }
+  vm->stack_top[-1] = NUMBER_VAL(-AS_NUMBER(value));
+  return 0;
+}
+
+static void JitEqual(VM *vm) {
+  Value b = Pop(vm);
+  Value a = Pop(vm);
+  Push(vm, BOOL_VAL(ValueEqual(a, b)));
+}
+
+static void JitPrint(VM *vm) {
+  PrintValue(Pop(vm));
+  printf("\n");
+}
+
+static int JitUndefinedVariable(VM *vm, int slot) {
+  RuntimeError(vm, "Undefined variable '%s'.",
+               AS_CSTRING(vm->global_names.values[slot]));
+  return 1;
+}
+
+static int JitIncrementLocal(VM *vm, CallFrame *frame,
+                             Instruction *instruction) {
+  Value *local = &frame->slots[instruction->arg];
+  Value increment = *instruction->as.constant;
+  if (IS_NUMBER(*local) && IS_NUMBER(increment)) {
+    *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(increment));
+  } else if (IS_STRING(*local) && IS_STRING(increment)) {
+    Push(vm, *local);
+    Push(vm, increment);
+    Concatenate(vm);
+    *local = Pop(vm);
+  } else {
+    RuntimeError(vm, "Operands must be two numbers or two strings.");
+    return 1;
+  }
+  return 0;
+}
+
+// Runs the callee to completion before returning, so compiled code never has
+// to resume in the middle of a function. Returns INTERPRET_SWITCHED if the
+// call switched fibers instead; the compiled code then returns too, leaving
+// its frame to be interpreted when its fiber is resumed.
+static int JitCall(VM *vm, int arg_count) {
+  ObjFiber *fiber = vm->fiber;
+  int depth = vm->frame_count;
+  if (!CallValue(vm, vm->stack_top[-1 - arg_count], arg_count)) {
+    return 1;
+  }
+  if (vm->fiber != fiber) {
+    return INTERPRET_SWITCHED;
+  }
+  if (vm->frame_count == depth) {
+    return 0; // A native function, already done.
+  }
+  CallFrame *callee = &vm->frames[vm->frame_count - 1];
+  InterpretResult result = callee->closure->function->jit_code != NULL
+                               ? JitRun(vm, callee)
+                               : Run(vm, depth);
+  return result == INTERPRET_SWITCHED ? INTERPRET_SWITCHED
+                                      : result != INTERPRET_OK;
+}
+
+// Returns JIT_TAIL_CALL once the callee has taken over the frame; otherwise
+// makes an ordinary call, as JitCall does.
+static int JitTailCall(VM *vm, int arg_count) {
+  return TailCall(vm, arg_count) ? JIT_TAIL_CALL : JitCall(vm, arg_count);
+}
+
+static void JitClosure(VM *vm, CallFrame *frame, Instruction *instruction) {
+  ObjFunction *function = AS_FUNCTION(*instruction->as.constant);
+  uint8_t *captures =
+      frame->closure->function->chunk.code + instruction->offset +
+      instruction->arg;
+  ObjClosure *closure = NewClosure(vm, function);
+  Push(vm, OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalue_count; i++) {
+    uint8_t is_local = *captures++;
+    uint8_t index = *captures++;
+    if (is_local) {
+      closure->upvalues[i] = CaptureUpvalue(vm, frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+}
+
+static void JitCloseUpvalue(VM *vm) {
+  CloseUpvalues(vm, vm->stack_top - 1);
+  Pop(vm);
+}
+
+// Returns INTERPRET_SWITCHED if this ended a fiber other than the main one.
+static int JitReturn(VM *vm, CallFrame *frame) {
+  Value result = Pop(vm);
+  CloseUpvalues(vm, frame->slots);
+  vm->frame_count--;
+  if (vm->frame_count == 0) {
+    Pop(vm);
+    if (vm->fiber->caller == NULL) {
+      return 0;
+    }
+    FinishFiber(vm, result);
+    return INTERPRET_SWITCHED;
+  }
+  vm->stack_top = frame->slots;
+  Push(vm, result);
+  return 0;
+}
+
+// Encoding.
+
+static void Emit(Assembler *as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    int old_capacity = as->capacity;
+    as->capacity = GROW_CAPACITY(old_capacity);
+    as->code = GROW_ARRAY(uint8_t, as->code, old_capacity, as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void Emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    Emit(as, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+static void Emit64(Assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    Emit(as, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+static void Rex(Assembler *as, bool wide, int reg, int base) {
+  uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40) {
+    Emit(as, rex);
+  }
+}
+
+// ModRM for [base + disp32].
+static void Memory(Assembler *as, int reg, int base, int32_t disp) {
+  Emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    Emit(as, 0x24);
+  }
+  Emit32(as, (uint32_t)disp);
+}
+
+static void Direct(Assembler *as, int reg, int rm) {
+  Emit(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void MovImm(Assembler *as, Register reg, uint64_t imm) {
+  Rex(as, true, 0, reg);
+  Emit(as, 0xb8 + (reg & 7));
+  Emit64(as, imm);
+}
+
+static void Load(Assembler *as, Register reg, Register base, int32_t disp) {
+  Rex(as, true, reg, base);
+  Emit(as, 0x8b);
+  Memory(as, reg, base, disp);
+}
+
+static void Store(Assembler *as, Register base, int32_t disp, Register reg) {
+  Rex(as, true, reg, base);
+  Emit(as, 0x89);
+  Memory(as, reg, base, disp);
+}
+
+static void MovReg(Assembler *as, Register dst, Register src) {
+  Rex(as, true, src, dst);
+  Emit(as, 0x89);
+  Direct(as, src, dst);
+}
+
+static void AddImm(Assembler *as, Register reg, int32_t imm) {
+  Rex(as, true, 0, reg);
+  Emit(as, 0x81);
+  Direct(as, imm < 0 ? 5 : 0, reg);
+  Emit32(as, (uint32_t)(imm < 0 ? -imm : imm));
+}
+
+static void AddReg(Assembler *as, Register dst, Register src) {
+  Rex(as, true, src, dst);
+  Emit(as, 0x01);
+  Direct(as, src, dst);
+}
+
+#ifdef NAN_BOXING
+static void AndReg(Assembler *as, Register dst, Register src) {
+  Rex(as, true, src, dst);
+  Emit(as, 0x21);
+  Direct(as, src, dst);
+}
+
+static void CmpReg(Assembler *as, Register a, Register b) {
+  Rex(as, true, b, a);
+  Emit(as, 0x39);
+  Direct(as, b, a);
+}
+
+static void CmpRegMem(Assembler *as, Register reg, Register base,
+                      int32_t disp) {
+  Rex(as, true, reg, base);
+  Emit(as, 0x3b);
+  Memory(as, reg, base, disp);
+}
+#else
+static void Cmp32Imm(Assembler *as, Register base, int32_t disp,
+                     uint32_t imm) {
+  Rex(as, false, 0, base);
+  Emit(as, 0x81);
+  Memory(as, 7, base, disp);
+  Emit32(as, imm);
+}
+
+static void Cmp8Imm(Assembler *as, Register base, int32_t disp, uint8_t imm) {
+  Rex(as, false, 0, base);
+  Emit(as, 0x80);
+  Memory(as, 7, base, disp);
+  Emit(as, imm);
+}
+#endif
+
+// An SSE2 scalar double instruction with a memory operand: movsd (0x10 load,
+// 0x11 store), addsd, subsd, mulsd or divsd.
+static void Sse(Assembler *as, uint8_t prefix, uint8_t opcode, int xmm,
+                Register base, int32_t disp) {
+  Emit(as, prefix);
+  Rex(as, false, xmm, base);
+  Emit(as, 0x0f);
+  Emit(as, opcode);
+  Memory(as, xmm, base, disp);
+}
+
+// The same between two registers: also movapd (0x28), ucomisd (0x2e) and
+// xorpd (0x57) behind 0x66.
+static void SseReg(Assembler *as, uint8_t prefix, uint8_t opcode, int dst,
+                   int src) {
+  Emit(as, prefix);
+  Rex(as, false, dst, src);
+  Emit(as, 0x0f);
+  Emit(as, opcode);
+  Direct(as, dst, src);
+}
+
+static void Ucomisd(Assembler *as, int a, int b) {
+  SseReg(as, 0x66, 0x2e, a, b);
+}
+
+static void MovXmmRax(Assembler *as, int xmm) {
+  Emit(as, 0x66);
+  Rex(as, true, xmm, RAX);
+  Emit(as, 0x0f);
+  Emit(as, 0x6e);
+  Direct(as, xmm, RAX);
+}
+
+static void Lea(Assembler *as, Register reg, Register base, int32_t disp) {
+  Rex(as, true, reg, base);
+  Emit(as, 0x8d);
+  Memory(as, reg, base, disp);
+}
+
+static void TestEax(Assembler *as) {
+  Emit(as, 0x85);
+  Emit(as, 0xc0);
+}
+
+static void CmpEax(Assembler *as, int8_t value) {
+  Emit(as, 0x83); // cmp eax, imm8
+  Emit(as, 0xf8);
+  Emit(as, (uint8_t)value);
+}
+
+static void PushReg(Assembler *as, Register reg) {
+  Rex(as, false, 0, reg);
+  Emit(as, 0x50 + (reg & 7));
+}
+
+static void PopReg(Assembler *as, Register reg) {
+  Rex(as, false, 0, reg);
+  Emit(as, 0x58 + (reg & 7));
+}
+
+// Calls a helper with the VM as its first argument; any others must already
+// be in rsi and rdx.
+static void CallFunction(Assembler *as, void *function) {
+  MovReg(as, RDI, R15);
+  MovImm(as, RAX, (uint64_t)(uintptr_t)function);
+  Emit(as, 0xff);
+  Emit(as, 0xd0);
+}
+
+// Emits a jump with an empty rel32 and returns where that rel32 is.
+static int Jump(Assembler *as, Condition condition) {
+  if (condition == CC_ALWAYS) {
+    Emit(as, 0xe9);
+  } else {
+    Emit(as, 0x0f);
+    Emit(as, 0x80 | condition);
+  }
+  Emit32(as, 0);
+  return as->count - 4;
+}
+
+static void PatchAt(Assembler *as, int at, int destination) {
+  uint32_t rel = (uint32_t)(destination - (at + 4));
+  memcpy(&as->code[at], &rel, sizeof(rel));
+}
+
+static void Patch(Assembler *as, int at) { PatchAt(as, at, as->count); }
+
+static void JumpTo(Assembler *as, Condition condition, int target) {
+  if (as->fixup_capacity < as->fixup_count + 1) {
+    int old_capacity = as->fixup_capacity;
+    as->fixup_capacity = GROW_CAPACITY(old_capacity);
+    as->fixups =
+        GROW_ARRAY(Fixup, as->fixups, old_capacity, as->fixup_capacity);
+  }
+  as->fixups[as->fixup_count].at = Jump(as, condition);
+  as->fixups[as->fixup_count].target = target;
+  as->fixup_count++;
+}
+
+static void JumpToError(Assembler *as, Condition condition) {
+  if (as->error_capacity < as->error_count + 1) {
+    int old_capacity = as->error_capacity;
+    as->error_capacity = GROW_CAPACITY(old_capacity);
+    as->errors =
+        GROW_ARRAY(int, as->errors, old_capacity, as->error_capacity);
+  }
+  as->errors[as->error_count++] = Jump(as, condition);
+}
+
+// Templates for Values.
+
+static void CopyValue(Assembler *as, Register dst, int32_t dst_disp,
+                      Register src, int32_t src_disp) {
+#ifdef NAN_BOXING
+  Load(as, RCX, src, src_disp);
+  Store(as, dst, dst_disp, RCX);
+#else
+  // Two quadword moves rather than one movdqu: every template writes Values
+  // as whole quadwords, so these loads always forward from earlier stores.
+  Load(as, RCX, src, src_disp);
+  Load(as, RDX, src, src_disp + 8);
+  Store(as, dst, dst_disp, RCX);
+  Store(as, dst, dst_disp + 8, RDX);
+#endif
+}
+
+static void StoreLiteral(Assembler *as, Register base, int32_t disp,
+                         Value value) {
+#ifdef NAN_BOXING
+  MovImm(as, RCX, value);
+  Store(as, base, disp, RCX);
+#else
+  uint64_t payload;
+  memcpy(&payload, &value.as, sizeof(payload));
+  MovImm(as, RCX, value.type);
+  Store(as, base, disp + TYPE_OFFSET, RCX);
+  MovImm(as, RCX, payload);
+  Store(as, base, disp + 8, RCX);
+#endif
+}
+
+// Emits a type test and returns the jump taken when the Value at
+// [base + disp] is not a number.
+static int JumpIfNotNumber(Assembler *as, Register base, int32_t disp) {
+#ifdef NAN_BOXING
+  Load(as, RAX, base, disp);
+  MovImm(as, RCX, QNAN);
+  AndReg(as, RAX, RCX);
+  CmpReg(as, RAX, RCX);
+  return Jump(as, CC_E);
+#else
+  Cmp32Imm(as, base, disp + TYPE_OFFSET, VAL_NUMBER);
+  return Jump(as, CC_NE);
+#endif
+}
+
+// Stores true into [base + disp] if the last comparison set `condition`.
+static void StoreCondition(Assembler *as, Condition condition, Register base,
+                           int32_t disp) {
+  Emit(as, 0x0f); // setcc al
+  Emit(as, 0x90 | condition);
+  Emit(as, 0xc0);
+  Emit(as, 0x0f); // movzx eax, al
+  Emit(as, 0xb6);
+  Emit(as, 0xc0);
+#ifdef NAN_BOXING
+  MovImm(as, RCX, FALSE_VAL);
+  AddReg(as, RAX, RCX);
+  Store(as, base, disp, RAX);
+#else
+  MovImm(as, RCX, VAL_BOOL);
+  Store(as, base, disp + TYPE_OFFSET, RCX);
+  Store(as, base, disp + BOOL_OFFSET, RAX);
+#endif
+}
+
+// Hands the VM state to a helper about to be called on behalf of
+// `instruction`, and takes it back afterwards.
+static void SaveState(Assembler *as, Instruction *instruction) {
+  Store(as, R15, STACK_TOP_OFFSET, RBX);
+  MovImm(as, RAX, (uint64_t)(uintptr_t)(instruction + 1));
+  Store(as, R13, (int32_t)offsetof(CallFrame, ip), RAX);
+}
+
+static void LoadState(Assembler *as) {
+  Load(as, RBX, R15, STACK_TOP_OFFSET);
+  Load(as, R12, R13, (int32_t)offsetof(CallFrame, slots));
+}
+
+// Points r13 back at this code's frame, the topmost, after a call that may
+// have grown vm->frames and so moved it.
+static void LoadFrame(Assembler *as) {
+  Rex(as, false, RCX, R15);
+  Emit(as, 0x8b); // mov ecx, frame_count
+  Memory(as, RCX, R15, FRAME_COUNT_OFFSET);
+  Rex(as, true, RCX, RCX);
+  Emit(as, 0x69); // imul rcx, rcx, imm32
+  Direct(as, RCX, RCX);
+  Emit32(as, (uint32_t)sizeof(CallFrame));
+  Load(as, R13, R15, FRAMES_OFFSET);
+  AddReg(as, R13, RCX);
+  AddImm(as, R13, -(int32_t)sizeof(CallFrame));
+}
+
+static void CallHelper(Assembler *as, Instruction *instruction, void *helper,
+                       bool can_fail) {
+  SaveState(as, instruction);
+  CallFunction(as, helper);
+  LoadState(as);
+  if (can_fail) {
+    TestEax(as);
+    JumpToError(as, CC_NE);
+  }
+}
+
+static void Prologue(Assembler *as) {
+  PushReg(as, RBX);
+  PushReg(as, R12);
+  PushReg(as, R13);
+  PushReg(as, R15);
+  AddImm(as, RSP, -8); // Keep the stack 16-byte aligned for calls.
+  MovReg(as, R15, RDI);
+  MovReg(as, R13, RSI);
+  LoadState(as);
+}
+
+static void Epilogue(Assembler *as, InterpretResult result) {
+  Emit(as, 0xb8); // mov eax, imm32
+  Emit32(as, result);
+  AddImm(as, RSP, 8);
+  PopReg(as, R15);
+  PopReg(as, R13);
+  PopReg(as, R12);
+  PopReg(as, RBX);
+  Emit(as, 0xc3);
+}
+
+// Returns INTERPRET_SWITCHED from compiled code if the helper just called
+// did.
+static void ExitIfSwitched(Assembler *as) {
+  CmpEax(as, INTERPRET_SWITCHED);
+  int same_fiber = Jump(as, CC_NE);
+  Epilogue(as, INTERPRET_SWITCHED);
+  Patch(as, same_fiber);
+}
+
+static void GetLocal(Assembler *as, int slot) {
+  CopyValue(as, RBX, 0, R12, slot * VALUE_SIZE);
+  AddImm(as, RBX, VALUE_SIZE);
+}
+
+static void PushConstant(Assembler *as, Value value) {
+  StoreLiteral(as, RBX, 0, value);
+  AddImm(as, RBX, VALUE_SIZE);
+}
+
+static void CheckDefined(Assembler *as, Instruction *instruction,
+                         int32_t disp) {
+#ifdef NAN_BOXING
+  MovImm(as, RCX, UNDEFINED_VAL);
+  CmpRegMem(as, RCX, RAX, disp);
+#else
+  Cmp32Imm(as, RAX, disp + TYPE_OFFSET, VAL_UNDEFINED);
+#endif
+  int defined = Jump(as, CC_NE);
+  SaveState(as, instruction);
+  Emit(as, 0xbe); // mov esi, imm32
+  Emit32(as, (uint32_t)instruction->as.index);
+  CallFunction(as, JitUndefinedVariable);
+  JumpToError(as, CC_ALWAYS);
+  Patch(as, defined);
+}
+
+static void LoadUpvalue(Assembler *as, int slot) {
+  Load(as, RAX, R13, (int32_t)offsetof(CallFrame, closure));
+  Load(as, RAX, RAX, (int32_t)offsetof(ObjClosure, upvalues));
+  Load(as, RAX, RAX, slot * (int32_t)sizeof(ObjUpvalue *));
+  Load(as, RAX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+}
+
+static uint8_t GenericOpcode(uint8_t opcode) {
+  switch (opcode) {
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    return OP_ADD;
+  case OP_SUBTRACT_NUM:
+    return OP_SUBTRACT;
+  case OP_MULTIPLY_NUM:
+    return OP_MULTIPLY;
+  case OP_DIVIDE_NUM:
+    return OP_DIVIDE;
+  case OP_LESS_NUM:
+    return OP_LESS;
+  case OP_GREATER_NUM:
+    return OP_GREATER;
+  default:
+    return opcode;
+  }
+}
+
+// Inline number arithmetic on the top two values, with the helper as the
+// slow path for strings and type errors.
+static void BinaryOp(Assembler *as, Instruction *instruction, uint8_t opcode) {
+  int a_not_number = JumpIfNotNumber(as, RBX, SECOND);
+  int b_not_number = JumpIfNotNumber(as, RBX, TOP);
+  Sse(as, 0xf2, 0x10, XMM0, RBX, SECOND + NUMBER_OFFSET);
+  switch (opcode) {
+  case OP_LESS:
+  case OP_GREATER:
+    Sse(as, 0xf2, 0x10, XMM1, RBX, TOP + NUMBER_OFFSET);
+    if (opcode == OP_LESS) {
+      Ucomisd(as, XMM1, XMM0);
+    } else {
+      Ucomisd(as, XMM0, XMM1);
+    }
+    StoreCondition(as, CC_A, RBX, SECOND);
+    break;
+  default: {
+    uint8_t sse_opcode = opcode == OP_ADD        ? 0x58
+                         : opcode == OP_SUBTRACT ? 0x5c
+                         : opcode == OP_MULTIPLY ? 0x59
+                                                 : 0x5e;
+    Sse(as, 0xf2, sse_opcode, XMM0, RBX, TOP + NUMBER_OFFSET);
+    Sse(as, 0xf2, 0x11, XMM0, RBX, SECOND + NUMBER_OFFSET);
+    break;
+  }
+  }
+  AddImm(as, RBX, -VALUE_SIZE);
+  int done = Jump(as, CC_ALWAYS);
+  Patch(as, a_not_number);
+  Patch(as, b_not_number);
+  Emit(as, 0xbe); // mov esi, imm32
+  Emit32(as, opcode);
+  CallHelper(as, instruction, JitArithmetic, true);
+  Patch(as, done);
+}
+
+static void CompareJump(Assembler *as, Instruction *instruction, bool less,
+                        int target) {
+  int a_not_number = JumpIfNotNumber(as, RBX, SECOND);
+  int b_not_number = JumpIfNotNumber(as, RBX, TOP);
+  Sse(as, 0xf2, 0x10, XMM0, RBX, SECOND + NUMBER_OFFSET);
+  Sse(as, 0xf2, 0x10, XMM1, RBX, TOP + NUMBER_OFFSET);
+  AddImm(as, RBX, 2 * -VALUE_SIZE);
+  if (less) {
+    Ucomisd(as, XMM1, XMM0);
+  } else {
+    Ucomisd(as, XMM0, XMM1);
+  }
+  JumpTo(as, CC_BE, target);
+  int done = Jump(as, CC_ALWAYS);
+  Patch(as, a_not_number);
+  Patch(as, b_not_number);
+  CallHelper(as, instruction, JitComparisonError, true);
+  Patch(as, done);
+}
+
+static void JumpIfFalse(Assembler *as, int target) {
+#ifdef NAN_BOXING
+  Load(as, RAX, RBX, TOP);
+  MovImm(as, RCX, NULL_VAL);
+  CmpReg(as, RAX, RCX);
+  JumpTo(as, CC_E, target);
+  MovImm(as, RCX, FALSE_VAL);
+  CmpReg(as, RAX, RCX);
+  JumpTo(as, CC_E, target);
+#else
+  Cmp32Imm(as, RBX, TOP + TYPE_OFFSET, VAL_NULL);
+  JumpTo(as, CC_E, target);
+  Cmp32Imm(as, RBX, TOP + TYPE_OFFSET, VAL_BOOL);
+  int truthy = Jump(as, CC_NE);
+  Cmp8Imm(as, RBX, TOP + BOOL_OFFSET, 0);
+  JumpTo(as, CC_E, target);
+  Patch(as, truthy);
+#endif
+}
+
+static void IncrementLocal(Assembler *as, Instruction *instruction) {
+  int32_t local = instruction->arg * VALUE_SIZE;
+  int slow = -1;
+  int done = -1;
+  if (IS_NUMBER(*instruction->as.constant)) {
+    slow = JumpIfNotNumber(as, R12, local);
+    Sse(as, 0xf2, 0x10, XMM0, R12, local + NUMBER_OFFSET);
+    MovImm(as, RAX, (uint64_t)(uintptr_t)instruction->as.constant);
+    Sse(as, 0xf2, 0x58, XMM0, RAX, NUMBER_OFFSET);
+    Sse(as, 0xf2, 0x11, XMM0, R12, local + NUMBER_OFFSET);
+    done = Jump(as, CC_ALWAYS);
+    Patch(as, slow);
+  }
+  MovReg(as, RSI, R13);
+  MovImm(as, RDX, (uint64_t)(uintptr_t)instruction);
+  CallHelper(as, instruction, JitIncrementLocal, true);
+  if (done != -1) {
+    Patch(as, done);
+  }
+}
+
+static void CompileInstruction(Assembler *as, ObjFunction *function,
+                               Instruction *instruction) {
+  if (instruction->opcode == OP_LOOP_TRACE) {
+    JumpTo(as, CC_ALWAYS,
+           (int)(instruction->as.trace->header - function->instructions));
+    return;
+  }
+  int target = instruction->opcode == OP_JUMP ||
+                       instruction->opcode == OP_LOOP ||
+                       instruction->opcode == OP_JUMP_IF_FALSE ||
+                       instruction->opcode == OP_LESS_JUMP_IF_FALSE ||
+                       instruction->opcode == OP_GREATER_JUMP_IF_FALSE
+                   ? (int)(instruction->as.target - function->instructions)
+                   : -1;
+  switch (instruction->opcode) {
+  case OP_CONSTANT:
+    PushConstant(as, *instruction->as.constant);
+    break;
+  case OP_NULL:
+    PushConstant(as, NULL_VAL);
+    break;
+  case OP_TRUE:
+    PushConstant(as, BOOL_VAL(true));
+    break;
+  case OP_FALSE:
+    PushConstant(as, BOOL_VAL(false));
+    break;
+  case OP_POP:
+    AddImm(as, RBX, -VALUE_SIZE);
+    break;
+  case OP_DEFINE_GLOBAL_SLOT:
+    Load(as, RAX, R15, GLOBALS_OFFSET);
+    CopyValue(as, RAX, instruction->as.index * VALUE_SIZE, RBX, TOP);
+    AddImm(as, RBX, -VALUE_SIZE);
+    break;
+  case OP_GET_GLOBAL_SLOT: {
+    int32_t disp = instruction->as.index * VALUE_SIZE;
+    Load(as, RAX, R15, GLOBALS_OFFSET);
+    CheckDefined(as, instruction, disp);
+    CopyValue(as, RBX, 0, RAX, disp);
+    AddImm(as, RBX, VALUE_SIZE);
+    break;
+  }
+  case OP_SET_GLOBAL_SLOT: {
+    int32_t disp = instruction->as.index * VALUE_SIZE;
+    Load(as, RAX, R15, GLOBALS_OFFSET);
+    CheckDefined(as, instruction, disp);
+    CopyValue(as, RAX, disp, RBX, TOP);
+    break;
+  }
+  case OP_GET_LOCAL:
+    GetLocal(as, instruction->as.index);
+    break;
+  case OP_SET_LOCAL:
+    CopyValue(as, R12, instruction->as.index * VALUE_SIZE, RBX, TOP);
+    break;
+  case OP_GET_UPVALUE:
+    LoadUpvalue(as, instruction->as.index);
+    CopyValue(as, RBX, 0, RAX, 0);
+    AddImm(as, RBX, VALUE_SIZE);
+    break;
+  case OP_SET_UPVALUE:
+    LoadUpvalue(as, instruction->as.index);
+    CopyValue(as, RAX, 0, RBX, TOP);
+    break;
+  case OP_EQUAL:
+    CallHelper(as, instruction, JitEqual, false);
+    break;
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_LESS_NUM:
+  case OP_GREATER_NUM:
+    BinaryOp(as, instruction, GenericOpcode(instruction->opcode));
+    break;
+  case OP_NOT:
+    CallHelper(as, instruction, JitNot, true);
+    break;
+  case OP_NEGATE:
+    CallHelper(as, instruction, JitNegate, true);
+    break;
+  case OP_PRINT:
+    CallHelper(as, instruction, JitPrint, false);
+    break;
+  case OP_JUMP_IF_FALSE:
+    JumpIfFalse(as, target);
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    JumpTo(as, CC_ALWAYS, target);
+    break;
+  case OP_CALL:
+    Emit(as, 0xbe); // mov esi, imm32
+    Emit32(as, (uint32_t)instruction->as.index);
+    SaveState(as, instruction);
+    CallFunction(as, JitCall);
+    ExitIfSwitched(as);
+    TestEax(as);
+    JumpToError(as, CC_NE);
+    LoadFrame(as);
+    LoadState(as);
+    break;
+  case OP_TAIL_CALL: {
+    Emit(as, 0xbe); // mov esi, imm32
+    Emit32(as, (uint32_t)instruction->as.index);
+    SaveState(as, instruction);
+    CallFunction(as, JitTailCall);
+    CmpEax(as, JIT_TAIL_CALL);
+    int call = Jump(as, CC_NE);
+    Epilogue(as, JIT_TAIL_CALL);
+    Patch(as, call);
+    ExitIfSwitched(as);
+    TestEax(as);
+    JumpToError(as, CC_NE);
+    LoadFrame(as);
+    LoadState(as);
+    break;
+  }
+  case OP_CLOSURE:
+    MovReg(as, RSI, R13);
+    MovImm(as, RDX, (uint64_t)(uintptr_t)instruction);
+    CallHelper(as, instruction, JitClosure, false);
+    break;
+  case OP_CLOSE_UPVALUE:
+    CallHelper(as, instruction, JitCloseUpvalue, false);
+    break;
+  case OP_RETURN:
+    MovReg(as, RSI, R13);
+    SaveState(as, instruction);
+    CallFunction(as, JitReturn);
+    ExitIfSwitched(as);
+    Epilogue(as, INTERPRET_OK);
+    break;
+  case OP_GET_LOCAL_GET_LOCAL:
+    GetLocal(as, instruction->as.index);
+    GetLocal(as, instruction->arg);
+    break;
+  case OP_GET_LOCAL_CONSTANT:
+    GetLocal(as, instruction->arg);
+    PushConstant(as, *instruction->as.constant);
+    break;
+  case OP_SET_LOCAL_POP:
+    CopyValue(as, R12, instruction->as.index * VALUE_SIZE, RBX, TOP);
+    AddImm(as, RBX, -VALUE_SIZE);
+    break;
+  case OP_INCREMENT_LOCAL:
+    IncrementLocal(as, instruction);
+    break;
+  case OP_LESS_JUMP_IF_FALSE:
+    CompareJump(as, instruction, true, target);
+    break;
+  case OP_GREATER_JUMP_IF_FALSE:
+    CompareJump(as, instruction, false, target);
+    break;
+  }
+}
+
+// Copies the assembled code into executable memory.
+static void *MapCode(Assembler *as) {
+  void *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return NULL;
+  }
+  memcpy(code, as->code, as->count);
+  mprotect(code, as->count, PROT_READ | PROT_EXEC);
+  return code;
+}
+
+bool JitCompile(ObjFunction *function) {
+  Assembler as = {0};
+  as.labels = ALLOCATE(int, function->instruction_count);
+  Prologue(&as);
+  for (int i = 0; i < function->instruction_count; i++) {
+    as.labels[i] = as.count;
+    CompileInstruction(&as, function, &function->instructions[i]);
+  }
+  for (int i = 0; i < as.error_count; i++) {
+    Patch(&as, as.errors[i]);
+  }
+  Epilogue(&as, INTERPRET_RUNTIME_ERROR);
+  for (int i = 0; i < as.fixup_count; i++) {
+    PatchAt(&as, as.fixups[i].at, as.labels[as.fixups[i].target]);
+  }
+
+  function->jit_code = MapCode(&as);
+  function->jit_size = as.count;
+  FREE_ARRAY(uint8_t, as.code, as.capacity);
+  FREE_ARRAY(int, as.labels, function->instruction_count);
+  FREE_ARRAY(Fixup, as.fixups, as.fixup_capacity);
+  FREE_ARRAY(int, as.errors, as.error_capacity);
+  return function->jit_code != NULL;
+}
+
+// Traces.
+//
+// A trace runs the recorded loop path with every number unboxed in an xmm
+// register: each stack slot it touches gets one, and so does each global.
+// Types are only checked on entry. Inside the loop every value is either
+// loaded by those checks, a number constant, or the result of arithmetic on
+// such values, so it is a number without being tested again. The only guards
+// left in the loop are the recorded branches; when one goes the other way,
+// the trace boxes its registers back into the stack and globals and returns
+// to the interpreter.
+//
+// Register use inside traces:
+//   rdi  slots     rsi  where to store the stack top on exit
+//   rdx  the VM's global_values.values
+// rax, rcx and xmm0 are scratch; xmm1-xmm15 hold values.
+
+#define FIRST_TRACE_REGISTER 1
+#define TRACE_REGISTERS 15
+
+typedef enum {
+  SLOT_UNUSED, // Never touched by the trace; the stack copy is current.
+  SLOT_NUMBER,
+  SLOT_TRUE,
+  SLOT_FALSE,
+  // Comparisons whose result is still in the flags: ucomisd set "above" for
+  // < and >, or "equal and ordered" for ==, and `!` may have negated it.
+  SLOT_ABOVE,
+  SLOT_NOT_ABOVE,
+  SLOT_EQUAL,
+  SLOT_NOT_EQUAL,
+} SlotKind;
+
+typedef struct {
+  int at; // The guard's rel32.
+  Instruction *resume;
+  int height;
+  SlotKind *kinds; // Of the `height` live slots.
+} TraceExit;
+
+typedef struct {
+  Assembler as;
+  int *registers; // For each stack slot, or -1.
+  SlotKind *kinds;
+  int slot_count;
+  int globals[TRACE_REGISTERS];
+  int global_registers[TRACE_REGISTERS];
+  int global_count;
+  int register_count;
+  TraceExit *exits;
+  int exit_count;
+  int exit_capacity;
+} TraceCompiler;
+
+static int StackEffect(Instruction *instruction) {
+  switch (instruction->opcode) {
+  case OP_CONSTANT:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL_SLOT:
+    return 1;
+  case OP_GET_LOCAL_GET_LOCAL:
+  case OP_GET_LOCAL_CONSTANT:
+    return 2;
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+    return -2;
+  case OP_POP:
+  case OP_SET_LOCAL_POP:
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_EQUAL:
+    return -1;
+  default:
+    return 0;
+  }
+}
+
+static bool AssignRegister(TraceCompiler *tc, int *reg) {
+  if (*reg != -1) {
+    return true;
+  }
+  if (tc->register_count == TRACE_REGISTERS) {
+    return false;
+  }
+  *reg = FIRST_TRACE_REGISTER + tc->register_count++;
+  return true;
+}
+
+static int GlobalRegister(TraceCompiler *tc, int global) {
+  for (int i = 0; i < tc->global_count; i++) {
+    if (tc->globals[i] == global) {
+      return tc->global_registers[i];
+    }
+  }
+  return -1;
+}
+
+// Gives a register to every local the steps touch, every slot they push to,
+// and every global they use.
+static bool AssignRegisters(TraceCompiler *tc, Trace *trace, TraceStep *steps,
+                            int step_count) {
+  int height = trace->entry_height;
+  int max_height = height;
+  for (int i = 0; i < step_count; i++) {
+    height += StackEffect(steps[i].instruction);
+    if (height > max_height) {
+      max_height = height;
+    }
+  }
+  tc->slot_count = max_height;
+  tc->registers = ALLOCATE(int, max_height);
+  tc->kinds = ALLOCATE(SlotKind, max_height);
+  for (int slot = 0; slot < max_height; slot++) {
+    tc->registers[slot] = -1;
+    tc->kinds[slot] = SLOT_UNUSED;
+  }
+
+  for (int i = 0; i < step_count; i++) {
+    Instruction *instruction = steps[i].instruction;
+    int locals[2] = {-1, -1};
+    switch (instruction->opcode) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      locals[0] = instruction->as.index;
+      break;
+    case OP_GET_LOCAL_GET_LOCAL:
+      locals[0] = instruction->as.index;
+      locals[1] = instruction->arg;
+      break;
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_INCREMENT_LOCAL:
+      locals[0] = instruction->arg;
+      break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT: {
+      int global = instruction->as.index;
+      if (GlobalRegister(tc, global) == -1) {
+        int reg = -1;
+        if (!AssignRegister(tc, &reg)) {
+          return false;
+        }
+        tc->globals[tc->global_count] = global;
+        tc->global_registers[tc->global_count++] = reg;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    for (int j = 0; j < 2; j++) {
+      if (locals[j] != -1 && locals[j] < trace->entry_height) {
+        if (!AssignRegister(tc, &tc->registers[locals[j]])) {
+          return false;
+        }
+        tc->kinds[locals[j]] = SLOT_NUMBER;
+      }
+    }
+  }
+  for (int slot = trace->entry_height; slot < max_height; slot++) {
+    if (!AssignRegister(tc, &tc->registers[slot])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void AddExit(TraceCompiler *tc, Condition condition,
+                    Instruction *resume, int height) {
+  if (tc->exit_capacity < tc->exit_count + 1) {
+    int old_capacity = tc->exit_capacity;
+    tc->exit_capacity = GROW_CAPACITY(old_capacity);
+    tc->exits =
+        GROW_ARRAY(TraceExit, tc->exits, old_capacity, tc->exit_capacity);
+  }
+  TraceExit *exit = &tc->exits[tc->exit_count++];
+  exit->at = Jump(&tc->as, condition);
+  exit->resume = resume;
+  exit->height = height;
+  exit->kinds = ALLOCATE(SlotKind, height);
+  memcpy(exit->kinds, tc->kinds, sizeof(SlotKind) * height);
+}
+
+// Leaves the trace if the comparison in the flags is `value`.
+static void ExitWhen(TraceCompiler *tc, SlotKind flags, bool value,
+                     Instruction *resume, int height) {
+  if (flags == SLOT_NOT_ABOVE || flags == SLOT_NOT_EQUAL) {
+    flags = flags == SLOT_NOT_ABOVE ? SLOT_ABOVE : SLOT_EQUAL;
+    value = !value;
+  }
+  if (flags == SLOT_ABOVE) {
+    AddExit(tc, value ? CC_A : CC_BE, resume, height);
+  } else if (value) {
+    int unordered = Jump(&tc->as, CC_P);
+    AddExit(tc, CC_E, resume, height);
+    Patch(&tc->as, unordered);
+  } else {
+    AddExit(tc, CC_NE, resume, height);
+    AddExit(tc, CC_P, resume, height);
+  }
+}
+
+// Guards a branch whose condition is in the flags, exiting along the path
+// that was not recorded. A branch that leaves its condition on the stack has
+// it at height - 1, where the exit stores it as a boolean.
+static void GuardBranch(TraceCompiler *tc, TraceStep *step, SlotKind flags,
+                        int height, bool leaves_value) {
+  bool recorded = !step->taken;
+  Instruction *resume = recorded ? step->instruction->as.target
+                                 : step->instruction + 1;
+  if (leaves_value) {
+    tc->kinds[height - 1] = recorded ? SLOT_FALSE : SLOT_TRUE;
+  }
+  ExitWhen(tc, flags, !recorded, resume, height);
+  if (leaves_value) {
+    tc->kinds[height - 1] = recorded ? SLOT_TRUE : SLOT_FALSE;
+  }
+}
+
+static void BoxNumber(Assembler *as, Register base, int32_t disp, int xmm) {
+#ifndef NAN_BOXING
+  MovImm(as, RCX, VAL_NUMBER);
+  Store(as, base, disp + TYPE_OFFSET, RCX);
+#endif
+  Sse(as, 0xf2, 0x11, xmm, base, disp + NUMBER_OFFSET);
+}
+
+static void LoadNumberConstant(Assembler *as, int xmm, Value value) {
+  double number = AS_NUMBER(value);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  MovImm(as, RAX, bits);
+  MovXmmRax(as, xmm);
+}
+
+static bool CompileTraceStep(TraceCompiler *tc, TraceStep *step,
+                             int *height) {
+  Assembler *as = &tc->as;
+  Instruction *instruction = step->instruction;
+  int *reg = tc->registers;
+  int h = *height;
+  switch (instruction->opcode) {
+  case OP_CONSTANT:
+    LoadNumberConstant(as, reg[h], *instruction->as.constant);
+    tc->kinds[h] = SLOT_NUMBER;
+    break;
+  case OP_TRUE:
+    tc->kinds[h] = SLOT_TRUE;
+    break;
+  case OP_FALSE:
+    tc->kinds[h] = SLOT_FALSE;
+    break;
+  case OP_POP:
+  case OP_JUMP:
+  case OP_LOOP:
+    break;
+  case OP_GET_GLOBAL_SLOT:
+    SseReg(as, 0x66, 0x28, reg[h],
+           GlobalRegister(tc, instruction->as.index));
+    tc->kinds[h] = SLOT_NUMBER;
+    break;
+  case OP_SET_GLOBAL_SLOT:
+    SseReg(as, 0x66, 0x28, GlobalRegister(tc, instruction->as.index),
+           reg[h - 1]);
+    break;
+  case OP_GET_LOCAL:
+    SseReg(as, 0x66, 0x28, reg[h], reg[instruction->as.index]);
+    tc->kinds[h] = SLOT_NUMBER;
+    break;
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+    SseReg(as, 0x66, 0x28, reg[instruction->as.index], reg[h - 1]);
+    tc->kinds[instruction->as.index] = SLOT_NUMBER;
+    break;
+  case OP_GET_LOCAL_GET_LOCAL:
+    SseReg(as, 0x66, 0x28, reg[h], reg[instruction->as.index]);
+    SseReg(as, 0x66, 0x28, reg[h + 1], reg[instruction->arg]);
+    tc->kinds[h] = SLOT_NUMBER;
+    tc->kinds[h + 1] = SLOT_NUMBER;
+    break;
+  case OP_GET_LOCAL_CONSTANT:
+    SseReg(as, 0x66, 0x28, reg[h], reg[instruction->arg]);
+    LoadNumberConstant(as, reg[h + 1], *instruction->as.constant);
+    tc->kinds[h] = SLOT_NUMBER;
+    tc->kinds[h + 1] = SLOT_NUMBER;
+    break;
+  case OP_INCREMENT_LOCAL:
+    LoadNumberConstant(as, XMM0, *instruction->as.constant);
+    SseReg(as, 0xf2, 0x58, reg[instruction->arg], XMM0);
+    break;
+  case OP_NEGATE:
+    MovImm(as, RAX, (uint64_t)1 << 63);
+    MovXmmRax(as, XMM0);
+    SseReg(as, 0x66, 0x57, reg[h - 1], XMM0);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+    SseReg(as, 0xf2, 0x58, reg[h - 2], reg[h - 1]);
+    break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    SseReg(as, 0xf2, 0x5c, reg[h - 2], reg[h - 1]);
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    SseReg(as, 0xf2, 0x59, reg[h - 2], reg[h - 1]);
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    SseReg(as, 0xf2, 0x5e, reg[h - 2], reg[h - 1]);
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    Ucomisd(as, reg[h - 1], reg[h - 2]);
+    tc->kinds[h - 2] = SLOT_ABOVE;
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    Ucomisd(as, reg[h - 2], reg[h - 1]);
+    tc->kinds[h - 2] = SLOT_ABOVE;
+    break;
+  case OP_EQUAL:
+    Ucomisd(as, reg[h - 2], reg[h - 1]);
+    tc->kinds[h - 2] = SLOT_EQUAL;
+    break;
+  case OP_NOT: {
+    static const SlotKind negated[] = {
+        [SLOT_TRUE] = SLOT_FALSE,        [SLOT_FALSE] = SLOT_TRUE,
+        [SLOT_ABOVE] = SLOT_NOT_ABOVE,   [SLOT_NOT_ABOVE] = SLOT_ABOVE,
+        [SLOT_EQUAL] = SLOT_NOT_EQUAL,   [SLOT_NOT_EQUAL] = SLOT_EQUAL,
+    };
+    tc->kinds[h - 1] = negated[tc->kinds[h - 1]];
+    break;
+  }
+  case OP_JUMP_IF_FALSE:
+    // Numbers and literal booleans always branch the way they were recorded.
+    if (tc->kinds[h - 1] >= SLOT_ABOVE) {
+      GuardBranch(tc, step, tc->kinds[h - 1], h, true);
+    }
+    break;
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+    if (instruction->opcode == OP_LESS_JUMP_IF_FALSE) {
+      Ucomisd(as, reg[h - 1], reg[h - 2]);
+    } else {
+      Ucomisd(as, reg[h - 2], reg[h - 1]);
+    }
+    GuardBranch(tc, step, SLOT_ABOVE, h - 2, false);
+    break;
+  default:
+    return false;
+  }
+  *height = h + StackEffect(instruction);
+  return true;
+}
+
+static void CompileTraceExit(TraceCompiler *tc, TraceExit *exit) {
+  Assembler *as = &tc->as;
+  Patch(as, exit->at);
+  for (int slot = 0; slot < exit->height; slot++) {
+    int32_t disp = slot * VALUE_SIZE;
+    switch (exit->kinds[slot]) {
+    case SLOT_NUMBER:
+      BoxNumber(as, RDI, disp, tc->registers[slot]);
+      break;
+    case SLOT_TRUE:
+      StoreLiteral(as, RDI, disp, BOOL_VAL(true));
+      break;
+    case SLOT_FALSE:
+      StoreLiteral(as, RDI, disp, BOOL_VAL(false));
+      break;
+    default:
+      break;
+    }
+  }
+  for (int i = 0; i < tc->global_count; i++) {
+    BoxNumber(as, RDX, tc->globals[i] * VALUE_SIZE, tc->global_registers[i]);
+  }
+  Lea(as, RCX, RDI, exit->height * VALUE_SIZE);
+  Store(as, RSI, 0, RCX);
+  MovImm(as, RAX, (uint64_t)(uintptr_t)exit->resume);
+  Emit(as, 0xc3);
+}
+
+bool JitCompileTrace(Trace *trace, TraceStep *steps, int step_count) {
+  TraceCompiler tc = {0};
+  Assembler *as = &tc.as;
+  bool compiled = AssignRegisters(&tc, trace, steps, step_count);
+
+  // Entry: check and unbox everything the loop reads.
+  int entry_guards[2 * TRACE_REGISTERS];
+  int entry_guard_count = 0;
+  if (compiled) {
+    for (int slot = 0; slot < trace->entry_height; slot++) {
+      if (tc.registers[slot] != -1) {
+        int32_t disp = slot * VALUE_SIZE;
+        entry_guards[entry_guard_count++] = JumpIfNotNumber(as, RDI, disp);
+        Sse(as, 0xf2, 0x10, tc.registers[slot], RDI, disp + NUMBER_OFFSET);
+      }
+    }
+    for (int i = 0; i < tc.global_count; i++) {
+      int32_t disp = tc.globals[i] * VALUE_SIZE;
+      entry_guards[entry_guard_count++] = JumpIfNotNumber(as, RDX, disp);
+      Sse(as, 0xf2, 0x10, tc.global_registers[i], RDX, disp + NUMBER_OFFSET);
+    }
+  }
+
+  int loop_start = as->count;
+  int height = trace->entry_height;
+  for (int i = 0; compiled && i < step_count - 1; i++) {
+    compiled = CompileTraceStep(&tc, &steps[i], &height);
+  }
+  if (compiled && height == trace->entry_height) {
+    PatchAt(as, Jump(as, CC_ALWAYS), loop_start);
+    // A failed entry check leaves the stack as it was.
+    for (int i = 0; i < entry_guard_count; i++) {
+      Patch(as, entry_guards[i]);
+    }
+    MovImm(as, RAX, (uint64_t)(uintptr_t)trace->header);
+    Emit(as, 0xc3);
+    for (int i = 0; i < tc.exit_count; i++) {
+      CompileTraceExit(&tc, &tc.exits[i]);
+    }
+    trace->code = MapCode(as);
+    trace->code_size = as->count;
+  }
+
+  for (int i = 0; i < tc.exit_count; i++) {
+    FREE_ARRAY(SlotKind, tc.exits[i].kinds, tc.exits[i].height);
+  }
+  FREE_ARRAY(TraceExit, tc.exits, tc.exit_capacity);
+  FREE_ARRAY(int, tc.registers, tc.slot_count);
+  FREE_ARRAY(SlotKind, tc.kinds, tc.slot_count);
+  FREE_ARRAY(uint8_t, as->code, as->capacity);
+  return trace->code != NULL;
+}
+
+InterpretResult JitRun(VM *vm, CallFrame *frame) {
+  // Calls made while the code runs may move vm->frames.
+  int depth = (int)(frame - vm->frames);
+  for (;;) {
+    InterpretResult result =
+        ((JitCode)frame->closure->function->jit_code)(vm, frame);
+    if (result != JIT_TAIL_CALL) {
+      return result;
+    }
+    frame = &vm->frames[depth];
+    if (frame->closure->function->jit_code == NULL) {
+      return Run(vm, depth);
+    }
+  }
+}
+
+void JitFree(ObjFunction *function) {
+  if (function->jit_code != NULL) {
+    munmap(function->jit_code, function->jit_size);
+  }
+}
+
+#endif
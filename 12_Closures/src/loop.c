@@ -0,0 +1,524 @@
+#include "loop.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef EVENT_LOOP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define READ_MAX 65536 // Most bytes one read() callback gets.
+#define EVENTS_MAX 64  // Events taken from epoll at a time.
+#define DELAY_MAX 1e12 // Longest setTimeout() delay in ms, about 31 years.
+
+// Every file descriptor with a read or write in progress is in the epoll set,
+// along with a single timerfd. Timers are kept in a binary min-heap, and the
+// timerfd is armed for the earliest of them. Events are handled one at a time,
+// calling back into Lox through RunCallback(), so a callback may start or
+// cancel operations of its own, even on the descriptor it was called for.
+
+typedef struct {
+  int64_t deadline; // Nanoseconds on the monotonic clock.
+  int id; // Timers due at the same time fire in the order they were set.
+  ObjClosure *callback;
+} Timer;
+
+typedef struct {
+  uint32_t events; // Asked of epoll; 0 when not in the epoll set.
+  ObjClosure *on_read; // NULL unless a read is in progress.
+  ObjString *data; // NULL unless a write is in progress.
+  int written;
+  ObjClosure *on_written; // NULL for none.
+} Watch;
+
+typedef struct EventLoop {
+  int epoll_fd;
+  int timer_fd;
+  Timer *timers;
+  int timer_count;
+  int timer_capacity;
+  int next_timer_id;
+  Watch *watches; // Indexed by file descriptor.
+  int watch_capacity;
+  int operations; // Reads and writes in progress.
+  bool running;
+  char *buffer; // READ_MAX bytes.
+} EventLoop;
+
+static int64_t Now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static EventLoop *GetLoop(VM *vm) {
+  if (vm->loop != NULL) {
+    return vm->loop;
+  }
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = timer_fd};
+  if (epoll_fd < 0 || timer_fd < 0 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) < 0) {
+    RuntimeError(vm, "Could not create the event loop: %s.", strerror(errno));
+    if (epoll_fd >= 0) {
+      close(epoll_fd);
+    }
+    if (timer_fd >= 0) {
+      close(timer_fd);
+    }
+    return NULL;
+  }
+  // A write to a closed pipe or socket fails with EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
+  EventLoop *loop = ALLOCATE(EventLoop, 1);
+  loop->epoll_fd = epoll_fd;
+  loop->timer_fd = timer_fd;
+  loop->timers = NULL;
+  loop->timer_count = 0;
+  loop->timer_capacity = 0;
+  loop->next_timer_id = 1;
+  loop->watches = NULL;
+  loop->watch_capacity = 0;
+  loop->operations = 0;
+  loop->running = false;
+  loop->buffer = ALLOCATE(char, READ_MAX);
+  vm->loop = loop;
+  return loop;
+}
+
+void FreeLoop(VM *vm) {
+  EventLoop *loop = vm->loop;
+  if (loop == NULL) {
+    return;
+  }
+  close(loop->epoll_fd);
+  close(loop->timer_fd);
+  FREE_ARRAY(Timer, loop->timers, loop->timer_capacity);
+  FREE_ARRAY(Watch, loop->watches, loop->watch_capacity);
+  FREE_ARRAY(char, loop->buffer, READ_MAX);
+  FREE(EventLoop, loop);
+  vm->loop = NULL;
+}
+
+static bool Earlier(Timer *a, Timer *b) {
+  return a->deadline < b->deadline ||
+         (a->deadline == b->deadline && a->id < b->id);
+}
+
+static void SwapTimers(Timer *a, Timer *b) {
+  Timer temp = *a;
+  *a = *b;
+  *b = temp;
+}
+
+static void SiftUp(EventLoop *loop, int index) {
+  Timer *timers = loop->timers;
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (!Earlier(&timers[index], &timers[parent])) {
+      break;
+    }
+    SwapTimers(&timers[index], &timers[parent]);
+    index = parent;
+  }
+}
+
+static void SiftDown(EventLoop *loop, int index) {
+  Timer *timers = loop->timers;
+  while (true) {
+    int earliest = index;
+    int left = 2 * index + 1;
+    int right = left + 1;
+    if (left < loop->timer_count && Earlier(&timers[left], &timers[earliest])) {
+      earliest = left;
+    }
+    if (right < loop->timer_count &&
+        Earlier(&timers[right], &timers[earliest])) {
+      earliest = right;
+    }
+    if (earliest == index) {
+      break;
+    }
+    SwapTimers(&timers[index], &timers[earliest]);
+    index = earliest;
+  }
+}
+
+static void RemoveTimer(EventLoop *loop, int index) {
+  loop->timers[index] = loop->timers[--loop->timer_count];
+  if (index < loop->timer_count) {
+    SiftDown(loop, index);
+    SiftUp(loop, index);
+  }
+}
+
+// Arms the timerfd for the earliest timer, or disarms it if there is none.
+static void ArmTimer(EventLoop *loop) {
+  struct itimerspec spec = {0};
+  if (loop->timer_count > 0) {
+    int64_t deadline = loop->timers[0].deadline;
+    spec.it_value.tv_sec = (time_t)(deadline / 1000000000);
+    spec.it_value.tv_nsec = (long)(deadline % 1000000000);
+  }
+  timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static bool FdArgument(Value value, int *fd) {
+  if (!IS_NUMBER(value)) {
+    return false;
+  }
+  double number = AS_NUMBER(value);
+  if (number < 0 || number > INT32_MAX || number != (int)number) {
+    return false;
+  }
+  *fd = (int)number;
+  return true;
+}
+
+static Watch *GetWatch(EventLoop *loop, int fd) {
+  if (fd >= loop->watch_capacity) {
+    int old_capacity = loop->watch_capacity;
+    int capacity = GROW_CAPACITY(old_capacity);
+    while (capacity <= fd) {
+      capacity = GROW_CAPACITY(capacity);
+    }
+    loop->watches = GROW_ARRAY(Watch, loop->watches, old_capacity, capacity);
+    memset(loop->watches + old_capacity, 0,
+           sizeof(Watch) * (capacity - old_capacity));
+    loop->watch_capacity = capacity;
+  }
+  return &loop->watches[fd];
+}
+
+// Asks epoll for the events the file descriptor's reads and writes in progress
+// wait for. It is made non-blocking when it is first added.
+static bool UpdateWatch(VM *vm, EventLoop *loop, int fd) {
+  Watch *watch = &loop->watches[fd];
+  uint32_t events = (watch->on_read != NULL ? EPOLLIN : 0) |
+                    (watch->data != NULL ? EPOLLOUT : 0);
+  if (events == watch->events) {
+    return true;
+  }
+  struct epoll_event event = {.events = events, .data.fd = fd};
+  int result;
+  if (events == 0) {
+    result = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  } else if (watch->events == 0) {
+    int flags = fcntl(fd, F_GETFL);
+    result = flags < 0 ? flags : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (result == 0) {
+      result = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+  } else {
+    result = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  }
+  if (result < 0) {
+    RuntimeError(vm, "Cannot watch file descriptor %d: %s.", fd,
+                 strerror(errno));
+    return false;
+  }
+  watch->events = events;
+  return true;
+}
+
+static bool SetTimeoutNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 2 || !IS_CLOSURE(args[0]) || !IS_NUMBER(args[1])) {
+    RuntimeError(vm, "setTimeout() takes a function and a delay in ms.");
+    return false;
+  }
+  EventLoop *loop = GetLoop(vm);
+  if (loop == NULL) {
+    return false;
+  }
+  double delay = AS_NUMBER(args[1]);
+  // Written so NaN fails too; a deadline past DELAY_MAX could overflow.
+  if (!(delay <= DELAY_MAX)) {
+    RuntimeError(vm, "setTimeout() delay must be a number of ms up to %g.",
+                 DELAY_MAX);
+    return false;
+  }
+  if (loop->timer_count + 1 > loop->timer_capacity) {
+    int old_capacity = loop->timer_capacity;
+    loop->timer_capacity = GROW_CAPACITY(old_capacity);
+    loop->timers = GROW_ARRAY(Timer, loop->timers, old_capacity,
+                              loop->timer_capacity);
+  }
+  int id = loop->next_timer_id++;
+  Timer *timer = &loop->timers[loop->timer_count++];
+  timer->deadline = Now() + (delay > 0 ? (int64_t)(delay * 1e6) : 0);
+  timer->id = id;
+  timer->callback = AS_CLOSURE(args[0]);
+  args[-1] = NUMBER_VAL(id);
+  SiftUp(loop, loop->timer_count - 1);
+  if (loop->timers[0].id == id) {
+    ArmTimer(loop);
+  }
+  return true;
+}
+
+static bool ClearTimeoutNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 1 || !IS_NUMBER(args[0])) {
+    RuntimeError(vm, "clearTimeout() takes a timer id.");
+    return false;
+  }
+  EventLoop *loop = vm->loop;
+  args[-1] = BOOL_VAL(false);
+  if (loop == NULL) {
+    return true;
+  }
+  for (int i = 0; i < loop->timer_count; i++) {
+    if (loop->timers[i].id == AS_NUMBER(args[0])) {
+      RemoveTimer(loop, i);
+      if (i == 0) {
+        ArmTimer(loop);
+      }
+      args[-1] = BOOL_VAL(true);
+      break;
+    }
+  }
+  return true;
+}
+
+static bool ReadNative(VM *vm, int arg_count, Value *args) {
+  int fd;
+  if (arg_count != 2 || !FdArgument(args[0], &fd) || !IS_CLOSURE(args[1])) {
+    RuntimeError(vm, "read() takes a file descriptor and a function.");
+    return false;
+  }
+  EventLoop *loop = GetLoop(vm);
+  if (loop == NULL) {
+    return false;
+  }
+  Watch *watch = GetWatch(loop, fd);
+  if (watch->on_read != NULL) {
+    RuntimeError(vm, "File descriptor %d is already being read.", fd);
+    return false;
+  }
+  watch->on_read = AS_CLOSURE(args[1]);
+  if (!UpdateWatch(vm, loop, fd)) {
+    watch->on_read = NULL;
+    return false;
+  }
+  loop->operations++;
+  args[-1] = NULL_VAL;
+  return true;
+}
+
+static bool WriteNative(VM *vm, int arg_count, Value *args) {
+  int fd;
+  if (arg_count != 3 || !FdArgument(args[0], &fd) || !IS_STRING(args[1]) ||
+      !(IS_CLOSURE(args[2]) || IS_NULL(args[2]))) {
+    RuntimeError(vm,
+                 "write() takes a file descriptor, a string and a function.");
+    return false;
+  }
+  EventLoop *loop = GetLoop(vm);
+  if (loop == NULL) {
+    return false;
+  }
+  Watch *watch = GetWatch(loop, fd);
+  if (watch->data != NULL) {
+    RuntimeError(vm, "File descriptor %d is already being written.", fd);
+    return false;
+  }
+  watch->data = AS_STRING(args[1]);
+  watch->written = 0;
+  watch->on_written = IS_NULL(args[2]) ? NULL : AS_CLOSURE(args[2]);
+  if (!UpdateWatch(vm, loop, fd)) {
+    watch->data = NULL;
+    return false;
+  }
+  loop->operations++;
+  args[-1] = NULL_VAL;
+  return true;
+}
+
+static bool CloseNative(VM *vm, int arg_count, Value *args) {
+  int fd;
+  if (arg_count != 1 || !FdArgument(args[0], &fd)) {
+    RuntimeError(vm, "close() takes a file descriptor.");
+    return false;
+  }
+  EventLoop *loop = vm->loop;
+  if (loop != NULL && fd < loop->watch_capacity) {
+    Watch *watch = &loop->watches[fd];
+    loop->operations -= (watch->on_read != NULL) + (watch->data != NULL);
+    if (watch->events != 0) {
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    memset(watch, 0, sizeof(Watch));
+  }
+  if (close(fd) < 0) {
+    RuntimeError(vm, "Cannot close file descriptor %d: %s.", fd,
+                 strerror(errno));
+    return false;
+  }
+  args[-1] = NULL_VAL;
+  return true;
+}
+
+static bool CallWithPair(VM *vm, ObjClosure *callback, int fds[2]) {
+  Value pair[2] = {NUMBER_VAL(fds[0]), NUMBER_VAL(fds[1])};
+  return RunCallback(vm, callback, 2, pair);
+}
+
+static bool PipeNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 1 || !IS_CLOSURE(args[0])) {
+    RuntimeError(vm, "pipe() takes a function.");
+    return false;
+  }
+  int fds[2];
+  if (pipe(fds) < 0) {
+    RuntimeError(vm, "Cannot create a pipe: %s.", strerror(errno));
+    return false;
+  }
+  args[-1] = NULL_VAL;
+  return CallWithPair(vm, AS_CLOSURE(args[0]), fds);
+}
+
+static bool SocketPairNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 1 || !IS_CLOSURE(args[0])) {
+    RuntimeError(vm, "socketPair() takes a function.");
+    return false;
+  }
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    RuntimeError(vm, "Cannot create a socket pair: %s.", strerror(errno));
+    return false;
+  }
+  args[-1] = NULL_VAL;
+  return CallWithPair(vm, AS_CLOSURE(args[0]), fds);
+}
+
+// Runs the callbacks of every timer that is due. Timers set by them wait for
+// the next turn of the loop, even if they are already due.
+static bool FireTimers(VM *vm, EventLoop *loop) {
+  uint64_t expirations;
+  if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    RuntimeError(vm, "Cannot read the event loop timer: %s.", strerror(errno));
+    return false;
+  }
+  int64_t now = Now();
+  int last_id = loop->next_timer_id - 1;
+  bool ok = true;
+  while (ok && loop->timer_count > 0 && loop->timers[0].deadline <= now &&
+         loop->timers[0].id <= last_id) {
+    ObjClosure *callback = loop->timers[0].callback;
+    RemoveTimer(loop, 0);
+    ok = RunCallback(vm, callback, 0, NULL);
+  }
+  ArmTimer(loop);
+  return ok;
+}
+
+// Finishes whichever of the file descriptor's read and write `events` allow.
+// Either can find nothing to do after all, if an earlier callback reused the
+// descriptor.
+static bool HandleEvents(VM *vm, EventLoop *loop, int fd, uint32_t events) {
+  if (fd >= loop->watch_capacity) {
+    return true;
+  }
+  Watch *watch = &loop->watches[fd];
+  if (watch->on_read != NULL && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+    ssize_t count = read(fd, loop->buffer, READ_MAX);
+    if (count >= 0 || (errno != EAGAIN && errno != EINTR)) {
+      Value data = count > 0
+                       ? OBJ_VAL(CopyString(vm, loop->buffer, (int)count))
+                       : NULL_VAL;
+      ObjClosure *callback = watch->on_read;
+      watch->on_read = NULL;
+      loop->operations--;
+      if (!UpdateWatch(vm, loop, fd) ||
+          !RunCallback(vm, callback, 1, &data)) {
+        return false;
+      }
+      watch = &loop->watches[fd]; // The callback may have moved them.
+    }
+  }
+  if (watch->data != NULL && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+    ObjString *data = watch->data;
+    ssize_t count = write(fd, data->chars + watch->written,
+                          (size_t)(data->length - watch->written));
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return true;
+    }
+    if (count >= 0) {
+      watch->written += (int)count;
+      if (watch->written < data->length) {
+        return true;
+      }
+    }
+    Value ok = BOOL_VAL(count >= 0);
+    ObjClosure *callback = watch->on_written;
+    watch->data = NULL;
+    watch->on_written = NULL;
+    loop->operations--;
+    if (!UpdateWatch(vm, loop, fd)) {
+      return false;
+    }
+    if (callback != NULL) {
+      return RunCallback(vm, callback, 1, &ok);
+    }
+  }
+  return true;
+}
+
+static bool RunLoopNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 0) {
+    RuntimeError(vm, "runLoop() takes no arguments.");
+    return false;
+  }
+  EventLoop *loop = GetLoop(vm);
+  if (loop == NULL) {
+    return false;
+  }
+  if (loop->running) {
+    RuntimeError(vm, "The event loop is already running.");
+    return false;
+  }
+  loop->running = true;
+  bool ok = true;
+  struct epoll_event events[EVENTS_MAX];
+  while (ok && (loop->timer_count > 0 || loop->operations > 0)) {
+    int count = epoll_wait(loop->epoll_fd, events, EVENTS_MAX, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      RuntimeError(vm, "Cannot wait for events: %s.", strerror(errno));
+      ok = false;
+    }
+    for (int i = 0; ok && i < count; i++) {
+      int fd = events[i].data.fd;
+      ok = fd == loop->timer_fd
+               ? FireTimers(vm, loop)
+               : HandleEvents(vm, loop, fd, events[i].events);
+    }
+  }
+  loop->running = false;
+  args[-1] = NULL_VAL;
+  return ok;
+}
+
+void DefineLoopNatives(VM *vm) {
+  DefineNative(vm, "setTimeout", SetTimeoutNative);
+  DefineNative(vm, "clearTimeout", ClearTimeoutNative);
+  DefineNative(vm, "read", ReadNative);
+  DefineNative(vm, "write", WriteNative);
+  DefineNative(vm, "close", CloseNative);
+  DefineNative(vm, "pipe", PipeNative);
+  DefineNative(vm, "socketPair", SocketPairNative);
+  DefineNative(vm, "runLoop", RunLoopNative);
+}
+
+#endif
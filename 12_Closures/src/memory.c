@@ -1,5 +1,7 @@
 #include "memory.h"
+#include "jit.h"
 #include "object.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
@@ -26,6 +28,12 @@ static void FreeObject(Object *object) {
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     FreeChunk(&function->chunk);
+    FREE_ARRAY(Instruction, function->instructions,
+               function->instruction_count);
+#ifdef JIT
+    JitFree(function);
+    FreeTraces(function);
+#endif
     FREE(ObjFunction, object);
     break;
   }
@@ -44,11 +52,18 @@ static void FreeObject(Object *object) {
     FREE(ObjUpvalue, object);
     break;
   }
+  case OBJ_FIBER: {
+    ObjFiber *fiber = (ObjFiber *)object;
+    FREE_ARRAY(CallFrame, fiber->frames, fiber->frame_capacity);
+    FREE_ARRAY(Value, fiber->stack, fiber->stack_capacity);
+    FREE(ObjFiber, object);
+    break;
+  }
   }
 }
 
-void FreeObjects() {
-  Object *object = vm.objects;
+void FreeObjects(VM *vm) {
+  Object *object = vm->objects;
   while (object != NULL) {
     Object *next = object->next;
     FreeObject(object);
@@ -5,26 +5,33 @@
 #include "vm.h"
 
 #define ALLOCATE_OBJ(type, objectType)                                         \
-  (type *)AllocateObject(sizeof(type), objectType)
+  (type *)AllocateObject(vm, sizeof(type), objectType)
 
-static Object *AllocateObject(size_t size, ObjType type) {
+static Object *AllocateObject(VM *vm, size_t size, ObjType type) {
   Object *object = (Object *)reallocate(NULL, 0, size);
   object->type = type;
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm->objects;
+  vm->objects = object;
   return object;
 }
 
-ObjFunction *NewFunction() {
+ObjFunction *NewFunction(VM *vm) {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalue_count = 0;
   function->name = NULL;
+  function->instructions = NULL;
+  function->instruction_count = 0;
+  function->stack_size = 0;
+  function->call_count = 0;
+  function->jit_code = NULL;
+  function->jit_size = 0;
+  function->traces = NULL;
   InitChunk(&function->chunk);
   return function;
 }
 
-ObjClosure *NewClosure(ObjFunction *function) {
+ObjClosure *NewClosure(VM *vm, ObjFunction *function) {
   ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *,
                                    function->upvalue_count);
   for (int i = 0; i < function->upvalue_count; i++) {
@@ -37,18 +44,19 @@ ObjClosure *NewClosure(ObjFunction *function) {
   return closure;
 }
 
-ObjNative *NewNative(NativeFn function) {
+ObjNative *NewNative(VM *vm, NativeFn function) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
   return native;
 }
 
-static ObjString *AllocateString(char *chars, int length, uint32_t hash) {
+static ObjString *AllocateString(VM *vm, char *chars, int length,
+                                 uint32_t hash) {
   ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
   string->hash = hash;
-  TableSet(&vm.strings, string, NULL_VAL);
+  TableSet(&vm->strings, string, NULL_VAL);
   return string;
 }
 
@@ -61,29 +69,29 @@ static uint32_t HashString(const char *key, int length) {
   return hash;
 }
 
-ObjString *GetString(char *chars, int length) {
+ObjString *GetString(VM *vm, char *chars, int length) {
   uint32_t hash = HashString(chars, length);
-  ObjString *interned = TableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = TableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
     return interned;
   }
-  return AllocateString(chars, length, hash);
+  return AllocateString(vm, chars, length, hash);
 }
 
-ObjString *CopyString(const char *chars, int length) {
+ObjString *CopyString(VM *vm, const char *chars, int length) {
   uint32_t hash = HashString(chars, length);
-  ObjString *interned = TableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = TableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) {
     return interned;
   }
   char *heap_chars = ALLOCATE(char, length + 1);
   memcpy(heap_chars, chars, length);
   heap_chars[length] = '\0';
-  return AllocateString(heap_chars, length, hash);
+  return AllocateString(vm, heap_chars, length, hash);
 }
 
-ObjUpvalue *NewUpvalue(Value *slot) {
+ObjUpvalue *NewUpvalue(VM *vm, Value *slot) {
   ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NULL_VAL;
   upvalue->location = slot;
@@ -91,6 +99,28 @@ ObjUpvalue *NewUpvalue(Value *slot) {
   return upvalue;
 }
 
+ObjFiber *NewFiber(VM *vm, ObjClosure *closure) {
+  ObjFiber *fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+  fiber->frames = NULL;
+  fiber->frame_count = 0;
+  fiber->frame_capacity = 0;
+  fiber->stack = NULL;
+  fiber->stack_top = NULL;
+  fiber->stack_capacity = 0;
+  fiber->open_upvalues = NULL;
+  fiber->caller = NULL;
+  fiber->state = FIBER_RUNNING;
+  if (closure != NULL) {
+    // Call() grows the stack as the fiber's calls need it.
+    fiber->stack = ALLOCATE(Value, FIBER_STACK_INITIAL);
+    fiber->stack_capacity = FIBER_STACK_INITIAL;
+    fiber->stack[0] = OBJ_VAL(closure);
+    fiber->stack_top = fiber->stack + 1;
+    fiber->state = FIBER_SUSPENDED;
+  }
+  return fiber;
+}
+
 static void PrintFunction(ObjFunction *function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -116,5 +146,8 @@ void PrintObject(Value value) {
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
+  case OBJ_FIBER:
+    printf("<fiber>");
+    break;
   }
 }
@@ -0,0 +1,721 @@
+#include "optimizer.h"
+#include "ir.h"
+#include "memory.h"
+#include "object.h"
+
+// The optimizer rewrites a chunk lifted into the form of ir.h. The passes, in
+// the order OptimizeChunk() runs them:
+//   RemoveUnreachable()  Deletes the code no path from the entry reaches.
+//   ForwardStores()      Keeps a stored value on the stack rather than
+//                        popping it and loading it straight back.
+//   HoistLoopTests()     Computes the part of a loop's test that no
+//                        iteration changes once, before the loop, into a new
+//                        stack slot.
+//   NumberValues()       Numbers the values each block computes, equal
+//                        numbers for equal values, and replaces code that
+//                        recomputes a value some stack slot still holds with
+//                        a load of that slot.
+//   SimplifyJumps()      Deletes jumps to the next instruction, threads jumps
+//                        to jumps and drops values pushed only to be popped.
+//
+// None of them changes what a program prints or when it fails. Code is only
+// removed or moved where it cannot fail, or where the same computation has
+// already succeeded on the same values.
+
+// The local slots some closure captures. A call can change them.
+static bool *CapturedSlots(Ir *ir) {
+  bool *captured = ALLOCATE(bool, ir->max_height + 1);
+  memset(captured, 0, sizeof(bool) * (ir->max_height + 1));
+  for (int i = 0; i < ir->count; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead || node->opcode != OP_CLOSURE) {
+      continue;
+    }
+    uint8_t *pairs = CapturePairs(ir, node);
+    for (int j = 0; j < CaptureCount(ir, node); j++) {
+      if (pairs[2 * j] && pairs[2 * j + 1] <= ir->max_height) {
+        captured[pairs[2 * j + 1]] = true;
+      }
+    }
+  }
+  return captured;
+}
+
+static void RemoveUnreachable(Ir *ir) {
+  bool *reached = ALLOCATE(bool, ir->count);
+  memset(reached, 0, sizeof(bool) * ir->count);
+  int *worklist = ALLOCATE(int, ir->count);
+  int work = 0;
+  reached[0] = true;
+  worklist[work++] = 0;
+  while (work > 0) {
+    Node *node = &ir->nodes[worklist[--work]];
+    int successors[2];
+    int successor_count = 0;
+    if (IsWideJump(node->opcode)) {
+      successors[successor_count++] = node->operand;
+    }
+    if (FallsThrough(node)) {
+      successors[successor_count++] = NextLive(ir, (int)(node - ir->nodes));
+    }
+    for (int i = 0; i < successor_count; i++) {
+      int next = successors[i];
+      if (next < ir->count && !reached[next]) {
+        reached[next] = true;
+        worklist[work++] = next;
+      }
+    }
+  }
+  for (int i = 0; i < ir->count; i++) {
+    if (!reached[i]) {
+      ir->nodes[i].dead = true;
+    }
+  }
+  FREE_ARRAY(bool, reached, ir->count);
+  FREE_ARRAY(int, worklist, ir->count);
+}
+
+// Turns a store, a pop and a load of what was stored into just the store,
+// which leaves the value on the stack.
+static void ForwardStores(Ir *ir) {
+  for (int i = 0; i < ir->count; i++) {
+    Node *store = &ir->nodes[i];
+    uint8_t load;
+    switch (store->opcode) {
+    case OP_SET_LOCAL:
+      load = OP_GET_LOCAL;
+      break;
+    case OP_SET_GLOBAL_SLOT:
+      load = OP_GET_GLOBAL_SLOT;
+      break;
+    case OP_SET_UPVALUE:
+      load = OP_GET_UPVALUE;
+      break;
+    default:
+      continue;
+    }
+    if (store->dead) {
+      continue;
+    }
+    int pop = NextLive(ir, i);
+    int reload = pop < ir->count ? NextLive(ir, pop) : ir->count;
+    if (reload < ir->count && ir->nodes[pop].opcode == OP_POP &&
+        ir->nodes[reload].opcode == load &&
+        ir->nodes[reload].operand == store->operand &&
+        ir->incoming[pop] == 0 && ir->incoming[reload] == 0) {
+      ir->nodes[pop].dead = true;
+      ir->nodes[reload].dead = true;
+    }
+  }
+}
+
+// Value numbering. Two values get the same number only if they are equal:
+// the same constant, the same slot's value, the same global or upvalue read
+// with no store or call in between, or the same operator applied to values
+// with the same numbers. Strings are interned, so equal strings are the same
+// object, and every operator gives equal results for equal operands.
+
+typedef struct {
+  uint8_t opcode;
+  int left; // Value numbers of the operands, or a leaf's operand.
+  int right;
+  int value; // 0 for an empty entry.
+} Expression;
+
+typedef struct {
+  int value;
+  int start; // The first node of the code computing it, or -1.
+  bool pure; // Whether nodes `start` up to the current one only compute it.
+} StackValue;
+
+typedef struct {
+  Expression *expressions; // An open-addressed hash table.
+  int count;
+  int capacity;
+  int next_value;
+  int epoch; // Changes whenever globals or upvalues may have been stored.
+} Numbering;
+
+static Expression *FindExpression(Expression *expressions, int capacity,
+                                  uint8_t opcode, int left, int right) {
+  uint32_t hash = 2166136261u;
+  hash = (hash ^ opcode) * 16777619u;
+  hash = (hash ^ (uint32_t)left) * 16777619u;
+  hash = (hash ^ (uint32_t)right) * 16777619u;
+  uint32_t index = hash & (uint32_t)(capacity - 1);
+  while (true) {
+    Expression *expression = &expressions[index];
+    if (expression->value == 0 ||
+        (expression->opcode == opcode && expression->left == left &&
+         expression->right == right)) {
+      return expression;
+    }
+    index = (index + 1) & (uint32_t)(capacity - 1);
+  }
+}
+
+static Expression *AddExpression(Numbering *numbering, uint8_t opcode,
+                                 int left, int right) {
+  if (numbering->count + 1 > numbering->capacity * 3 / 4) {
+    int capacity = numbering->capacity < 64 ? 64 : numbering->capacity * 2;
+    Expression *expressions = ALLOCATE(Expression, capacity);
+    memset(expressions, 0, sizeof(Expression) * capacity);
+    for (int i = 0; i < numbering->capacity; i++) {
+      Expression *old = &numbering->expressions[i];
+      if (old->value != 0) {
+        *FindExpression(expressions, capacity, old->opcode, old->left,
+                        old->right) = *old;
+      }
+    }
+    FREE_ARRAY(Expression, numbering->expressions, numbering->capacity);
+    numbering->expressions = expressions;
+    numbering->capacity = capacity;
+  }
+  Expression *expression =
+      FindExpression(numbering->expressions, numbering->capacity, opcode,
+                     left, right);
+  if (expression->value == 0) {
+    expression->opcode = opcode;
+    expression->left = left;
+    expression->right = right;
+    numbering->count++;
+  }
+  return expression;
+}
+
+static int NewValue(Numbering *numbering) { return numbering->next_value++; }
+
+// The number of the value `opcode` computes from `left` and `right`. `seen`
+// tells whether it was already numbered.
+static int ValueNumber(Numbering *numbering, uint8_t opcode, int left,
+                       int right, bool *seen) {
+  Expression *expression = AddExpression(numbering, opcode, left, right);
+  *seen = expression->value != 0;
+  if (!*seen) {
+    expression->value = NewValue(numbering);
+  }
+  return expression->value;
+}
+
+// Replaces nodes `first` to `last`, which compute `value`, with a load of a
+// stack slot below `limit` that holds it, if there is one.
+static void ReuseValue(Ir *ir, StackValue *stack, int limit, int first,
+                       int last, int value) {
+  for (int slot = 0; slot < limit; slot++) {
+    if (stack[slot].value != value) {
+      continue;
+    }
+    ir->nodes[first].opcode = OP_GET_LOCAL;
+    ir->nodes[first].operand = slot;
+    for (int i = first + 1; i <= last; i++) {
+      ir->nodes[i].dead = true;
+    }
+    return;
+  }
+}
+
+static void NumberValues(Ir *ir) {
+  Numbering numbering = {NULL, 0, 0, 1, 0};
+  StackValue *stack = ALLOCATE(StackValue, ir->max_height + 1);
+  bool *captured = CapturedSlots(ir);
+  bool started = false;
+  for (int i = 0; i < ir->count; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead) {
+      continue;
+    }
+    int top = ir->heights[i];
+    if (!started || ir->incoming[i] > 0) {
+      // Nothing is known about the values arriving along a jump.
+      for (int slot = 0; slot < top; slot++) {
+        stack[slot] = (StackValue){NewValue(&numbering), -1, false};
+      }
+      numbering.epoch++;
+      started = true;
+    }
+    bool seen;
+    switch (node->opcode) {
+    case OP_CONSTANT:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE: {
+      int value =
+          ValueNumber(&numbering, node->opcode, node->operand, 0, &seen);
+      stack[top] = (StackValue){value, i, true};
+      break;
+    }
+    case OP_GET_LOCAL:
+      stack[top] = (StackValue){stack[node->operand].value, i, true};
+      break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_UPVALUE: {
+      int value = ValueNumber(&numbering, node->opcode, node->operand,
+                              numbering.epoch, &seen);
+      if (seen) {
+        ReuseValue(ir, stack, top, i, i, value);
+      }
+      stack[top] = (StackValue){value, i, true};
+      break;
+    }
+    case OP_SET_LOCAL:
+      stack[node->operand] = (StackValue){stack[top - 1].value, -1, false};
+      stack[top - 1].pure = false;
+      break;
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_UPVALUE: {
+      // The stored value is what a load reads until the next store or call.
+      numbering.epoch++;
+      uint8_t load = node->opcode == OP_SET_UPVALUE ? OP_GET_UPVALUE
+                                                    : OP_GET_GLOBAL_SLOT;
+      AddExpression(&numbering, load, node->operand, numbering.epoch)->value =
+          stack[top - 1].value;
+      stack[top - 1].pure = false;
+      break;
+    }
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE: {
+      StackValue *left = &stack[top - 2];
+      StackValue *right = &stack[top - 1];
+      int value = ValueNumber(&numbering, node->opcode, left->value,
+                              right->value, &seen);
+      bool pure = left->pure && right->pure;
+      if (seen && pure) {
+        ReuseValue(ir, stack, top - 2, left->start, i, value);
+      }
+      *left = (StackValue){value, left->start, pure};
+      break;
+    }
+    case OP_NOT:
+    case OP_NEGATE: {
+      StackValue *operand = &stack[top - 1];
+      int value =
+          ValueNumber(&numbering, node->opcode, operand->value, 0, &seen);
+      if (seen && operand->pure) {
+        ReuseValue(ir, stack, top - 1, operand->start, i, value);
+      }
+      operand->value = value;
+      break;
+    }
+    case OP_JUMP_IF_FALSE_LONG:
+      stack[top - 1].pure = false;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      stack[top - 1 - node->operand] =
+          (StackValue){NewValue(&numbering), i, false};
+      for (int slot = 0; slot < top - 1 - node->operand; slot++) {
+        if (captured[slot]) {
+          stack[slot].value = NewValue(&numbering);
+        }
+      }
+      numbering.epoch++;
+      break;
+    case OP_CLOSURE:
+      stack[top] = (StackValue){NewValue(&numbering), i, false};
+      break;
+    default:
+      break;
+    }
+  }
+  FREE_ARRAY(Expression, numbering.expressions, numbering.capacity);
+  FREE_ARRAY(StackValue, stack, ir->max_height + 1);
+  FREE_ARRAY(bool, captured, ir->max_height + 1);
+}
+
+// Loop-invariant code motion, for the test of a while or for loop. The test
+// runs first on every iteration, so if the code before the invariant part
+// cannot fail, computing that part once before the loop fails exactly when
+// the first test would have. The value lives in a new slot just below the
+// loop's own locals, which move up by one, and is popped after the loop.
+
+typedef struct {
+  int header; // The first node of the test, which the loop jumps back to.
+  int exit; // The OP_POP of the test's value once the loop is done.
+  int first; // The invariant nodes.
+  int last;
+  int slot; // The new slot: the stack height at the header.
+} Hoist;
+
+// A value on the stack while FindHoist() scans a test.
+typedef struct {
+  int first;
+  int last;
+  bool invariant;
+  bool computed; // Not just a load.
+} TestValue;
+
+static bool CannotFail(Node *node) {
+  switch (node->opcode) {
+  case OP_CONSTANT:
+  case OP_NULL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool GlobalStored(Ir *ir, Hoist *loop, int global) {
+  for (int i = loop->header; i < loop->exit; i++) {
+    Node *node = &ir->nodes[i];
+    if (!node->dead &&
+        (node->opcode == OP_SET_GLOBAL_SLOT ||
+         node->opcode == OP_DEFINE_GLOBAL_SLOT) &&
+        node->operand == global) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void ConsiderHoist(Hoist *hoist, TestValue *value) {
+  if (value->invariant && value->computed &&
+      (hoist->first == -1 || value->first < hoist->first)) {
+    hoist->first = value->first;
+    hoist->last = value->last;
+  }
+}
+
+// Finds what to hoist out of the loop whose backward jumps land on
+// `header`, if it is a loop with a test and part of the test is invariant.
+// `stored` and `values` are scratch space for as many slots as the stack has.
+static bool FindHoist(Ir *ir, int header, bool *captured, bool *stored,
+                      TestValue *values, Hoist *hoist) {
+  // The test ends at the first jump, which leaves the loop for the OP_POP
+  // just after the loop's last backward jump.
+  int test = header;
+  while (test < ir->count &&
+         (ir->nodes[test].dead || !IsWideJump(ir->nodes[test].opcode))) {
+    test++;
+  }
+  if (test == ir->count || ir->nodes[test].opcode != OP_JUMP_IF_FALSE_LONG) {
+    return false;
+  }
+  int exit = ir->nodes[test].operand;
+  if (exit <= test || exit >= ir->count || ir->nodes[exit].dead ||
+      ir->nodes[exit].opcode != OP_POP || ir->incoming[exit] != 1) {
+    return false;
+  }
+  int before_exit = exit - 1;
+  while (ir->nodes[before_exit].dead) {
+    before_exit--;
+  }
+  if (ir->nodes[before_exit].opcode != OP_LOOP_LONG) {
+    return false;
+  }
+  hoist->header = header;
+  hoist->exit = exit;
+  hoist->first = -1;
+  hoist->slot = ir->heights[header];
+
+  // Nothing may jump into the loop past its header, or out of it but for
+  // the test.
+  memset(stored, 0, sizeof(bool) * (ir->max_height + 1));
+  bool calls = false;
+  bool loops_back = false;
+  for (int i = header; i < exit; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead) {
+      continue;
+    }
+    if (i > header && ir->incoming[i] > 0 &&
+        (i <= test || ir->first_source[i] < header ||
+         ir->last_source[i] >= exit)) {
+      return false;
+    }
+    if (IsWideJump(node->opcode) && i != test &&
+        (node->operand < header || node->operand >= exit)) {
+      return false;
+    }
+    loops_back |= node->opcode == OP_LOOP_LONG && node->operand == header;
+    switch (node->opcode) {
+    case OP_SET_LOCAL:
+      stored[node->operand] = true;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      calls = true;
+      break;
+    case OP_CLOSURE: {
+      // Captures keep their slot in one byte.
+      uint8_t *pairs = CapturePairs(ir, node);
+      for (int j = 0; j < CaptureCount(ir, node); j++) {
+        if (pairs[2 * j] && pairs[2 * j + 1] >= hoist->slot &&
+            pairs[2 * j + 1] == UINT8_MAX) {
+          return false;
+        }
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  if (!loops_back) {
+    return false;
+  }
+
+  for (int i = header; i < test; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead) {
+      continue;
+    }
+    int top = ir->heights[i];
+    TestValue *left = top >= 2 ? &values[top - 2] : NULL;
+    TestValue *right = &values[top - 1];
+    switch (node->opcode) {
+    case OP_CONSTANT:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+      values[top] = (TestValue){i, i, true, false};
+      continue;
+    case OP_GET_LOCAL:
+      values[top] = (TestValue){i, i,
+                                node->operand < hoist->slot &&
+                                    !stored[node->operand] &&
+                                    !captured[node->operand],
+                                false};
+      continue;
+    case OP_GET_GLOBAL_SLOT:
+      values[top] = (TestValue){
+          i, i, !calls && !GlobalStored(ir, hoist, node->operand), false};
+      continue;
+    case OP_GET_UPVALUE:
+      values[top] = (TestValue){i, i, false, false};
+      continue;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      if (!left->invariant || !right->invariant) {
+        ConsiderHoist(hoist, left);
+        ConsiderHoist(hoist, right);
+      }
+      *left = (TestValue){left->first, i,
+                          left->invariant && right->invariant, true};
+      continue;
+    case OP_NOT:
+    case OP_NEGATE:
+      right->last = i;
+      right->computed = true;
+      continue;
+    default:
+      break;
+    }
+    // Anything else ends the part of the test this pass understands.
+    for (int slot = hoist->slot; slot < top; slot++) {
+      ConsiderHoist(hoist, &values[slot]);
+    }
+    test = i;
+    break;
+  }
+  if (ir->nodes[test].opcode == OP_JUMP_IF_FALSE_LONG) {
+    ConsiderHoist(hoist, &values[ir->heights[test] - 1]);
+  }
+  if (hoist->first == -1) {
+    return false;
+  }
+  for (int i = header; i < hoist->first; i++) {
+    if (!ir->nodes[i].dead && !CannotFail(&ir->nodes[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Moves a node inside a loop up past the loop's new slot.
+static void ShiftSlots(Ir *ir, Node *node, int slot) {
+  if ((node->opcode == OP_GET_LOCAL || node->opcode == OP_SET_LOCAL) &&
+      node->operand >= slot) {
+    node->operand++;
+  } else if (node->opcode == OP_CLOSURE) {
+    uint8_t *pairs = CapturePairs(ir, node);
+    for (int j = 0; j < CaptureCount(ir, node); j++) {
+      if (pairs[2 * j] && pairs[2 * j + 1] >= slot) {
+        pairs[2 * j + 1]++;
+      }
+    }
+  }
+}
+
+// Applies `hoists`, which are in order and whose loops do not overlap.
+static void ApplyHoists(Ir *ir, Hoist *hoists, int hoist_count) {
+  int capacity = ir->count;
+  int *hoist_at = ALLOCATE(int, ir->count);
+  for (int i = 0; i < ir->count; i++) {
+    hoist_at[i] = -1;
+  }
+  for (int h = 0; h < hoist_count; h++) {
+    hoist_at[hoists[h].header] = h;
+    capacity += hoists[h].last - hoists[h].first + 2;
+  }
+  Node *nodes = ALLOCATE(Node, capacity);
+  int *origin = ALLOCATE(int, capacity); // Of each node, or -1 if new.
+  int *index_of = ALLOCATE(int, ir->count + 1);
+  int *preheader = ALLOCATE(int, hoist_count);
+  int out = 0;
+  Hoist *hoist = NULL;
+  for (int i = 0; i < ir->count; i++) {
+    if (hoist_at[i] != -1) {
+      hoist = &hoists[hoist_at[i]];
+      preheader[hoist_at[i]] = out;
+      for (int j = hoist->first; j <= hoist->last; j++) {
+        if (!ir->nodes[j].dead) {
+          origin[out] = -1;
+          nodes[out++] = ir->nodes[j];
+        }
+      }
+    }
+    Node node = ir->nodes[i];
+    if (hoist != NULL && i < hoist->exit) {
+      if (i == hoist->first) {
+        node.opcode = OP_GET_LOCAL;
+        node.operand = hoist->slot;
+      } else if (i > hoist->first && i <= hoist->last) {
+        node.dead = true;
+      } else {
+        ShiftSlots(ir, &node, hoist->slot);
+      }
+    }
+    index_of[i] = out;
+    origin[out] = i;
+    nodes[out++] = node;
+    if (hoist != NULL && i == hoist->exit) {
+      origin[out] = -1;
+      nodes[out++] = (Node){.opcode = OP_POP,
+                            .operand = 0,
+                            .line = node.line,
+                            .captures = -1,
+                            .dead = false};
+      hoist = NULL;
+    }
+  }
+  index_of[ir->count] = out;
+
+  // Jumps from outside a loop to its header now run the hoisted code first.
+  for (int i = 0; i < out; i++) {
+    Node *node = &nodes[i];
+    if (origin[i] == -1 || !IsWideJump(node->opcode)) {
+      continue;
+    }
+    int h = node->operand < ir->count ? hoist_at[node->operand] : -1;
+    if (h != -1 &&
+        (origin[i] < hoists[h].header || origin[i] >= hoists[h].exit)) {
+      node->operand = preheader[h];
+    } else {
+      node->operand = index_of[node->operand];
+    }
+  }
+
+  FREE_ARRAY(int, hoist_at, ir->count);
+  FREE_ARRAY(int, origin, capacity);
+  FREE_ARRAY(int, index_of, ir->count + 1);
+  FREE_ARRAY(int, preheader, hoist_count);
+  FreeAnalysis(ir);
+  FREE_ARRAY(Node, ir->nodes, ir->capacity);
+  ir->nodes = nodes;
+  ir->count = out;
+  ir->capacity = capacity;
+}
+
+static bool HoistLoopTests(Ir *ir) {
+  bool *captured = CapturedSlots(ir);
+  bool *stored = ALLOCATE(bool, ir->max_height + 1);
+  TestValue *values = ALLOCATE(TestValue, ir->max_height + 1);
+  bool *is_header = ALLOCATE(bool, ir->count);
+  memset(is_header, 0, sizeof(bool) * ir->count);
+  for (int i = 0; i < ir->count; i++) {
+    if (!ir->nodes[i].dead && ir->nodes[i].opcode == OP_LOOP_LONG) {
+      is_header[ir->nodes[i].operand] = true;
+    }
+  }
+  Hoist *hoists = NULL;
+  int hoist_count = 0;
+  int hoist_capacity = 0;
+  int covered = 0; // Past the last loop hoisted from, so none overlap.
+  for (int i = 0; i < ir->count; i++) {
+    Hoist hoist;
+    if (!is_header[i] || i < covered ||
+        !FindHoist(ir, i, captured, stored, values, &hoist)) {
+      continue;
+    }
+    if (hoist_capacity < hoist_count + 1) {
+      int old_capacity = hoist_capacity;
+      hoist_capacity = GROW_CAPACITY(old_capacity);
+      hoists = GROW_ARRAY(Hoist, hoists, old_capacity, hoist_capacity);
+    }
+    hoists[hoist_count++] = hoist;
+    covered = hoist.exit + 1;
+  }
+  int max_height = ir->max_height;
+  FREE_ARRAY(bool, is_header, ir->count);
+  if (hoist_count > 0) {
+    ApplyHoists(ir, hoists, hoist_count);
+  }
+  FREE_ARRAY(bool, captured, max_height + 1);
+  FREE_ARRAY(bool, stored, max_height + 1);
+  FREE_ARRAY(TestValue, values, max_height + 1);
+  FREE_ARRAY(Hoist, hoists, hoist_capacity);
+  return hoist_count > 0;
+}
+
+static void SimplifyJumps(Ir *ir) {
+  for (int i = 0; i < ir->count; i++) {
+    Node *node = &ir->nodes[i];
+    if (node->dead) {
+      continue;
+    }
+    if (IsWideJump(node->opcode)) {
+      // A bounded number of hops, in case jumps go round in a circle.
+      for (int hops = 0; hops < 8; hops++) {
+        Node *target = &ir->nodes[node->operand];
+        if (target->opcode != OP_JUMP_LONG || target == node) {
+          break;
+        }
+        node->operand = target->operand;
+      }
+      if (node->opcode == OP_JUMP_LONG && node->operand == NextLive(ir, i)) {
+        node->dead = true;
+      }
+      continue;
+    }
+    int next = NextLive(ir, i);
+    if (CannotFail(node) && next < ir->count &&
+        ir->nodes[next].opcode == OP_POP && ir->incoming[next] == 0) {
+      node->dead = true;
+      ir->nodes[next].dead = true;
+    }
+  }
+}
+
+
+void OptimizeChunk(Chunk *chunk, int arity) {
+  Ir ir;
+  Lift(&ir, chunk, arity);
+  Analyze(&ir);
+  RemoveUnreachable(&ir);
+  Analyze(&ir);
+  ForwardStores(&ir);
+  Analyze(&ir);
+  while (HoistLoopTests(&ir)) {
+    Analyze(&ir);
+  }
+  NumberValues(&ir);
+  Analyze(&ir);
+  SimplifyJumps(&ir);
+  Lower(&ir);
+  FreeIr(&ir);
+}
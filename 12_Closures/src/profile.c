@@ -0,0 +1,330 @@
+#include "profile.h"
+#include "common.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef PROFILE_OPS
+
+// One opcode, pair or triple that ran. Unused positions hold
+// PROFILE_NO_OPCODE.
+typedef struct {
+  uint64_t count;
+  uint8_t opcodes[3];
+} Sequence;
+
+typedef struct {
+  Sequence *sequences;
+  int count;
+  int capacity;
+} SequenceList;
+
+OpProfile *NewOpProfile(bool time, const char *json_path) {
+  OpProfile *profile = ALLOCATE(OpProfile, 1);
+  memset(profile, 0, sizeof(OpProfile));
+  profile->time = time;
+  profile->json_path = json_path;
+  if (time) {
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+      uint64_t start = ReadTicks();
+      uint64_t elapsed = ReadTicks() - start;
+      if (elapsed < overhead) {
+        overhead = elapsed;
+      }
+    }
+    profile->tick_overhead = overhead;
+  }
+  RestartOpProfile(profile);
+  return profile;
+}
+
+void RestartOpProfile(OpProfile *profile) {
+  profile->previous[0] = PROFILE_NO_OPCODE;
+  profile->previous[1] = PROFILE_NO_OPCODE;
+  profile->last_tick = ReadTicks();
+}
+
+void FreeOpProfile(OpProfile *profile) { FREE(OpProfile, profile); }
+
+static void AddSequence(SequenceList *list, uint64_t count, int first,
+                        int second, int third) {
+  if (count == 0) {
+    return;
+  }
+  if (list->count + 1 > list->capacity) {
+    int old_capacity = list->capacity;
+    list->capacity = GROW_CAPACITY(old_capacity);
+    list->sequences =
+        GROW_ARRAY(Sequence, list->sequences, old_capacity, list->capacity);
+  }
+  Sequence *sequence = &list->sequences[list->count++];
+  sequence->count = count;
+  sequence->opcodes[0] = (uint8_t)first;
+  sequence->opcodes[1] = (uint8_t)second;
+  sequence->opcodes[2] = (uint8_t)third;
+}
+
+static int CompareSequences(const void *a, const void *b) {
+  const Sequence *first = a;
+  const Sequence *second = b;
+  if (first->count != second->count) {
+    return first->count > second->count ? -1 : 1;
+  }
+  return memcmp(first->opcodes, second->opcodes, sizeof(first->opcodes));
+}
+
+// Lists the sequences of `length` opcodes that ran, most frequent first.
+// Those reaching back before the start of a run are left out.
+static SequenceList SortSequences(OpProfile *profile, int length) {
+  SequenceList list = {NULL, 0, 0};
+  const int none = PROFILE_NO_OPCODE;
+  for (int a = 0; a < OPCODE_COUNT; a++) {
+    if (length == 1) {
+      AddSequence(&list, profile->counts[a], a, none, none);
+      continue;
+    }
+    for (int b = 0; b < OPCODE_COUNT; b++) {
+      if (length == 2) {
+        AddSequence(&list, profile->pairs[a][b], a, b, none);
+        continue;
+      }
+      for (int c = 0; c < OPCODE_COUNT; c++) {
+        AddSequence(&list, profile->triples[a][b][c], a, b, c);
+      }
+    }
+  }
+  if (list.count > 0) {
+    qsort(list.sequences, list.count, sizeof(Sequence), CompareSequences);
+  }
+  return list;
+}
+
+static void FreeSequences(SequenceList *list) {
+  FREE_ARRAY(Sequence, list->sequences, list->capacity);
+}
+
+// Mean cycles per run of `opcode`, less the cost of reading the counter.
+static double MeanCycles(OpProfile *profile, int opcode) {
+  double cycles = (double)profile->cycles[opcode] / profile->counts[opcode] -
+                  (double)profile->tick_overhead;
+  return cycles > 0 ? cycles : 0;
+}
+
+static uint64_t TotalInstructions(OpProfile *profile) {
+  uint64_t total = 0;
+  for (int opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+    total += profile->counts[opcode];
+  }
+  return total;
+}
+
+static void PrintSequenceText(const char *title, SequenceList *list,
+                              uint64_t total) {
+  fprintf(stderr, "\n== %s ==\n", title);
+  for (int i = 0; i < list->count && i < PROFILE_TOP; i++) {
+    Sequence *sequence = &list->sequences[i];
+    fprintf(stderr, "%14llu %6.2f%% ", (unsigned long long)sequence->count,
+            100.0 * (double)sequence->count / (double)total);
+    for (int j = 0; j < 3 && sequence->opcodes[j] != PROFILE_NO_OPCODE; j++) {
+      fprintf(stderr, " %s", OpcodeName(sequence->opcodes[j]));
+    }
+    fputc('\n', stderr);
+  }
+}
+
+static void ReportText(OpProfile *profile, SequenceList lists[3]) {
+  uint64_t total = TotalInstructions(profile);
+  fprintf(stderr, "== Opcode profile: %llu instructions ==\n",
+          (unsigned long long)total);
+  fprintf(stderr, "%14s %7s ", "count", "%");
+  if (profile->time) {
+    fprintf(stderr, "%8s ", "cycles");
+  }
+  fprintf(stderr, " opcode\n");
+  for (int i = 0; i < lists[0].count; i++) {
+    Sequence *sequence = &lists[0].sequences[i];
+    int opcode = sequence->opcodes[0];
+    fprintf(stderr, "%14llu %6.2f%% ", (unsigned long long)sequence->count,
+            100.0 * (double)sequence->count / (double)total);
+    if (profile->time) {
+      fprintf(stderr, "%8.1f ", MeanCycles(profile, opcode));
+    }
+    fprintf(stderr, " %s\n", OpcodeName((uint8_t)opcode));
+  }
+  PrintSequenceText("Top pairs", &lists[1], total);
+  PrintSequenceText("Top triples", &lists[2], total);
+}
+
+static void WriteJsonSequences(FILE *file, const char *name,
+                               SequenceList *list, bool last) {
+  fprintf(file, "  \"%s\": [\n", name);
+  for (int i = 0; i < list->count; i++) {
+    Sequence *sequence = &list->sequences[i];
+    fprintf(file, "    {\"opcodes\": [");
+    for (int j = 0; j < 3 && sequence->opcodes[j] != PROFILE_NO_OPCODE; j++) {
+      fprintf(file, "%s\"%s\"", j > 0 ? ", " : "",
+              OpcodeName(sequence->opcodes[j]));
+    }
+    fprintf(file, "], \"count\": %llu}%s\n",
+            (unsigned long long)sequence->count,
+            i + 1 < list->count ? "," : "");
+  }
+  fprintf(file, "  ]%s\n", last ? "" : ",");
+}
+
+static void ReportJson(OpProfile *profile, SequenceList lists[3]) {
+  FILE *file = fopen(profile->json_path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write the opcode profile to \"%s\".\n",
+            profile->json_path);
+    return;
+  }
+  fprintf(file, "{\n  \"instructions\": %llu,\n  \"timed\": %s,\n",
+          (unsigned long long)TotalInstructions(profile),
+          profile->time ? "true" : "false");
+  fprintf(file, "  \"opcodes\": [\n");
+  for (int i = 0; i < lists[0].count; i++) {
+    Sequence *sequence = &lists[0].sequences[i];
+    fprintf(file, "    {\"opcode\": \"%s\", \"count\": %llu",
+            OpcodeName(sequence->opcodes[0]),
+            (unsigned long long)sequence->count);
+    if (profile->time) {
+      fprintf(file, ", \"cycles\": %.1f",
+              MeanCycles(profile, sequence->opcodes[0]));
+    }
+    fprintf(file, "}%s\n", i + 1 < lists[0].count ? "," : "");
+  }
+  fprintf(file, "  ],\n");
+  WriteJsonSequences(file, "pairs", &lists[1], false);
+  WriteJsonSequences(file, "triples", &lists[2], true);
+  fprintf(file, "}\n");
+  fclose(file);
+}
+
+void ReportOpProfile(OpProfile *profile) {
+  SequenceList lists[3];
+  for (int length = 1; length <= 3; length++) {
+    lists[length - 1] = SortSequences(profile, length);
+  }
+  if (profile->json_path != NULL) {
+    ReportJson(profile, lists);
+  } else {
+    ReportText(profile, lists);
+  }
+  for (int i = 0; i < 3; i++) {
+    FreeSequences(&lists[i]);
+  }
+}
+
+LineProfile *NewLineProfile(bool time) {
+  LineProfile *profile = ALLOCATE(LineProfile, 1);
+  profile->counts = NULL;
+  profile->cycles = NULL;
+  profile->capacity = 0;
+  profile->time = time;
+  profile->previous_line = 0;
+  GrowLineProfile(profile, 0);
+  profile->last_tick = ReadTicks();
+  return profile;
+}
+
+void GrowLineProfile(LineProfile *profile, int line) {
+  int old_capacity = profile->capacity;
+  int capacity = GROW_CAPACITY(old_capacity);
+  while (capacity <= line) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+  profile->counts =
+      GROW_ARRAY(uint64_t, profile->counts, old_capacity, capacity);
+  profile->cycles =
+      GROW_ARRAY(uint64_t, profile->cycles, old_capacity, capacity);
+  memset(profile->counts + old_capacity, 0,
+         sizeof(uint64_t) * (capacity - old_capacity));
+  memset(profile->cycles + old_capacity, 0,
+         sizeof(uint64_t) * (capacity - old_capacity));
+  profile->capacity = capacity;
+}
+
+void FreeLineProfile(LineProfile *profile) {
+  FREE_ARRAY(uint64_t, profile->counts, profile->capacity);
+  FREE_ARRAY(uint64_t, profile->cycles, profile->capacity);
+  FREE(LineProfile, profile);
+}
+
+// Marks every line some function has an instruction on. Functions are
+// compiled whether or not they are called, so this finds the code that never
+// ran as well.
+static bool *CodeLines(VM *vm, int line_count) {
+  bool *has_code = ALLOCATE(bool, line_count + 1);
+  memset(has_code, 0, sizeof(bool) * (line_count + 1));
+  for (Object *object = vm->objects; object != NULL; object = object->next) {
+    if (object->type != OBJ_FUNCTION) {
+      continue;
+    }
+    ObjFunction *function = (ObjFunction *)object;
+    for (int i = 0; i < function->instruction_count; i++) {
+      int line =
+          GetLine(&function->chunk, function->instructions[i].offset);
+      if (line <= line_count) {
+        has_code[line] = true;
+      }
+    }
+  }
+  return has_code;
+}
+
+void WriteLineProfile(VM *vm, LineProfile *profile, const char *source,
+                      const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write the line profile to \"%s\".\n", path);
+    return;
+  }
+  int line_count = 0;
+  for (const char *c = source; *c != '\0'; c++) {
+    if (*c == '\n' || c[1] == '\0') {
+      line_count++;
+    }
+  }
+  bool *has_code = CodeLines(vm, line_count);
+  uint64_t total_cycles = 0;
+  for (int line = 0; line < profile->capacity; line++) {
+    total_cycles += profile->cycles[line];
+  }
+  int code_lines = 0;
+  int covered_lines = 0;
+  const char *start = source;
+  for (int line = 1; line <= line_count; line++) {
+    const char *end = strchr(start, '\n');
+    int length = end != NULL ? (int)(end - start) : (int)strlen(start);
+    uint64_t count = line < profile->capacity ? profile->counts[line] : 0;
+    if (has_code[line]) {
+      code_lines++;
+      covered_lines += count > 0;
+    }
+    if (count > 0) {
+      fprintf(file, "%14llu", (unsigned long long)count);
+    } else {
+      fprintf(file, "%14s", has_code[line] ? "#####" : "-");
+    }
+    if (profile->time) {
+      if (count > 0 && total_cycles > 0) {
+        fprintf(file, " %6.2f%%", 100.0 * (double)profile->cycles[line] /
+                                      (double)total_cycles);
+      } else {
+        fprintf(file, " %7s", "");
+      }
+    }
+    fprintf(file, " %5d| %.*s\n", line, length, start);
+    start = end != NULL ? end + 1 : start + length;
+  }
+  fprintf(file, "Lines executed: %.2f%% of %d\n",
+          code_lines > 0 ? 100.0 * covered_lines / code_lines : 0.0,
+          code_lines);
+  fclose(file);
+  FREE_ARRAY(bool, has_code, line_count + 1);
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include "registers.h"
+#include "ir.h"
+#include "memory.h"
+
+// EmitRegisterCode() lifts the stack code into the form of ir.h and walks it,
+// keeping track of where each stack position's value really is: in the
+// position's own slot, in a lower slot it was loaded from, or in the constant
+// pool, as a register form's source operand says. Loads and constants then cost
+// nothing, and the operators using them name those places directly. Values only
+// go to their own slots where stack code runs or a jump lands, since both
+// expect the stack in memory. A local's value has to stay where a load found it
+// until it is used, so every store first saves what still refers to the slot it
+// overwrites; only calls, which are stack code, could change it otherwise.
+
+typedef struct {
+  Ir *ir;
+  Node *nodes; // The output. Jumps name input nodes until the very end.
+  int count;
+  int capacity;
+  int *location; // Of each stack position's value, as a source operand.
+  int height;
+  int stack_top; // Where the code emitted so far leaves the stack top.
+  int last_register; // The last node emitted while its `top` may still
+                     // change, or -1.
+} Emitter;
+
+static uint8_t RegisterForm(uint8_t opcode) {
+  switch (opcode) {
+  case OP_NEGATE:
+    return OP_NEGATE_R;
+  case OP_NOT:
+    return OP_NOT_R;
+  case OP_EQUAL:
+    return OP_EQUAL_R;
+  case OP_GREATER:
+    return OP_GREATER_R;
+  case OP_LESS:
+    return OP_LESS_R;
+  case OP_ADD:
+    return OP_ADD_R;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_R;
+  case OP_MULTIPLY:
+    return OP_MULTIPLY_R;
+  default:
+    return OP_DIVIDE_R;
+  }
+}
+
+static uint8_t CompareJumpForm(uint8_t opcode) {
+  switch (opcode) {
+  case OP_EQUAL:
+    return OP_EQUAL_JUMP_R;
+  case OP_GREATER:
+    return OP_GREATER_JUMP_R;
+  default:
+    return OP_LESS_JUMP_R;
+  }
+}
+
+static Node *EmitNode(Emitter *emitter, Node *node) {
+  if (emitter->count + 1 > emitter->capacity) {
+    int old_capacity = emitter->capacity;
+    emitter->capacity = GROW_CAPACITY(old_capacity);
+    emitter->nodes =
+        GROW_ARRAY(Node, emitter->nodes, old_capacity, emitter->capacity);
+  }
+  Node *copy = &emitter->nodes[emitter->count++];
+  *copy = *node;
+  emitter->stack_top = emitter->height;
+  emitter->last_register = -1;
+  return copy;
+}
+
+static Node *EmitRegister(Emitter *emitter, uint8_t opcode, int a, int b,
+                          int c, int top, int line) {
+  Node node = {.opcode = opcode,
+               .operand = 0,
+               .line = line,
+               .captures = -1,
+               .dead = false,
+               .a = (uint8_t)a,
+               .b = (uint8_t)b,
+               .c = (uint8_t)c,
+               .top = (uint8_t)top};
+  Node *copy = EmitNode(emitter, &node);
+  emitter->stack_top = top;
+  if (!IsJump(opcode)) {
+    emitter->last_register = emitter->count - 1;
+  }
+  return copy;
+}
+
+// Stores the value of stack position `position` in its own slot.
+static void Materialize(Emitter *emitter, int position, int line) {
+  int location = emitter->location[position];
+  if (location != position) {
+    EmitRegister(emitter, OP_MOVE, position, location, 0, emitter->height,
+                 line);
+    emitter->location[position] = position;
+  }
+}
+
+// Puts the whole stack in memory, with the stack top where stack code
+// expects it.
+static void Sync(Emitter *emitter, int line) {
+  for (int position = 0; position < emitter->height; position++) {
+    Materialize(emitter, position, line);
+  }
+  if (emitter->stack_top == emitter->height) {
+    return;
+  }
+  if (emitter->last_register != -1) {
+    emitter->nodes[emitter->last_register].top = (uint8_t)emitter->height;
+    emitter->stack_top = emitter->height;
+  } else if (emitter->stack_top == emitter->height + 1) {
+    Node pop = {.opcode = OP_POP, .operand = 0, .line = line, .captures = -1,
+                .dead = false};
+    EmitNode(emitter, &pop);
+  } else {
+    int slot = emitter->height - 1;
+    EmitRegister(emitter, OP_MOVE, slot, slot, 0, emitter->height, line);
+  }
+}
+
+// Stores the top of the stack in local `slot`, leaving it on the stack.
+static void StoreLocal(Emitter *emitter, int slot, int line) {
+  int *location = emitter->location;
+  int value = emitter->height - 1;
+  int source = location[value];
+  for (int position = slot + 1; position < value; position++) {
+    if (location[position] == slot) {
+      Materialize(emitter, position, line);
+    }
+  }
+  if (source == value && emitter->last_register == emitter->count - 1 &&
+      emitter->last_register != -1 &&
+      emitter->nodes[emitter->last_register].a == value) {
+    // The value was just computed. It can go straight to the local.
+    emitter->nodes[emitter->last_register].a = (uint8_t)slot;
+    location[value] = slot;
+  } else if (source != slot) {
+    EmitRegister(emitter, OP_MOVE, slot, source, 0, emitter->height, line);
+    if (source != value) {
+      location[value] = slot;
+    }
+  }
+  location[slot] = slot;
+}
+
+// Turns the comparison at `index`, perhaps negated, a jump if it is false and
+// the pop on either path into a single compare-and-jump, which lands past the
+// pop at the target. Returns the last node it used, or -1 if the code there
+// is anything else.
+static int FuseCompareJump(Emitter *emitter, int index) {
+  Ir *ir = emitter->ir;
+  Node *compare = &ir->nodes[index];
+  int jump = NextLive(ir, index);
+  bool negated = false;
+  if (jump < ir->count && ir->nodes[jump].opcode == OP_NOT &&
+      ir->incoming[jump] == 0) {
+    negated = true;
+    jump = NextLive(ir, jump);
+  }
+  if (jump >= ir->count || ir->nodes[jump].opcode != OP_JUMP_IF_FALSE_LONG ||
+      ir->incoming[jump] != 0) {
+    return -1;
+  }
+  int pop = NextLive(ir, jump);
+  int target = ir->nodes[jump].operand;
+  if (pop >= ir->count || ir->nodes[pop].opcode != OP_POP ||
+      ir->incoming[pop] != 0 || target >= ir->count ||
+      ir->nodes[target].opcode != OP_POP) {
+    return -1;
+  }
+  int landing = NextLive(ir, target);
+  int left = emitter->height - 2;
+  for (int position = 0; position < left; position++) {
+    Materialize(emitter, position, compare->line);
+  }
+  // The jump is taken when the comparison gives what the test negates to
+  // false.
+  Node *node = EmitRegister(emitter, CompareJumpForm(compare->opcode),
+                            negated ? 1 : 0, emitter->location[left],
+                            emitter->location[left + 1], left, compare->line);
+  node->operand = landing;
+  ir->incoming[target]--;
+  ir->incoming[landing]++;
+  emitter->height = left;
+  return pop;
+}
+
+// Translates the node at `index`, and perhaps some after it. Returns the last
+// node it used.
+static int Translate(Emitter *emitter, int index) {
+  Node *node = &emitter->ir->nodes[index];
+  int *location = emitter->location;
+  int height = emitter->height;
+  switch (node->opcode) {
+  case OP_CONSTANT:
+    if (node->operand < RK_CONSTANT) {
+      location[emitter->height++] = RK_CONSTANT | node->operand;
+      return index;
+    }
+    break;
+  case OP_GET_LOCAL:
+    location[height] = location[node->operand];
+    emitter->height++;
+    return index;
+  case OP_SET_LOCAL:
+    StoreLocal(emitter, node->operand, node->line);
+    return index;
+  case OP_POP:
+    emitter->height--;
+    return index;
+  case OP_NEGATE:
+  case OP_NOT:
+    EmitRegister(emitter, RegisterForm(node->opcode), height - 1,
+                 location[height - 1], 0, height, node->line);
+    location[height - 1] = height - 1;
+    return index;
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS: {
+    int last = FuseCompareJump(emitter, index);
+    if (last != -1) {
+      return last;
+    }
+  }
+    // Fall through.
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+    emitter->height--;
+    EmitRegister(emitter, RegisterForm(node->opcode), height - 2,
+                 location[height - 2], location[height - 1], height - 1,
+                 node->line);
+    location[height - 2] = height - 2;
+    return index;
+  default:
+    break;
+  }
+  Sync(emitter, node->line);
+  emitter->height += NodeEffect(node);
+  for (int position = height; position < emitter->height; position++) {
+    location[position] = position;
+  }
+  EmitNode(emitter, node);
+  return index;
+}
+
+void EmitRegisterCode(Chunk *chunk, int arity) {
+  Ir ir;
+  Lift(&ir, chunk, arity);
+  Analyze(&ir);
+  if (ir.max_height < RK_CONSTANT) {
+    Emitter emitter = {&ir, NULL, 0, 0, NULL, arity + 1, arity + 1, -1};
+    emitter.location = ALLOCATE(int, ir.max_height + 1);
+    for (int position = 0; position <= ir.max_height; position++) {
+      emitter.location[position] = position;
+    }
+    int *index_of = ALLOCATE(int, ir.count + 1);
+    bool reached = true;
+    for (int i = 0; i < ir.count; i++) {
+      Node *node = &ir.nodes[i];
+      if (ir.incoming[i] > 0) {
+        if (reached) {
+          Sync(&emitter, node->line);
+        } else {
+          emitter.height = ir.heights[i];
+          emitter.stack_top = emitter.height;
+          for (int position = 0; position < emitter.height; position++) {
+            emitter.location[position] = position;
+          }
+        }
+        emitter.last_register = -1;
+        reached = true;
+      }
+      index_of[i] = emitter.count;
+      if (reached) {
+        i = Translate(&emitter, i);
+        reached = FallsThrough(&ir.nodes[i]);
+      }
+    }
+    index_of[ir.count] = emitter.count;
+    for (int i = 0; i < emitter.count; i++) {
+      Node *node = &emitter.nodes[i];
+      if (IsJump(node->opcode)) {
+        node->operand = index_of[node->operand];
+      }
+    }
+    FREE_ARRAY(int, index_of, ir.count + 1);
+    FREE_ARRAY(int, emitter.location, ir.max_height + 1);
+    FreeAnalysis(&ir);
+    FREE_ARRAY(Node, ir.nodes, ir.capacity);
+    ir.nodes = emitter.nodes;
+    ir.count = emitter.count;
+    ir.capacity = emitter.capacity;
+    Lower(&ir);
+  }
+  FreeIr(&ir);
+}
@@ -0,0 +1,200 @@
+#include "sampler.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <sys/time.h>
+
+// The signal handler only reads the frame chain and the functions it points
+// to, which are never freed while the VM runs, and writes into tables that
+// are allocated before the timer starts.
+
+typedef struct {
+  ObjFunction *function;
+  int line; // Of the call the frame is making, or 0 for the innermost frame.
+} SampledFrame;
+
+typedef struct {
+  uint64_t hash;
+  int start; // Of the stack's frames in Sampler.frames, innermost first.
+  int depth;
+  bool truncated;
+  uint64_t count; // 0 for an empty bucket.
+} SampledStack;
+
+typedef struct {
+  VM *vm;
+  SampledStack *stacks; // An open-addressed hash table.
+  SampledFrame *frames;
+  int frame_count;
+  uint64_t idle; // Samples taken with no Lox code running.
+  uint64_t dropped; // While the frame chain was changing, or the tables full.
+} Sampler;
+
+static Sampler sampler;
+
+// The source line of the call a caller frame is making, or 0 if its ip is
+// not inside its function: a frame can be sampled while a call is
+// rewriting it.
+static int CallLine(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  ptrdiff_t index = frame->ip - function->instructions;
+  if (index < 1 || index > function->instruction_count) {
+    return 0;
+  }
+  return GetLine(&function->chunk, function->instructions[index - 1].offset);
+}
+
+// Appends `frames`, innermost first, to the sample. Returns false once the
+// sample is full.
+static bool AddFrames(SampledFrame *sample, int *depth, CallFrame *frames,
+                      int frame_count) {
+  for (int i = frame_count - 1; i >= 0; i--) {
+    if (*depth == SAMPLE_DEPTH) {
+      return false;
+    }
+    sample[*depth].function = frames[i].closure->function;
+    sample[*depth].line = *depth == 0 ? 0 : CallLine(&frames[i]);
+    (*depth)++;
+  }
+  return true;
+}
+
+static bool SameFrames(SampledFrame *a, SampledFrame *b, int depth) {
+  for (int i = 0; i < depth; i++) {
+    if (a[i].function != b[i].function || a[i].line != b[i].line) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void RecordSample(SampledFrame *sample, int depth, bool truncated) {
+  uint64_t hash = 14695981039346656037u;
+  for (int i = 0; i < depth; i++) {
+    hash = (hash ^ (uintptr_t)sample[i].function) * 1099511628211u;
+    hash = (hash ^ (uint64_t)sample[i].line) * 1099511628211u;
+  }
+  for (int probe = 0; probe < SAMPLE_STACKS; probe++) {
+    SampledStack *stack =
+        &sampler.stacks[(hash + (uint64_t)probe) & (SAMPLE_STACKS - 1)];
+    if (stack->count == 0) {
+      if (sampler.frame_count + depth > SAMPLE_FRAMES) {
+        break;
+      }
+      stack->hash = hash;
+      stack->start = sampler.frame_count;
+      stack->depth = depth;
+      stack->truncated = truncated;
+      stack->count = 1;
+      memcpy(&sampler.frames[stack->start], sample,
+             sizeof(SampledFrame) * (size_t)depth);
+      sampler.frame_count += depth;
+      return;
+    }
+    if (stack->hash == hash && stack->depth == depth &&
+        stack->truncated == truncated &&
+        SameFrames(&sampler.frames[stack->start], sample, depth)) {
+      stack->count++;
+      return;
+    }
+  }
+  sampler.dropped++;
+}
+
+static void TakeSample(int signal_number) {
+  (void)signal_number;
+  VM *vm = sampler.vm;
+  if (vm->frames_changing) {
+    sampler.dropped++;
+    return;
+  }
+  SampledFrame sample[SAMPLE_DEPTH];
+  int depth = 0;
+  bool complete = AddFrames(sample, &depth, vm->frames, vm->frame_count);
+  for (ObjFiber *fiber = vm->fiber->caller; complete && fiber != NULL;
+       fiber = fiber->caller) {
+    complete = AddFrames(sample, &depth, fiber->frames, fiber->frame_count);
+  }
+  if (depth == 0) {
+    sampler.idle++;
+    return;
+  }
+  RecordSample(sample, depth, !complete);
+}
+
+bool StartSampling(VM *vm, int hz) {
+  if (hz <= 0 || hz > 100000) {
+    hz = SAMPLE_DEFAULT_HZ;
+  }
+  sampler.vm = vm;
+  sampler.stacks = ALLOCATE(SampledStack, SAMPLE_STACKS);
+  memset(sampler.stacks, 0, sizeof(SampledStack) * SAMPLE_STACKS);
+  sampler.frames = ALLOCATE(SampledFrame, SAMPLE_FRAMES);
+  sampler.frame_count = 0;
+  sampler.idle = 0;
+  sampler.dropped = 0;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = TakeSample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  struct itimerval interval;
+  interval.it_interval.tv_sec = 0;
+  interval.it_interval.tv_usec = 1000000 / hz;
+  interval.it_value = interval.it_interval;
+  if (sigaction(SIGPROF, &action, NULL) != 0 ||
+      setitimer(ITIMER_PROF, &interval, NULL) != 0) {
+    fprintf(stderr, "Could not start the sampling profiler.\n");
+    return false;
+  }
+  return true;
+}
+
+static void PrintFrame(FILE *file, SampledFrame *frame) {
+  ObjString *name = frame->function->name;
+  fprintf(file, "%s", name != NULL ? name->chars : "script");
+  if (frame->line != 0) {
+    fprintf(file, ":%d", frame->line);
+  }
+}
+
+void StopSampling(const char *path) {
+  struct itimerval stop = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &stop, NULL);
+  // A signal may still be pending, and by default it would end the process.
+  signal(SIGPROF, SIG_IGN);
+
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write the profile to \"%s\".\n", path);
+  } else {
+    for (int i = 0; i < SAMPLE_STACKS; i++) {
+      SampledStack *stack = &sampler.stacks[i];
+      if (stack->count == 0) {
+        continue;
+      }
+      if (stack->truncated) {
+        fprintf(file, "[truncated];");
+      }
+      SampledFrame *frames = &sampler.frames[stack->start];
+      for (int j = stack->depth - 1; j >= 0; j--) {
+        PrintFrame(file, &frames[j]);
+        fputc(j > 0 ? ';' : ' ', file);
+      }
+      fprintf(file, "%llu\n", (unsigned long long)stack->count);
+    }
+    if (sampler.idle > 0) {
+      fprintf(file, "[outside Lox] %llu\n", (unsigned long long)sampler.idle);
+    }
+    if (sampler.dropped > 0) {
+      fprintf(file, "[dropped] %llu\n", (unsigned long long)sampler.dropped);
+    }
+    fclose(file);
+  }
+  FREE_ARRAY(SampledStack, sampler.stacks, SAMPLE_STACKS);
+  FREE_ARRAY(SampledFrame, sampler.frames, SAMPLE_FRAMES);
+  sampler.vm = NULL;
+}
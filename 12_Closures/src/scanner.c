@@ -1,79 +1,71 @@
 #include "scanner.h"
 #include "common.h"
 
-typedef struct {
-  const char *start;
-  const char *current;
-  int line;
-} Scanner;
-
-Scanner scanner;
-
-void InitScanner(const char *source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+void InitScanner(Scanner *scanner, const char *source) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
 }
 
-static bool IsAtEnd() { return *scanner.current == '\0'; }
+static bool IsAtEnd(Scanner *scanner) { return *scanner->current == '\0'; }
 
-static char Advance() {
-  scanner.current++;
-  return scanner.current[-1];
+static char Advance(Scanner *scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static char Peek() { return *scanner.current; }
+static char Peek(Scanner *scanner) { return *scanner->current; }
 
-static char PeekNext() {
-  if (IsAtEnd())
+static char PeekNext(Scanner *scanner) {
+  if (IsAtEnd(scanner))
     return '\0';
-  return scanner.current[1];
+  return scanner->current[1];
 }
 
-static bool Match(char expected) {
-  if (IsAtEnd())
+static bool Match(Scanner *scanner, char expected) {
+  if (IsAtEnd(scanner))
     return false;
-  if (*scanner.current != expected)
+  if (*scanner->current != expected)
     return false;
-  scanner.current++;
+  scanner->current++;
   return true;
 }
 
-static Token MakeToken(TokenType type) {
+static Token MakeToken(Scanner *scanner, TokenType type) {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
   return token;
 }
 
-static Token ErrorToken(const char *message) {
+static Token ErrorToken(Scanner *scanner, const char *message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
-static void SkipWhitespace() {
+static void SkipWhitespace(Scanner *scanner) {
   while (true) {
-    char c = Peek();
+    char c = Peek(scanner);
     switch (c) {
     case ' ':
     case '\r':
     case '\t':
-      Advance();
+      Advance(scanner);
       break;
     case '\n':
-      scanner.line++;
-      Advance();
+      scanner->line++;
+      Advance(scanner);
       break;
     case '/':
-      if (PeekNext() == '/') {
-        while (Peek() != '\n' && !IsAtEnd())
-          Advance();
+      if (PeekNext(scanner) == '/') {
+        while (Peek(scanner) != '\n' && !IsAtEnd(scanner))
+          Advance(scanner);
       } else {
         return;
       }
@@ -84,153 +76,157 @@ static void SkipWhitespace() {
   }
 }
 
-static Token String() {
-  while (Peek() != '"' && !IsAtEnd()) {
-    if (Peek() == '\n')
-      scanner.line++;
-    Advance();
+static Token String(Scanner *scanner) {
+  while (Peek(scanner) != '"' && !IsAtEnd(scanner)) {
+    if (Peek(scanner) == '\n')
+      scanner->line++;
+    Advance(scanner);
   }
-  if (IsAtEnd())
-    return ErrorToken("Unterminated string.");
+  if (IsAtEnd(scanner))
+    return ErrorToken(scanner, "Unterminated string.");
 
-  Advance();
-  return MakeToken(TOKEN_STRING);
+  Advance(scanner);
+  return MakeToken(scanner, TOKEN_STRING);
 }
 
 static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
 
-static Token Number() {
-  while (IsDigit(Peek()))
-    Advance();
+static Token Number(Scanner *scanner) {
+  while (IsDigit(Peek(scanner)))
+    Advance(scanner);
 
   // Look for a fractional part.
-  if (Peek() == '.' && IsDigit(PeekNext())) {
+  if (Peek(scanner) == '.' && IsDigit(PeekNext(scanner))) {
     // Consume the ".".
-    Advance();
+    Advance(scanner);
 
-    while (IsDigit(Peek()))
-      Advance();
+    while (IsDigit(Peek(scanner)))
+      Advance(scanner);
   }
 
-  return MakeToken(TOKEN_NUMBER);
+  return MakeToken(scanner, TOKEN_NUMBER);
 }
 
 static bool IsAlpha(char c) {
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static TokenType CheckKeyword(int start, int length, const char *rest,
-                              TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType CheckKeyword(Scanner *scanner, int start, int length,
+                              const char *rest, TokenType type) {
+  if (scanner->current - scanner->start == start + length &&
+      memcmp(scanner->start + start, rest, length) == 0) {
     return type;
   }
   return TOKEN_IDENTIFIER;
 }
 
-static TokenType IdentifierType() {
-  switch (scanner.start[0]) {
+static TokenType IdentifierType(Scanner *scanner) {
+  switch (scanner->start[0]) {
   case 'a':
-    return CheckKeyword(1, 2, "nd", TOKEN_AND);
+    return CheckKeyword(scanner, 1, 2, "nd", TOKEN_AND);
   case 'c':
-    return CheckKeyword(1, 4, "lass", TOKEN_CLASS);
+    return CheckKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
   case 'e':
-    return CheckKeyword(1, 3, "lse", TOKEN_ELSE);
+    return CheckKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
   case 'f':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
       case 'a':
-        return CheckKeyword(2, 3, "lse", TOKEN_FALSE);
+        return CheckKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
       case 'o':
-        return CheckKeyword(2, 1, "r", TOKEN_FOR);
+        return CheckKeyword(scanner, 2, 1, "r", TOKEN_FOR);
       case 'u':
-        return CheckKeyword(2, 1, "n", TOKEN_FUN);
+        return CheckKeyword(scanner, 2, 1, "n", TOKEN_FUN);
       }
     }
     break;
   case 'i':
-    return CheckKeyword(1, 1, "f", TOKEN_IF);
+    return CheckKeyword(scanner, 1, 1, "f", TOKEN_IF);
   case 'n':
-    return CheckKeyword(1, 2, "il", TOKEN_NULL);
+    return CheckKeyword(scanner, 1, 2, "il", TOKEN_NULL);
   case 'o':
-    return CheckKeyword(1, 1, "r", TOKEN_OR);
+    return CheckKeyword(scanner, 1, 1, "r", TOKEN_OR);
   case 'p':
-    return CheckKeyword(1, 4, "rint", TOKEN_PRINT);
+    return CheckKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
   case 'r':
-    return CheckKeyword(1, 5, "eturn", TOKEN_RETURN);
+    return CheckKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
   case 's':
-    return CheckKeyword(1, 4, "uper", TOKEN_SUPER);
+    return CheckKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
   case 't':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
       case 'h':
-        return CheckKeyword(2, 2, "is", TOKEN_THIS);
+        return CheckKeyword(scanner, 2, 2, "is", TOKEN_THIS);
       case 'r':
-        return CheckKeyword(2, 2, "ue", TOKEN_TRUE);
+        return CheckKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
       }
     }
     break;
   case 'v':
-    return CheckKeyword(1, 2, "ar", TOKEN_VAR);
+    return CheckKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
   case 'w':
-    return CheckKeyword(1, 4, "hile", TOKEN_WHILE);
+    return CheckKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
   }
   return TOKEN_IDENTIFIER;
 }
 
-static Token Identifier() {
-  while (IsAlpha(Peek()) || IsDigit(Peek()))
-    Advance();
-  return MakeToken(IdentifierType());
+static Token Identifier(Scanner *scanner) {
+  while (IsAlpha(Peek(scanner)) || IsDigit(Peek(scanner)))
+    Advance(scanner);
+  return MakeToken(scanner, IdentifierType(scanner));
 }
 
-Token ScanToken() {
-  SkipWhitespace();
+Token ScanToken(Scanner *scanner) {
+  SkipWhitespace(scanner);
 
-  scanner.start = scanner.current;
+  scanner->start = scanner->current;
 
-  if (IsAtEnd())
-    return MakeToken(TOKEN_EOF);
-  char c = Advance();
+  if (IsAtEnd(scanner))
+    return MakeToken(scanner, TOKEN_EOF);
+  char c = Advance(scanner);
   if (IsAlpha(c))
-    return Identifier();
+    return Identifier(scanner);
   if (IsDigit(c))
-    return Number();
+    return Number(scanner);
 
   switch (c) {
   case '(':
-    return MakeToken(TOKEN_LEFT_PAREN);
+    return MakeToken(scanner, TOKEN_LEFT_PAREN);
   case ')':
-    return MakeToken(TOKEN_RIGHT_PAREN);
+    return MakeToken(scanner, TOKEN_RIGHT_PAREN);
   case '{':
-    return MakeToken(TOKEN_LEFT_BRACE);
+    return MakeToken(scanner, TOKEN_LEFT_BRACE);
   case '}':
-    return MakeToken(TOKEN_RIGHT_BRACE);
+    return MakeToken(scanner, TOKEN_RIGHT_BRACE);
   case ';':
-    return MakeToken(TOKEN_SEMICOLON);
+    return MakeToken(scanner, TOKEN_SEMICOLON);
   case ',':
-    return MakeToken(TOKEN_COMMA);
+    return MakeToken(scanner, TOKEN_COMMA);
   case '.':
-    return MakeToken(TOKEN_DOT);
+    return MakeToken(scanner, TOKEN_DOT);
   case '-':
-    return MakeToken(TOKEN_MINUS);
+    return MakeToken(scanner, TOKEN_MINUS);
   case '+':
-    return MakeToken(TOKEN_PLUS);
+    return MakeToken(scanner, TOKEN_PLUS);
   case '/':
-    return MakeToken(TOKEN_SLASH);
+    return MakeToken(scanner, TOKEN_SLASH);
   case '*':
-    return MakeToken(TOKEN_STAR);
+    return MakeToken(scanner, TOKEN_STAR);
 
   case '!':
-    return MakeToken(Match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    return MakeToken(scanner,
+                     Match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
   case '=':
-    return MakeToken(Match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    return MakeToken(scanner,
+                     Match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
   case '<':
-    return MakeToken(Match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+    return MakeToken(scanner,
+                     Match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
   case '>':
-    return MakeToken(Match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    return MakeToken(scanner,
+                     Match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
   case '"':
-    return String();
+    return String(scanner);
   }
-  return ErrorToken("Unexpected character.");
+  return ErrorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -0,0 +1,245 @@
+#include "trace.h"
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+// Traces keep comparison results in the flags, so they must go straight to
+// a branch, perhaps through a `!`.
+static bool ReachesBranch(Instruction *next) {
+  return next->opcode == OP_JUMP_IF_FALSE || next->opcode == OP_NOT;
+}
+
+// Executes one instruction on the VM state exactly as Run() would, provided
+// the trace compiler can handle it with the operands it has: every variable
+// and arithmetic operand must be a number. Returns false, with nothing
+// executed, for anything else; the interpreter then carries on from there.
+static bool RecordStep(VM *vm, Value *slots, Instruction **ip, bool *taken) {
+  Instruction *instruction = *ip;
+  Instruction *next = instruction + 1;
+  Value *globals = vm->global_values.values;
+  *taken = false;
+  switch (instruction->opcode) {
+  case OP_CONSTANT:
+    if (!IS_NUMBER(*instruction->as.constant)) {
+      return false;
+    }
+    Push(vm, *instruction->as.constant);
+    break;
+  case OP_TRUE:
+    Push(vm, BOOL_VAL(true));
+    break;
+  case OP_FALSE:
+    Push(vm, BOOL_VAL(false));
+    break;
+  case OP_POP:
+    Pop(vm);
+    break;
+  case OP_GET_GLOBAL_SLOT:
+    if (!IS_NUMBER(globals[instruction->as.index])) {
+      return false;
+    }
+    Push(vm, globals[instruction->as.index]);
+    break;
+  case OP_SET_GLOBAL_SLOT:
+    if (!IS_NUMBER(globals[instruction->as.index]) ||
+        !IS_NUMBER(vm->stack_top[-1])) {
+      return false;
+    }
+    globals[instruction->as.index] = vm->stack_top[-1];
+    break;
+  case OP_GET_LOCAL:
+    if (!IS_NUMBER(slots[instruction->as.index])) {
+      return false;
+    }
+    Push(vm, slots[instruction->as.index]);
+    break;
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+    if (!IS_NUMBER(vm->stack_top[-1])) {
+      return false;
+    }
+    slots[instruction->as.index] = vm->stack_top[-1];
+    if (instruction->opcode == OP_SET_LOCAL_POP) {
+      Pop(vm);
+    }
+    break;
+  case OP_GET_LOCAL_GET_LOCAL:
+    if (!IS_NUMBER(slots[instruction->as.index]) ||
+        !IS_NUMBER(slots[instruction->arg])) {
+      return false;
+    }
+    Push(vm, slots[instruction->as.index]);
+    Push(vm, slots[instruction->arg]);
+    break;
+  case OP_GET_LOCAL_CONSTANT:
+    if (!IS_NUMBER(slots[instruction->arg]) ||
+        !IS_NUMBER(*instruction->as.constant)) {
+      return false;
+    }
+    Push(vm, slots[instruction->arg]);
+    Push(vm, *instruction->as.constant);
+    break;
+  case OP_INCREMENT_LOCAL: {
+    Value *local = &slots[instruction->arg];
+    if (!IS_NUMBER(*local) || !IS_NUMBER(*instruction->as.constant)) {
+      return false;
+    }
+    *local = NUMBER_VAL(AS_NUMBER(*local) +
+                        AS_NUMBER(*instruction->as.constant));
+    break;
+  }
+  case OP_NEGATE:
+    if (!IS_NUMBER(vm->stack_top[-1])) {
+      return false;
+    }
+    vm->stack_top[-1] = NUMBER_VAL(-AS_NUMBER(vm->stack_top[-1]));
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_GREATER:
+  case OP_GREATER_NUM: {
+    if (!ARE_NUMBERS(vm->stack_top[-1], vm->stack_top[-2])) {
+      return false;
+    }
+    uint8_t opcode = instruction->opcode;
+    bool comparison = opcode == OP_LESS || opcode == OP_LESS_NUM ||
+                      opcode == OP_GREATER || opcode == OP_GREATER_NUM;
+    if (comparison && !ReachesBranch(next)) {
+      return false;
+    }
+    double b = AS_NUMBER(Pop(vm));
+    double a = AS_NUMBER(Pop(vm));
+    switch (opcode) {
+    case OP_ADD:
+    case OP_ADD_NUM:
+      Push(vm, NUMBER_VAL(a + b));
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      Push(vm, NUMBER_VAL(a - b));
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      Push(vm, NUMBER_VAL(a * b));
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      Push(vm, NUMBER_VAL(a / b));
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      Push(vm, BOOL_VAL(a < b));
+      break;
+    default:
+      Push(vm, BOOL_VAL(a > b));
+      break;
+    }
+    break;
+  }
+  case OP_EQUAL:
+    if (!ARE_NUMBERS(vm->stack_top[-1], vm->stack_top[-2]) ||
+        !ReachesBranch(next)) {
+      return false;
+    }
+    Push(vm, BOOL_VAL(AS_NUMBER(Pop(vm)) == AS_NUMBER(Pop(vm))));
+    break;
+  case OP_NOT:
+    if (!IS_BOOL(vm->stack_top[-1]) || !ReachesBranch(next)) {
+      return false;
+    }
+    vm->stack_top[-1] = BOOL_VAL(!AS_BOOL(vm->stack_top[-1]));
+    break;
+  case OP_JUMP_IF_FALSE: {
+    Value condition = vm->stack_top[-1];
+    *taken = IS_NULL(condition) || (IS_BOOL(condition) && !AS_BOOL(condition));
+    if (*taken) {
+      next = instruction->as.target;
+    }
+    break;
+  }
+  case OP_JUMP:
+  case OP_LOOP: // A for loop's body jumps back to its increment clause.
+    *taken = true;
+    next = instruction->as.target;
+    break;
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE: {
+    if (!ARE_NUMBERS(vm->stack_top[-1], vm->stack_top[-2])) {
+      return false;
+    }
+    double b = AS_NUMBER(Pop(vm));
+    double a = AS_NUMBER(Pop(vm));
+    bool holds = instruction->opcode == OP_LESS_JUMP_IF_FALSE ? a < b : a > b;
+    *taken = !holds;
+    if (*taken) {
+      next = instruction->as.target;
+    }
+    break;
+  }
+  default:
+    return false;
+  }
+  *ip = next;
+  return true;
+}
+
+Trace *RecordTrace(VM *vm, CallFrame *frame, Instruction *loop) {
+  TraceStep steps[TRACE_MAX];
+  int step_count = 0;
+  Instruction *ip = frame->ip;
+  int entry_height = (int)(vm->stack_top - frame->slots);
+  Trace *trace = NULL;
+  while (step_count < TRACE_MAX) {
+    steps[step_count].instruction = ip;
+    if (ip == loop) {
+      steps[step_count++].taken = true;
+      trace = ALLOCATE(Trace, 1);
+      trace->header = loop->as.target;
+      trace->entry_height = entry_height;
+      trace->code = NULL;
+      trace->code_size = 0;
+      if (!JitCompileTrace(trace, steps, step_count)) {
+        FREE(Trace, trace);
+        trace = NULL;
+        break;
+      }
+      ObjFunction *function = frame->closure->function;
+      trace->next = function->traces;
+      function->traces = trace;
+      break;
+    }
+    if (!RecordStep(vm, frame->slots, &ip, &steps[step_count].taken)) {
+      break;
+    }
+    step_count++;
+  }
+  frame->ip = ip;
+  return trace;
+}
+
+void FreeTraces(ObjFunction *function) {
+  Trace *trace = function->traces;
+  while (trace != NULL) {
+    Trace *next = trace->next;
+    munmap(trace->code, trace->code_size);
+    FREE(Trace, trace);
+    trace = next;
+  }
+}
+
+#endif
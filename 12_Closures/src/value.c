@@ -24,6 +24,17 @@ void FreeValueArray(ValueArray *array) {
 }
 
 void PrintValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NULL(value)) {
+    printf("nullptr");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    PrintObject(value);
+  }
+#else
   switch (value.type) {
   case VAL_NULL:
     printf("nullptr");
@@ -37,10 +48,20 @@ void PrintValue(Value value) {
   case VAL_OBJ:
     PrintObject(value);
     break;
+  default:
+    break;
   }
+#endif
 }
 
 bool ValueEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    // Compare as doubles so NaN stays unequal to itself.
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
   switch (a.type) {
@@ -55,4 +76,5 @@ bool ValueEqual(Value a, Value b) {
   default:
     return false;
   }
+#endif
 }
\ No newline at end of file
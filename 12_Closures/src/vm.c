@@ -2,120 +2,672 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "loop.h"
 #include "memory.h"
 #include "object.h"
+#include "profile.h"
+#include "sampler.h"
+#include "trace.h"
 #include "value.h"
 
-VM vm;
+// Makes `fiber` the running one, storing the stacks of the fiber it replaces.
+static void SwitchFiber(VM *vm, ObjFiber *fiber) {
+  BEGIN_FRAME_CHANGE(vm);
+  ObjFiber *current = vm->fiber;
+  current->frames = vm->frames;
+  current->frame_count = vm->frame_count;
+  current->frame_capacity = vm->frame_capacity;
+  current->stack = vm->stack;
+  current->stack_top = vm->stack_top;
+  current->stack_capacity = vm->stack_capacity;
+  current->open_upvalues = vm->open_upvalues;
+  vm->frames = fiber->frames;
+  vm->frame_count = fiber->frame_count;
+  vm->frame_capacity = fiber->frame_capacity;
+  vm->stack = fiber->stack;
+  vm->stack_top = fiber->stack_top;
+  vm->stack_capacity = fiber->stack_capacity;
+  vm->open_upvalues = fiber->open_upvalues;
+  vm->fiber = fiber;
+  fiber->state = FIBER_RUNNING;
+  END_FRAME_CHANGE(vm);
+}
 
-static void ResetStack() {
-  vm.stack_top = vm.stack;
-  vm.frame_count = 0;
-  vm.open_upvalues = NULL;
+static void FreeFiberStacks(ObjFiber *fiber) {
+  FREE_ARRAY(CallFrame, fiber->frames, fiber->frame_capacity);
+  FREE_ARRAY(Value, fiber->stack, fiber->stack_capacity);
+  fiber->frames = NULL;
+  fiber->frame_count = 0;
+  fiber->frame_capacity = 0;
+  fiber->stack = NULL;
+  fiber->stack_top = NULL;
+  fiber->stack_capacity = 0;
 }
 
-static void RuntimeError(const char *format, ...) {
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  fputs("\n", stderr);
-  for (int i = vm.frame_count - 1; i >= 0; i--) {
-    CallFrame *frame = &vm.frames[i];
+// Marks the running fiber done and goes back to its caller. Its stacks are
+// freed at once, as nothing can run on them again.
+static void EndFiber(VM *vm) {
+  ObjFiber *fiber = vm->fiber;
+  ObjFiber *caller = fiber->caller;
+  fiber->caller = NULL;
+  SwitchFiber(vm, caller);
+  fiber->state = FIBER_DONE;
+  FreeFiberStacks(fiber);
+}
+
+void FinishFiber(VM *vm, Value result) {
+  EndFiber(vm);
+  vm->stack_top[-1] = result; // The caller's resume() returns it.
+}
+
+// An error ends the fiber it happened in and every fiber waiting on it in
+// resume(), leaving the main fiber, or the fiber a RunCallback() started,
+// running with empty stacks.
+static void ResetStack(VM *vm) {
+  while (true) {
+    CloseUpvalues(vm, vm->stack);
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
+    if (vm->fiber->caller == NULL) {
+      break;
+    }
+    EndFiber(vm);
+  }
+}
+
+// Prints the innermost and outermost TRACE_FRAMES frames, eliding the middle
+// of a deep recursion.
+static void PrintStackTrace(CallFrame *frames, int frame_count) {
+  for (int i = frame_count - 1; i >= 0; i--) {
+    if (i == frame_count - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+      fprintf(stderr, "... %d more frames\n", i + 1 - TRACE_FRAMES);
+      i = TRACE_FRAMES - 1;
+    }
+    CallFrame *frame = &frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    Instruction *instruction = frame->ip - 1;
+    int line = GetLine(&function->chunk, instruction->offset);
+    if (line == 0) {
+      fprintf(stderr, "[line ?] in ");
+    } else {
+      fprintf(stderr, "[line %d] in ", line);
+    }
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
       fprintf(stderr, "%s()\n", function->name->chars);
     }
   }
-  ResetStack();
 }
 
-static Value ClockNative(int arg_count, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+// Prints the stack trace for an error, then resets the stacks.
+static void UnwindError(VM *vm) {
+  PrintStackTrace(vm->frames, vm->frame_count);
+  // Then the calls waiting in resume(), fiber by fiber.
+  for (ObjFiber *fiber = vm->fiber->caller; fiber != NULL;
+       fiber = fiber->caller) {
+    PrintStackTrace(fiber->frames, fiber->frame_count);
+  }
+  ResetStack(vm);
+}
+
+void RuntimeError(VM *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputs("\n", stderr);
+  UnwindError(vm);
+}
+
+static bool ClockNative(VM *vm, int arg_count, Value* args) {
+  args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool Call(VM *vm, ObjClosure* closure, int arg_count);
+
+// fiber(function) makes a fiber that will call the function, which takes at
+// most one parameter, when first resumed.
+static bool FiberNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 1 || !IS_CLOSURE(args[0]) ||
+      AS_CLOSURE(args[0])->function->arity > 1) {
+    RuntimeError(vm, "fiber() takes a function of at most one parameter.");
+    return false;
+  }
+  args[-1] = OBJ_VAL(NewFiber(vm, AS_CLOSURE(args[0])));
+  return true;
+}
+
+// resume(fiber[, value]) runs the fiber until it yields or its function
+// returns, and returns the value it yielded or returned. The first resume
+// passes `value` to the function, later ones return it from yield().
+static bool ResumeNative(VM *vm, int arg_count, Value *args) {
+  if ((arg_count != 1 && arg_count != 2) || !IS_FIBER(args[0])) {
+    RuntimeError(vm, "resume() takes a fiber and an optional value.");
+    return false;
+  }
+  ObjFiber *fiber = AS_FIBER(args[0]);
+  if (fiber->state == FIBER_DONE) {
+    RuntimeError(vm, "Cannot resume a finished fiber.");
+    return false;
+  }
+  if (fiber->state == FIBER_RUNNING) {
+    RuntimeError(vm, "Cannot resume a running fiber.");
+    return false;
+  }
+  Value value = arg_count == 2 ? args[1] : NULL_VAL;
+  vm->stack_top = args; // The callee's slot waits for the result.
+  fiber->caller = vm->fiber;
+  SwitchFiber(vm, fiber);
+  if (vm->frame_count > 0) {
+    vm->stack_top[-1] = value; // The fiber's yield() returns it.
+    return true;
+  }
+  ObjClosure *closure = AS_CLOSURE(vm->stack[0]);
+  if (closure->function->arity == 1) {
+    Push(vm, value);
+  }
+  return Call(vm, closure, closure->function->arity);
+}
+
+// yield([value]) suspends the running fiber, making its resume() return
+// `value`, until it is resumed again.
+static bool YieldNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count > 1) {
+    RuntimeError(vm, "yield() takes at most one value.");
+    return false;
+  }
+  ObjFiber *fiber = vm->fiber;
+  ObjFiber *caller = fiber->caller;
+  if (caller == NULL) {
+    RuntimeError(vm, "Can only yield from a fiber started by resume().");
+    return false;
+  }
+  Value value = arg_count == 1 ? args[0] : NULL_VAL;
+  vm->stack_top = args;
+  fiber->caller = NULL;
+  SwitchFiber(vm, caller);
+  fiber->state = FIBER_SUSPENDED;
+  vm->stack_top[-1] = value;
+  return true;
+}
+
+static bool IsDoneNative(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 1 || !IS_FIBER(args[0])) {
+    RuntimeError(vm, "isDone() takes a fiber.");
+    return false;
+  }
+  args[-1] = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+  return true;
+}
+
+void DefineNative(VM *vm, const char* name, NativeFn function) {
+  Push(vm, OBJ_VAL(CopyString(vm, name, (int)strlen(name))));
+  Push(vm, OBJ_VAL(NewNative(vm, function)));
+  int slot = GlobalSlot(vm, AS_STRING(vm->stack[0]));
+  vm->global_values.values[slot] = vm->stack[1];
+  Pop(vm);
+  Pop(vm);
+}
+
+void InitVM(VM *vm) {
+  vm->frames = NULL;
+  vm->frame_capacity = 0;
+  vm->frame_max = FRAME_MAX;
+  vm->frames_changing = 0;
+  vm->stack = ALLOCATE(Value, STACK_INITIAL);
+  vm->stack_capacity = STACK_INITIAL;
+  vm->open_upvalues = NULL;
+  vm->objects = NULL;
+  vm->fiber = NewFiber(vm, NULL);
+  vm->spare_fiber = NULL;
+#ifdef PROFILE_OPS
+  vm->profile = NULL;
+  vm->line_profile = NULL;
+#endif
+  ResetStack(vm);
+  InitTable(&vm->strings);
+  InitTable(&vm->global_slots);
+  InitValueArray(&vm->global_values);
+  InitValueArray(&vm->global_names);
+  vm->jit_enabled = false;
+  vm->jit_threshold = JIT_THRESHOLD;
+  vm->trace_threshold = TRACE_THRESHOLD;
+  vm->strip_lines = false;
+  vm->share_constants = false;
+  vm->optimize = false;
+  vm->register_code = false;
+  DefineNative(vm, "clock", ClockNative);
+  DefineNative(vm, "fiber", FiberNative);
+  DefineNative(vm, "resume", ResumeNative);
+  DefineNative(vm, "yield", YieldNative);
+  DefineNative(vm, "isDone", IsDoneNative);
+#ifdef EVENT_LOOP
+  vm->loop = NULL;
+  DefineLoopNatives(vm);
+#endif
+#ifdef COMPUTED_GOTO
+  Run(vm, 0);
+#endif
+}
+
+void FreeVM(VM *vm) {
+#ifdef EVENT_LOOP
+  FreeLoop(vm);
+#endif
+#ifdef PROFILE_OPS
+  if (vm->profile != NULL) {
+    ReportOpProfile(vm->profile);
+    FreeOpProfile(vm->profile);
+  }
+  if (vm->line_profile != NULL) {
+    FreeLineProfile(vm->line_profile);
+  }
+#endif
+  // Hand the stacks back to the main fiber, which frees them with the rest.
+  SwitchFiber(vm, vm->fiber);
+  FreeTable(&vm->strings);
+  FreeTable(&vm->global_slots);
+  FreeValueArray(&vm->global_values);
+  FreeValueArray(&vm->global_names);
+  FreeObjects(vm);
+}
+
+// Returns the dense index of the global variable `name`, reserving an
+// undefined slot the first time the name is seen. The compiler resolves every
+// global reference through this, so the VM never hashes names at runtime.
+int GlobalSlot(VM *vm, ObjString *name) {
+  Value index;
+  if (TableGet(&vm->global_slots, name, &index)) {
+    return (int)AS_NUMBER(index);
+  }
+  int slot = vm->global_values.count;
+  WriteValueArray(&vm->global_values, UNDEFINED_VAL);
+  WriteValueArray(&vm->global_names, OBJ_VAL(name));
+  TableSet(&vm->global_slots, name, NUMBER_VAL(slot));
+  return slot;
+}
+
+// The net number of values the instruction at `code` pushes.
+static int StackEffect(uint8_t *code) {
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_NULL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_GLOBAL_SLOT:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CONSTANT_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_GET_GLOBAL_SLOT_LONG:
+  case OP_GET_LOCAL_LONG:
+    return 1;
+  case OP_GET_LOCAL_GET_LOCAL:
+  case OP_GET_LOCAL_CONSTANT:
+    return 2;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL_SLOT:
+  case OP_DEFINE_GLOBAL_SLOT_LONG:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_SET_LOCAL_POP:
+    return -1;
+  case OP_LESS_JUMP_IF_FALSE:
+  case OP_GREATER_JUMP_IF_FALSE:
+    return -2;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[1];
+  default:
+    return 0;
+  }
 }
 
-static void DefineNative(const char* name, NativeFn function) {
-  Push(OBJ_VAL(CopyString(name, (int)strlen(name))));
-  Push(OBJ_VAL(NewNative(function)));
-  TableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  Pop();
-  Pop();
+// The most values the function's frame holds at once, counting the callee
+// and arguments in its first slots. Call() makes room for all of them, so
+// nothing within a frame checks for overflow. Each forward jump hands its
+// height on to its target, where the code after an unconditional jump or a
+// return picks it up.
+static int StackSize(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  int *heights = ALLOCATE(int, chunk->count + 1);
+  for (int offset = 0; offset <= chunk->count; offset++) {
+    heights[offset] = -1;
+  }
+  int height = function->arity + 1;
+  int size = height;
+  bool falls_through = true;
+  for (int offset = 0; offset < chunk->count;
+       offset += InstructionLength(chunk, offset)) {
+    uint8_t *code = &chunk->code[offset];
+    if (heights[offset] > height ||
+        (heights[offset] >= 0 && !falls_through)) {
+      height = heights[offset];
+    }
+    // A string increment pushes both operands to concatenate them.
+    if (code[0] == OP_INCREMENT_LOCAL && height + 2 > size) {
+      size = height + 2;
+    }
+    if (IsRegisterForm(code[0])) {
+      // A register form names the height it leaves, and a string addition
+      // pushes both operands above it as well. A result nothing reads again
+      // may land above that height.
+      height = code[IsJump(code[0]) ? 4 : InstructionLength(chunk, offset) - 1];
+      int reach = height + 2;
+      if (!IsJump(code[0]) && code[1] + 1 > reach) {
+        reach = code[1] + 1;
+      }
+      if (reach > size) {
+        size = reach;
+      }
+    } else {
+      height += StackEffect(code);
+    }
+    if (height > size) {
+      size = height;
+    }
+    if (IsJump(code[0]) && code[0] != OP_LOOP && code[0] != OP_LOOP_LONG) {
+      int target = JumpTarget(chunk, offset);
+      if (heights[target] < height) {
+        heights[target] = height;
+      }
+    }
+    falls_through = code[0] != OP_JUMP && code[0] != OP_LOOP &&
+                    code[0] != OP_JUMP_LONG && code[0] != OP_LOOP_LONG &&
+                    code[0] != OP_RETURN;
+  }
+  FREE_ARRAY(int, heights, chunk->count + 1);
+  return size;
 }
 
-void InitVM() {
-  ResetStack();
-  vm.objects = NULL;
-  InitTable(&vm.strings);
-  InitTable(&vm.globals);
-  DefineNative("clock", ClockNative);
+// Translates the function's bytecode, and that of every function nested in
+// its constants, into the Instruction array Run() executes.
+static void DecodeFunction(VM *vm, ObjFunction *function) {
+  if (function->instructions != NULL) {
+    return;
+  }
+  Chunk *chunk = &function->chunk;
+  int *index_of = ALLOCATE(int, chunk->count + 1);
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += InstructionLength(chunk, offset)) {
+    index_of[offset] = count++;
+  }
+  index_of[chunk->count] = count;
+
+  Instruction *instructions = ALLOCATE(Instruction, count);
+  for (int offset = 0; offset < chunk->count;
+       offset += InstructionLength(chunk, offset)) {
+    Instruction *instruction = &instructions[index_of[offset]];
+    uint8_t *code = &chunk->code[offset];
+    instruction->opcode = code[0];
+    instruction->offset = offset;
+    instruction->arg = 0;
+    switch (code[0]) {
+    case OP_CONSTANT:
+      instruction->as.constant = &chunk->constants.values[code[1]];
+      break;
+    case OP_CONSTANT_LONG:
+      instruction->opcode = OP_CONSTANT;
+      instruction->as.constant =
+          &chunk->constants.values[ReadWideOperand(&code[1])];
+      break;
+    case OP_CLOSURE:
+      instruction->as.constant = &chunk->constants.values[code[1]];
+      instruction->arg = 2;
+      DecodeFunction(vm, AS_FUNCTION(*instruction->as.constant));
+      break;
+    case OP_CLOSURE_LONG:
+      instruction->opcode = OP_CLOSURE;
+      instruction->as.constant =
+          &chunk->constants.values[ReadWideOperand(&code[1])];
+      instruction->arg = 4;
+      DecodeFunction(vm, AS_FUNCTION(*instruction->as.constant));
+      break;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_SET_LOCAL_POP:
+      instruction->as.index = code[1];
+      break;
+    case OP_GET_LOCAL_LONG:
+      instruction->opcode = OP_GET_LOCAL;
+      instruction->as.index = ReadWideOperand(&code[1]);
+      break;
+    case OP_SET_LOCAL_LONG:
+      instruction->opcode = OP_SET_LOCAL;
+      instruction->as.index = ReadWideOperand(&code[1]);
+      break;
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+      instruction->as.index = (code[1] << 8) | code[2];
+      break;
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+      instruction->opcode = OP_DEFINE_GLOBAL_SLOT;
+      instruction->as.index = ReadWideOperand(&code[1]);
+      break;
+    case OP_GET_GLOBAL_SLOT_LONG:
+      instruction->opcode = OP_GET_GLOBAL_SLOT;
+      instruction->as.index = ReadWideOperand(&code[1]);
+      break;
+    case OP_SET_GLOBAL_SLOT_LONG:
+      instruction->opcode = OP_SET_GLOBAL_SLOT;
+      instruction->as.index = ReadWideOperand(&code[1]);
+      break;
+    case OP_GET_LOCAL_GET_LOCAL:
+      instruction->as.index = code[1];
+      instruction->arg = code[2];
+      break;
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_INCREMENT_LOCAL:
+      instruction->as.constant = &chunk->constants.values[code[2]];
+      instruction->arg = code[1];
+      break;
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+      instruction->opcode = code[0] == OP_JUMP_LONG ? OP_JUMP
+                            : code[0] == OP_LOOP_LONG ? OP_LOOP
+                                                      : OP_JUMP_IF_FALSE;
+      instruction->as.target =
+          &instructions[index_of[JumpTarget(chunk, offset)]];
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+      instruction->as.target =
+          &instructions[index_of[JumpTarget(chunk, offset)]];
+      break;
+    case OP_MOVE:
+    case OP_NEGATE_R:
+    case OP_NOT_R:
+      instruction->as.regs.jump = 0;
+      instruction->as.regs.a = code[1];
+      instruction->as.regs.b = code[2];
+      instruction->as.regs.c = 0;
+      instruction->as.regs.top = code[3];
+      break;
+    case OP_EQUAL_R:
+    case OP_GREATER_R:
+    case OP_LESS_R:
+    case OP_ADD_R:
+    case OP_SUBTRACT_R:
+    case OP_MULTIPLY_R:
+    case OP_DIVIDE_R:
+      instruction->as.regs.jump = 0;
+      instruction->as.regs.a = code[1];
+      instruction->as.regs.b = code[2];
+      instruction->as.regs.c = code[3];
+      instruction->as.regs.top = code[4];
+      break;
+    case OP_EQUAL_JUMP_R:
+    case OP_GREATER_JUMP_R:
+    case OP_LESS_JUMP_R:
+      instruction->as.regs.jump =
+          index_of[JumpTarget(chunk, offset)] - (index_of[offset] + 1);
+      instruction->as.regs.a = code[1];
+      instruction->as.regs.b = code[2];
+      instruction->as.regs.c = code[3];
+      instruction->as.regs.top = code[4];
+      break;
+    default:
+      instruction->as.index = 0;
+      break;
+    }
+#ifdef COMPUTED_GOTO
+    instruction->handler = vm->handlers[instruction->opcode];
+#endif
+  }
+  FREE_ARRAY(int, index_of, chunk->count + 1);
+  function->instructions = instructions;
+  function->instruction_count = count;
+  function->stack_size = StackSize(function);
 }
 
-void FreeVM() {
-  FreeTable(&vm.strings);
-  FreeTable(&vm.globals);
-  FreeObjects();
+void Push(VM *vm, Value value) {
+  *vm->stack_top = value;
+  vm->stack_top++;
 }
 
-void Push(Value value) {
-  *vm.stack_top = value;
-  vm.stack_top++;
+Value Pop(VM *vm) {
+  vm->stack_top--;
+  return *vm->stack_top;
 }
 
-Value Pop() {
-  vm.stack_top--;
-  return *vm.stack_top;
+// Makes room for `count` more values above the stack top. Growing may move
+// the stack, and with it everything that points into it: each frame's slots,
+// the open upvalues and vm->stack_top.
+static void GrowStack(VM *vm, int count) {
+  int needed = (int)(vm->stack_top - vm->stack) + count;
+  int capacity = vm->stack_capacity;
+  while (capacity < needed) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+  Value *old_stack = vm->stack;
+  vm->stack = GROW_ARRAY(Value, vm->stack, vm->stack_capacity, capacity);
+  vm->stack_capacity = capacity;
+  for (int i = 0; i < vm->frame_count; i++) {
+    vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old_stack);
+  }
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = vm->stack + (upvalue->location - old_stack);
+  }
+  vm->stack_top = vm->stack + (vm->stack_top - old_stack);
 }
 
-static Value Peek(int distance) { return vm.stack_top[-1 - distance]; }
+static bool GrowFrames(VM *vm) {
+  if (vm->frame_count >= vm->frame_max) {
+    RuntimeError(vm, "Stack overflow.");
+    return false;
+  }
+  int capacity = GROW_CAPACITY(vm->frame_capacity);
+  if (capacity > vm->frame_max) {
+    capacity = vm->frame_max;
+  }
+  BEGIN_FRAME_CHANGE(vm);
+  vm->frames = GROW_ARRAY(CallFrame, vm->frames, vm->frame_capacity, capacity);
+  vm->frame_capacity = capacity;
+  END_FRAME_CHANGE(vm);
+  return true;
+}
 
-static bool Call(ObjClosure* closure, int arg_count) {
+static bool Call(VM *vm, ObjClosure* closure, int arg_count) {
   if (arg_count != closure->function->arity) {
-    RuntimeError("Expected %d arguments but got %d.", closure->function->arity,
-                 arg_count);
+    RuntimeError(vm, "Expected %d arguments but got %d.",
+                 closure->function->arity, arg_count);
     return false;
   }
-  if (vm.frame_count == FRAME_MAX) {
-    RuntimeError("Stack overflow.");
+  if (vm->frame_count == vm->frame_capacity && !GrowFrames(vm)) {
     return false;
   }
-  CallFrame *frame = &vm.frames[vm.frame_count++];
+  // The new frame starts at the callee, below the stack top.
+  int room = closure->function->stack_size - arg_count - 1;
+  if (vm->stack_top + room > vm->stack + vm->stack_capacity) {
+    GrowStack(vm, room);
+  }
+#ifdef JIT
+  ObjFunction *function = closure->function;
+  if (vm->jit_enabled && function->jit_code == NULL &&
+      ++function->call_count >= vm->jit_threshold && !JitCompile(function)) {
+    vm->jit_enabled = false;
+  }
+#endif
+  CallFrame *frame = &vm->frames[vm->frame_count];
   frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stack_top - arg_count - 1;
+  frame->ip = closure->function->instructions;
+  frame->slots = vm->stack_top - arg_count - 1;
+  // The sampling profiler may look at the frame as soon as it is counted.
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  vm->frame_count++;
   return true;
 }
 
-static bool CallValue(Value callee, int arg_count) {
+bool CallValue(VM *vm, Value callee, int arg_count) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
     case OBJ_CLOSURE:
-      return Call(AS_CLOSURE(callee), arg_count);
+      return Call(vm, AS_CLOSURE(callee), arg_count);
     case OBJ_NATIVE: {
-      NativeFn native = AS_NATIVE(callee);
-      Value result = native(arg_count, vm.stack_top - arg_count);
-      vm.stack_top -= arg_count + 1;
-      Push(result);
+      ObjFiber *fiber = vm->fiber;
+      Value *args = vm->stack_top - arg_count;
+      if (!AS_NATIVE(callee)(vm, arg_count, args)) {
+        return false;
+      }
+      // A native that switched fibers has left both stacks as they should be.
+      if (vm->fiber == fiber) {
+        vm->stack_top = args;
+      }
       return true;
     }
     default:
       break; // Non-callable object type.
     }
   }
-  RuntimeError("Can only call functions and classes.");
+  RuntimeError(vm, "Can only call functions and classes.");
   return false;
 }
 
+bool TailCall(VM *vm, int arg_count) {
+  Value callee = vm->stack_top[-1 - arg_count];
+  if (!IS_CLOSURE(callee) ||
+      AS_CLOSURE(callee)->function->arity != arg_count) {
+    return false;
+  }
+  CallFrame *frame = &vm->frames[vm->frame_count - 1];
+  CloseUpvalues(vm, frame->slots);
+  memmove(frame->slots, vm->stack_top - arg_count - 1,
+          sizeof(Value) * (arg_count + 1));
+  vm->stack_top = frame->slots + arg_count + 1;
+  vm->frame_count--;
+  return Call(vm, AS_CLOSURE(callee), arg_count);
+}
+
 static bool Not(Value value) {
   return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void Concatenate() {
-  ObjString *str2 = AS_STRING(Pop());
-  ObjString *str1 = AS_STRING(Pop());
+void Concatenate(VM *vm) {
+  ObjString *str2 = AS_STRING(Pop(vm));
+  ObjString *str1 = AS_STRING(Pop(vm));
 
   int length = str1->length + str2->length;
   char *chars = ALLOCATE(char, length + 1);
@@ -123,13 +675,13 @@ static void Concatenate() {
   memcpy(chars + str1->length, str2->chars, str2->length);
   chars[length] = '\0';
 
-  ObjString *result = GetString(chars, length);
-  Push(OBJ_VAL(result));
+  ObjString *result = GetString(vm, chars, length);
+  Push(vm, OBJ_VAL(result));
 }
 
-static ObjUpvalue* CaptureUpvalue(Value* local) {
+ObjUpvalue *CaptureUpvalue(VM *vm, Value *local) {
   ObjUpvalue *prev_upvalue = NULL;
-  ObjUpvalue *upvalue = vm.open_upvalues;
+  ObjUpvalue *upvalue = vm->open_upvalues;
   while (upvalue != NULL && upvalue->location > local) {
     prev_upvalue = upvalue;
     upvalue = upvalue->next;
@@ -137,253 +689,854 @@ static ObjUpvalue* CaptureUpvalue(Value* local) {
   if (upvalue != NULL && upvalue->location == local) {
     return upvalue;
   }
-  ObjUpvalue* created_upvalue = NewUpvalue(local);
+  ObjUpvalue* created_upvalue = NewUpvalue(vm, local);
   created_upvalue->next = upvalue;
   if (prev_upvalue == NULL) {
-    vm.open_upvalues = created_upvalue;
+    vm->open_upvalues = created_upvalue;
   } else {
     prev_upvalue->next = created_upvalue;
   }
   return created_upvalue;
 }
 
-static void CloseUpvalues(Value* last) {
-  while (vm.open_upvalues != NULL &&
-         vm.open_upvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.open_upvalues;
+void CloseUpvalues(VM *vm, Value *last) {
+  while (vm->open_upvalues != NULL &&
+         vm->open_upvalues->location >= last) {
+    ObjUpvalue* upvalue = vm->open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.open_upvalues = upvalue->next;
+    vm->open_upvalues = upvalue->next;
   }
 }
 
-static InterpretResult Run() {
-  CallFrame *frame = &vm.frames[vm.frame_count - 1];
+// Runs the frame a call has just pushed to completion if its function has
+// been compiled; otherwise Run() carries on into it.
+static InterpretResult FinishCall(VM *vm, ObjFiber *caller_fiber,
+                                  int caller_depth) {
+  if (vm->fiber != caller_fiber) {
+    return INTERPRET_SWITCHED;
+  }
+#ifdef JIT
+  CallFrame *callee = &vm->frames[vm->frame_count - 1];
+  if (vm->frame_count > caller_depth &&
+      callee->closure->function->jit_code != NULL) {
+    return JitRun(vm, callee);
+  }
+#else
+  (void)caller_depth;
+#endif
+  return INTERPRET_OK;
+}
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(type, op)                                                    \
+// Runs the topmost frame until the frame count drops back to exit_depth,
+// which is 0 for a whole script. The JIT passes its own depth to run a callee
+// that has not been compiled; such nested runs return INTERPRET_SWITCHED as
+// soon as the running fiber changes, while the outermost one follows it.
+InterpretResult Run(VM *vm, int exit_depth) {
+  CallFrame *frame;
+  Instruction *ip;
+  Value *slots;
+  Value *constants; // For register forms.
+  Value *stack_top;
+#ifdef CACHE_TOS
+  Value tos;
+  Value pop_value;
+#endif
+#ifdef PROFILE_OPS
+  OpProfile *profile = vm->profile;
+  LineProfile *line_profile = vm->line_profile;
+#endif
+
+// The interpreter state lives in locals so the compiler can keep it in
+// registers. It is written back to the current CallFrame and to vm->stack_top
+// only before anything that reads it from there: calls, returns, allocations
+// and runtime errors. ip always points at the instruction after the one
+// being executed.
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm->frames[vm->frame_count - 1];                                  \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+  } while (false)
+#define STORE_FRAME() (frame->ip = ip)
+
+#ifdef CACHE_TOS
+// The top of the stack is held in `tos`; its home slot stack_top[-1] is stale
+// until the stack is saved. Every push spills the old top first, so only that
+// one slot is ever out of date.
+#define SPILL_TOS() (stack_top[-1] = tos)
+#define FILL_TOS() (tos = stack_top[-1])
+#define SAVE_STACK() (stack_top[-1] = tos, vm->stack_top = stack_top)
+#define LOAD_STACK() (stack_top = vm->stack_top, tos = stack_top[-1])
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    stack_top[-1] = tos;                                                       \
+    tos = (value);                                                             \
+    stack_top++;                                                               \
+  } while (false)
+#define POP() (pop_value = tos, stack_top--, tos = stack_top[-1], pop_value)
+#define DROP() (stack_top--, tos = stack_top[-1])
+#define PEEK(distance) ((distance) == 0 ? tos : stack_top[-1 - (distance)])
+#define SET_TOP(value) (tos = (value))
+#else
+#define SPILL_TOS() ((void)0)
+#define FILL_TOS() ((void)0)
+#define SAVE_STACK() (vm->stack_top = stack_top)
+#define LOAD_STACK() (stack_top = vm->stack_top)
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define DROP() (stack_top--)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+#define SET_TOP(value) (stack_top[-1] = (value))
+#endif
+
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    SAVE_STACK();                                                              \
+    RuntimeError(vm, __VA_ARGS__);                                             \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+// Whether Run() must return `result` from a call or a compiled callee, rather
+// than carry on with whatever frame is now on top.
+#define STOPS_RUN(result)                                                      \
+  ((result) != INTERPRET_OK &&                                                 \
+   ((result) != INTERPRET_SWITCHED || exit_depth != 0))
+
+#define CALL_VALUE(arg_count)                                                  \
   do {                                                                         \
-    if (!IS_NUMBER(Peek(0)) || !IS_NUMBER(Peek(1))) {                          \
-      RuntimeError("Operands must be numbers.");                               \
+    STORE_FRAME();                                                             \
+    SAVE_STACK();                                                              \
+    ObjFiber *caller_fiber = vm->fiber;                                        \
+    int caller_depth = vm->frame_count;                                        \
+    if (!CallValue(vm, PEEK(arg_count), arg_count)) {                          \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(Pop());                                               \
-    double a = AS_NUMBER(Pop());                                               \
-    Push(type(a op b));                                                        \
+    InterpretResult call_result =                                              \
+        FinishCall(vm, caller_fiber, caller_depth);                            \
+    if (STOPS_RUN(call_result)) {                                              \
+      return call_result;                                                      \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
   } while (false)
 
-  while (true) {
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      Push(constant);
-      break;
+#define OPERAND() (ip[-1].as)
+#define GLOBAL(slot) (vm->global_values.values[slot])
+#define READ_CONSTANT() (*OPERAND().constant)
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define BINARY_OP(type, op, quickened)                                         \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    QUICKEN(quickened);                                                        \
+    double b = AS_NUMBER(PEEK(0));                                             \
+    double a = AS_NUMBER(PEEK(1));                                             \
+    DROP();                                                                    \
+    SET_TOP(type(a op b));                                                     \
+  } while (false)
+// The body of a quickened number op. If the single guard fails, the
+// instruction goes back to its generic form and runs again from there.
+#define NUMBER_OP(type, op, generic)                                           \
+  do {                                                                         \
+    if (!ARE_NUMBERS(PEEK(0), PEEK(1))) {                                      \
+      QUICKEN(generic);                                                        \
+      ip--;                                                                    \
+      DISPATCH();                                                              \
+    }                                                                          \
+    double b = AS_NUMBER(PEEK(0));                                             \
+    double a = AS_NUMBER(PEEK(1));                                             \
+    DROP();                                                                    \
+    SET_TOP(type(a op b));                                                     \
+  } while (false)
+// Register forms read their sources where they are and then move the stack
+// top to where their operands say. With CACHE_TOS the cached top goes home
+// first, as a source may be its slot.
+#define REGISTERS() (ip[-1].as.regs)
+#define RK(operand)                                                            \
+  (((operand) & RK_CONSTANT ? constants : slots)[(operand) & ~RK_CONSTANT])
+#define SET_STACK_TOP(top) (stack_top = slots + (top), FILL_TOS())
+#ifdef CACHE_TOS
+// Writes the result to register `a` and moves the stack top. The result is
+// usually the new top, and reloading that from the slot just written stalls.
+#define STORE_REGISTER(value)                                                  \
+  do {                                                                         \
+    Value stored = (value);                                                    \
+    slots[REGISTERS().a] = stored;                                             \
+    stack_top = slots + REGISTERS().top;                                       \
+    tos = REGISTERS().a + 1 == REGISTERS().top ? stored : stack_top[-1];       \
+  } while (false)
+#else
+#define STORE_REGISTER(value)                                                  \
+  (slots[REGISTERS().a] = (value), stack_top = slots + REGISTERS().top)
+#endif
+// Sources are read through pointers, so only the fields an instruction tests
+// get loaded: loading a whole Value from a slot that the previous instruction
+// has just written field by field stalls.
+#define RK_EQUAL(b, c)                                                         \
+  (ARE_NUMBERS(*(b), *(c)) ? AS_NUMBER(*(b)) == AS_NUMBER(*(c))                \
+                           : ValueEqual(*(b), *(c)))
+#define REGISTER_OP(type, op)                                                  \
+  do {                                                                         \
+    SPILL_TOS();                                                               \
+    Value *b = &RK(REGISTERS().b);                                             \
+    Value *c = &RK(REGISTERS().c);                                             \
+    if (!ARE_NUMBERS(*b, *c)) {                                                \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    STORE_REGISTER(type(AS_NUMBER(*b) op AS_NUMBER(*c)));                      \
+  } while (false)
+#define COMPARE_JUMP(op)                                                       \
+  do {                                                                         \
+    SPILL_TOS();                                                               \
+    Value *b = &RK(REGISTERS().b);                                             \
+    Value *c = &RK(REGISTERS().c);                                             \
+    if (!ARE_NUMBERS(*b, *c)) {                                                \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    SET_STACK_TOP(REGISTERS().top);                                            \
+    if ((AS_NUMBER(*b) op AS_NUMBER(*c)) == REGISTERS().a) {                   \
+      ip += REGISTERS().jump;                                                  \
+    }                                                                          \
+  } while (false)
+
+#ifdef PROFILE_OPS
+#define PROFILE_LINE()                                                         \
+  ProfileLine(line_profile,                                                    \
+              GetLine(&frame->closure->function->chunk, ip->offset))
+#define NEXT()                                                                 \
+  ((profile != NULL ? ProfileOp(profile, ip->opcode) : (void)0),              \
+   (line_profile != NULL ? PROFILE_LINE() : (void)0), ip++)
+#else
+#define NEXT() (ip++)
+#endif
+
+#ifdef COMPUTED_GOTO
+  static void *dispatch_table[] = {
+      [OP_CONSTANT] = &&do_OP_CONSTANT,
+      [OP_NULL] = &&do_OP_NULL,
+      [OP_TRUE] = &&do_OP_TRUE,
+      [OP_FALSE] = &&do_OP_FALSE,
+      [OP_POP] = &&do_OP_POP,
+      [OP_DEFINE_GLOBAL_SLOT] = &&do_OP_DEFINE_GLOBAL_SLOT,
+      [OP_GET_GLOBAL_SLOT] = &&do_OP_GET_GLOBAL_SLOT,
+      [OP_SET_GLOBAL_SLOT] = &&do_OP_SET_GLOBAL_SLOT,
+      [OP_GET_LOCAL] = &&do_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&do_OP_SET_LOCAL,
+      [OP_GET_UPVALUE] = &&do_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&do_OP_SET_UPVALUE,
+      [OP_EQUAL] = &&do_OP_EQUAL,
+      [OP_GREATER] = &&do_OP_GREATER,
+      [OP_LESS] = &&do_OP_LESS,
+      [OP_ADD] = &&do_OP_ADD,
+      [OP_SUBTRACT] = &&do_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&do_OP_MULTIPLY,
+      [OP_DIVIDE] = &&do_OP_DIVIDE,
+      [OP_NOT] = &&do_OP_NOT,
+      [OP_NEGATE] = &&do_OP_NEGATE,
+      [OP_PRINT] = &&do_OP_PRINT,
+      [OP_JUMP_IF_FALSE] = &&do_OP_JUMP_IF_FALSE,
+      [OP_JUMP] = &&do_OP_JUMP,
+      [OP_LOOP] = &&do_OP_LOOP,
+      [OP_CALL] = &&do_OP_CALL,
+      [OP_TAIL_CALL] = &&do_OP_TAIL_CALL,
+      [OP_CLOSURE] = &&do_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&do_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&do_OP_RETURN,
+      [OP_GET_LOCAL_GET_LOCAL] = &&do_OP_GET_LOCAL_GET_LOCAL,
+      [OP_GET_LOCAL_CONSTANT] = &&do_OP_GET_LOCAL_CONSTANT,
+      [OP_SET_LOCAL_POP] = &&do_OP_SET_LOCAL_POP,
+      [OP_INCREMENT_LOCAL] = &&do_OP_INCREMENT_LOCAL,
+      [OP_LESS_JUMP_IF_FALSE] = &&do_OP_LESS_JUMP_IF_FALSE,
+      [OP_GREATER_JUMP_IF_FALSE] = &&do_OP_GREATER_JUMP_IF_FALSE,
+      [OP_MOVE] = &&do_OP_MOVE,
+      [OP_NEGATE_R] = &&do_OP_NEGATE_R,
+      [OP_NOT_R] = &&do_OP_NOT_R,
+      [OP_EQUAL_R] = &&do_OP_EQUAL_R,
+      [OP_GREATER_R] = &&do_OP_GREATER_R,
+      [OP_LESS_R] = &&do_OP_LESS_R,
+      [OP_ADD_R] = &&do_OP_ADD_R,
+      [OP_SUBTRACT_R] = &&do_OP_SUBTRACT_R,
+      [OP_MULTIPLY_R] = &&do_OP_MULTIPLY_R,
+      [OP_DIVIDE_R] = &&do_OP_DIVIDE_R,
+      [OP_EQUAL_JUMP_R] = &&do_OP_EQUAL_JUMP_R,
+      [OP_GREATER_JUMP_R] = &&do_OP_GREATER_JUMP_R,
+      [OP_LESS_JUMP_R] = &&do_OP_LESS_JUMP_R,
+      [OP_ADD_NUM] = &&do_OP_ADD_NUM,
+      [OP_ADD_STR] = &&do_OP_ADD_STR,
+      [OP_SUBTRACT_NUM] = &&do_OP_SUBTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&do_OP_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&do_OP_DIVIDE_NUM,
+      [OP_LESS_NUM] = &&do_OP_LESS_NUM,
+      [OP_GREATER_NUM] = &&do_OP_GREATER_NUM,
+      [OP_LOOP_TRACE] = &&do_OP_LOOP_TRACE,
+  };
+  // InitVM() enters once with no frames to publish the handler addresses
+  // that DecodeFunction() stores in each instruction.
+  if (vm->frame_count == 0) {
+    vm->handlers = dispatch_table;
+    return INTERPRET_OK;
+  }
+#define DISPATCH() goto *NEXT()->handler
+#define REWRITE(instruction, op)                                               \
+  ((instruction)->opcode = (op), (instruction)->handler = dispatch_table[op])
+#define CASE(name) do_##name:
+#define INTERPRET_LOOP DISPATCH();
+#else
+#define DISPATCH() break
+#define REWRITE(instruction, op) ((instruction)->opcode = (op))
+#define CASE(name) case name:
+#define INTERPRET_LOOP                                                         \
+  while (true)                                                                 \
+    switch (NEXT()->opcode)
+#endif
+#define QUICKEN(op) REWRITE(&ip[-1], op)
+
+  LOAD_FRAME();
+  LOAD_STACK();
+
+  INTERPRET_LOOP {
+    CASE(OP_CONSTANT) {
+      PUSH(READ_CONSTANT());
+      DISPATCH();
     }
-    case OP_NULL: {
-      Push(NULL_VAL);
-      break;
+    CASE(OP_NULL) {
+      PUSH(NULL_VAL);
+      DISPATCH();
     }
-    case OP_TRUE: {
-      Push(BOOL_VAL(true));
-      break;
+    CASE(OP_TRUE) {
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
     }
-    case OP_FALSE: {
-      Push(BOOL_VAL(false));
-      break;
+    CASE(OP_FALSE) {
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
     }
-    case OP_POP: {
-      Pop();
-      break;
+    CASE(OP_POP) {
+      DROP();
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      TableSet(&vm.globals, name, Peek(0));
-      Pop();
-      break;
+    CASE(OP_DEFINE_GLOBAL_SLOT) {
+      GLOBAL(OPERAND().index) = PEEK(0);
+      DROP();
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!TableGet(&vm.globals, name, &value)) {
-        RuntimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_GET_GLOBAL_SLOT) {
+      int slot = OPERAND().index;
+      if (IS_UNDEFINED(GLOBAL(slot))) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm->global_names.values[slot]));
       }
-      Push(value);
-      break;
+      PUSH(GLOBAL(slot));
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (TableSet(&vm.globals, name, Peek(0))) {
-        TableDelete(&vm.globals, name);
-        RuntimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_GLOBAL_SLOT) {
+      int slot = OPERAND().index;
+      if (IS_UNDEFINED(GLOBAL(slot))) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm->global_names.values[slot]));
       }
-      break;
+      GLOBAL(slot) = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      Push(frame->slots[slot]);
-      break;
+    CASE(OP_GET_LOCAL) {
+      int slot = OPERAND().index;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      frame->slots[slot] = Peek(0);
-      break;
+    CASE(OP_SET_LOCAL) {
+      int slot = OPERAND().index;
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      Push(*frame->closure->upvalues[slot]->location);
-      break;
+    CASE(OP_GET_UPVALUE) {
+      int slot = OPERAND().index;
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = Peek(0);
-      break;
+    CASE(OP_SET_UPVALUE) {
+      int slot = OPERAND().index;
+      *frame->closure->upvalues[slot]->location = PEEK(0);
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = Pop();
-      Value a = Pop();
-      Push(BOOL_VAL(ValueEqual(a, b)));
-      break;
+    CASE(OP_EQUAL) {
+      Value b = PEEK(0);
+      Value a = PEEK(1);
+      DROP();
+      SET_TOP(BOOL_VAL(ValueEqual(a, b)));
+      DISPATCH();
     }
-    case OP_GREATER: {
-      BINARY_OP(BOOL_VAL, >);
-      break;
+    CASE(OP_GREATER) {
+      BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+      DISPATCH();
     }
-    case OP_LESS: {
-      BINARY_OP(BOOL_VAL, <);
-      break;
+    CASE(OP_LESS) {
+      BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+      DISPATCH();
     }
-    case OP_ADD: {
-      if (IS_STRING(Peek(0)) && IS_STRING(Peek(1))) {
-        Concatenate();
-      } else if (IS_NUMBER(Peek(0)) && IS_NUMBER(Peek(1))) {
-        double b = AS_NUMBER(Pop());
-        double a = AS_NUMBER(Pop());
-        Push(NUMBER_VAL(a + b));
+    CASE(OP_ADD) {
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        QUICKEN(OP_ADD_STR);
+        SAVE_STACK();
+        Concatenate(vm);
+        LOAD_STACK();
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        QUICKEN(OP_ADD_NUM);
+        double b = AS_NUMBER(PEEK(0));
+        double a = AS_NUMBER(PEEK(1));
+        DROP();
+        SET_TOP(NUMBER_VAL(a + b));
       } else {
-        RuntimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      break;
+      DISPATCH();
     }
-    case OP_SUBTRACT: {
-      BINARY_OP(NUMBER_VAL, -);
-      break;
+    CASE(OP_SUBTRACT) {
+      BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+      DISPATCH();
     }
-    case OP_MULTIPLY: {
-      BINARY_OP(NUMBER_VAL, *);
-      break;
+    CASE(OP_MULTIPLY) {
+      BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+      DISPATCH();
     }
-    case OP_DIVIDE: {
-      BINARY_OP(NUMBER_VAL, /);
-      break;
+    CASE(OP_DIVIDE) {
+      BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+      DISPATCH();
     }
-    case OP_NOT: {
-      if (!IS_BOOL(Peek(0))) {
-        RuntimeError("Operand must be a boolean.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_NOT) {
+      if (!IS_BOOL(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a boolean.");
       }
-      Push(BOOL_VAL(Not(Pop())));
-      break;
+      SET_TOP(BOOL_VAL(Not(PEEK(0))));
+      DISPATCH();
     }
-    case OP_NEGATE: {
-      if (!IS_NUMBER(Peek(0))) {
-        RuntimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_NEGATE) {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      Push(NUMBER_VAL(-AS_NUMBER(Pop())));
-      break;
+      SET_TOP(NUMBER_VAL(-AS_NUMBER(PEEK(0))));
+      DISPATCH();
     }
-    case OP_PRINT: {
-      Value result = Pop();
-      PrintValue(result);
+    CASE(OP_PRINT) {
+      PrintValue(POP());
       printf("\n");
-      break;
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      if (Not(Peek(0))) {
-        frame->ip += offset;
+    CASE(OP_JUMP_IF_FALSE) {
+      if (Not(PEEK(0))) {
+        ip = OPERAND().target;
       }
-      break;
+      DISPATCH();
     }
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+    CASE(OP_JUMP) {
+      ip = OPERAND().target;
+      DISPATCH();
     }
-    case OP_LOOP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+    CASE(OP_LOOP) {
+#ifdef JIT
+      // The count stops at the threshold, so a loop that could not be traced
+      // is not recorded again.
+      if (vm->jit_enabled && ip[-1].arg < vm->trace_threshold &&
+          ++ip[-1].arg == vm->trace_threshold) {
+        Instruction *loop = ip - 1;
+        frame->ip = OPERAND().target;
+        SAVE_STACK();
+        Trace *trace = RecordTrace(vm, frame, loop);
+        if (trace != NULL) {
+          loop->as.trace = trace;
+          REWRITE(loop, OP_LOOP_TRACE);
+        }
+        ip = frame->ip;
+        LOAD_STACK();
+        DISPATCH();
+      }
+#endif
+      ip = OPERAND().target;
+      DISPATCH();
+    }
+    CASE(OP_CALL) {
+      CALL_VALUE(OPERAND().index);
+      DISPATCH();
     }
-    case OP_CALL: {
-      int arg_count = READ_BYTE();
-      if (!CallValue(Peek(arg_count), arg_count)) {
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_TAIL_CALL) {
+      int arg_count = OPERAND().index;
+      STORE_FRAME();
+      SAVE_STACK();
+      if (!TailCall(vm, arg_count)) {
+        // An ordinary call, so errors are reported from this frame; the
+        // OP_RETURN that follows finishes it.
+        CALL_VALUE(arg_count);
+        DISPATCH();
       }
-      frame = &vm.frames[vm.frame_count - 1];
-      break;
+#ifdef JIT
+      // The callee has taken over this frame, so it returns for both.
+      if (frame->closure->function->jit_code != NULL) {
+        InterpretResult call_result = JitRun(vm, frame);
+        if (STOPS_RUN(call_result)) {
+          return call_result;
+        }
+        if (call_result == INTERPRET_OK && vm->frame_count == exit_depth) {
+          return INTERPRET_OK;
+        }
+      }
+#endif
+      LOAD_FRAME();
+      LOAD_STACK();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
+    CASE(OP_CLOSURE) {
       ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure *closure = NewClosure(function);
-      Push(OBJ_VAL(closure));
+      uint8_t *captures =
+          frame->closure->function->chunk.code + ip[-1].offset + ip[-1].arg;
+      SAVE_STACK();
+      ObjClosure *closure = NewClosure(vm, function);
+      Push(vm, OBJ_VAL(closure));
       for (int i = 0; i < closure->upvalue_count; i++) {
-        uint8_t is_local = READ_BYTE();
-        uint8_t index = READ_BYTE();
+        uint8_t is_local = *captures++;
+        uint8_t index = *captures++;
         if (is_local) {
-          closure->upvalues[i] =
-              CaptureUpvalue(frame->slots + index);
+          closure->upvalues[i] = CaptureUpvalue(vm, slots + index);
         } else {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
       }
-      break;
+      LOAD_STACK();
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE: {
-      CloseUpvalues(vm.stack_top - 1);
-      Pop();
-      break;
+    CASE(OP_CLOSE_UPVALUE) {
+      SAVE_STACK();
+      CloseUpvalues(vm, stack_top - 1);
+      DROP();
+      DISPATCH();
     }
-    case OP_RETURN: {
-      Value result = Pop();
-      CloseUpvalues(frame->slots);
-      vm.frame_count--;
-      if (vm.frame_count == 0) {
-        Pop();
+    CASE(OP_RETURN) {
+      Value result = POP();
+      SAVE_STACK();
+      CloseUpvalues(vm, slots);
+      vm->frame_count--;
+      if (vm->frame_count == 0) {
+        Pop(vm);
+        if (vm->fiber->caller == NULL) {
+          return INTERPRET_OK;
+        }
+        FinishFiber(vm, result);
+        if (exit_depth != 0) {
+          return INTERPRET_SWITCHED;
+        }
+        LOAD_FRAME();
+        LOAD_STACK();
+        DISPATCH();
+      }
+      vm->stack_top = slots;
+      Push(vm, result);
+      if (vm->frame_count == exit_depth) {
         return INTERPRET_OK;
       }
-      vm.stack_top = frame->slots;
-      Push(result);
-      frame = &vm.frames[vm.frame_count - 1];
-      break;
+      LOAD_FRAME();
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_GET_LOCAL) {
+      PUSH(slots[OPERAND().index]);
+      PUSH(slots[ip[-1].arg]);
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_CONSTANT) {
+      PUSH(slots[ip[-1].arg]);
+      PUSH(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP) {
+      slots[OPERAND().index] = PEEK(0);
+      DROP();
+      DISPATCH();
+    }
+    CASE(OP_INCREMENT_LOCAL) {
+      // The local may be the top of the stack itself.
+      Value *local = &slots[ip[-1].arg];
+      Value increment = READ_CONSTANT();
+      SPILL_TOS();
+      if (IS_NUMBER(*local) && IS_NUMBER(increment)) {
+        *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(increment));
+      } else if (IS_STRING(*local) && IS_STRING(increment)) {
+        PUSH(*local);
+        PUSH(increment);
+        SAVE_STACK();
+        Concatenate(vm);
+        LOAD_STACK();
+        *local = POP();
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      FILL_TOS();
+      DISPATCH();
+    }
+    CASE(OP_LESS_JUMP_IF_FALSE) {
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      bool less = AS_NUMBER(PEEK(1)) < AS_NUMBER(PEEK(0));
+      DROP();
+      DROP();
+      if (!less) {
+        ip = OPERAND().target;
+      }
+      DISPATCH();
+    }
+    CASE(OP_GREATER_JUMP_IF_FALSE) {
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      bool greater = AS_NUMBER(PEEK(1)) > AS_NUMBER(PEEK(0));
+      DROP();
+      DROP();
+      if (!greater) {
+        ip = OPERAND().target;
+      }
+      DISPATCH();
+    }
+    CASE(OP_MOVE) {
+      SPILL_TOS();
+      STORE_REGISTER(RK(REGISTERS().b));
+      DISPATCH();
+    }
+    CASE(OP_NEGATE_R) {
+      SPILL_TOS();
+      Value *b = &RK(REGISTERS().b);
+      if (!IS_NUMBER(*b)) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      STORE_REGISTER(NUMBER_VAL(-AS_NUMBER(*b)));
+      DISPATCH();
+    }
+    CASE(OP_NOT_R) {
+      SPILL_TOS();
+      Value *b = &RK(REGISTERS().b);
+      if (!IS_BOOL(*b)) {
+        RUNTIME_ERROR("Operand must be a boolean.");
+      }
+      STORE_REGISTER(BOOL_VAL(Not(*b)));
+      DISPATCH();
+    }
+    CASE(OP_EQUAL_R) {
+      SPILL_TOS();
+      bool equal = RK_EQUAL(&RK(REGISTERS().b), &RK(REGISTERS().c));
+      STORE_REGISTER(BOOL_VAL(equal));
+      DISPATCH();
+    }
+    CASE(OP_GREATER_R) {
+      REGISTER_OP(BOOL_VAL, >);
+      DISPATCH();
+    }
+    CASE(OP_LESS_R) {
+      REGISTER_OP(BOOL_VAL, <);
+      DISPATCH();
+    }
+    CASE(OP_ADD_R) {
+      SPILL_TOS();
+      Value *b = &RK(REGISTERS().b);
+      Value *c = &RK(REGISTERS().c);
+      if (ARE_NUMBERS(*b, *c)) {
+        STORE_REGISTER(NUMBER_VAL(AS_NUMBER(*b) + AS_NUMBER(*c)));
+      } else if (IS_STRING(*b) && IS_STRING(*c)) {
+        // Concatenate() takes its operands from above every live slot.
+        SET_STACK_TOP(REGISTERS().top);
+        Value left = *b;
+        Value right = *c;
+        PUSH(left);
+        PUSH(right);
+        SAVE_STACK();
+        Concatenate(vm);
+        LOAD_STACK();
+        Value result = POP();
+        STORE_REGISTER(result);
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_R) {
+      REGISTER_OP(NUMBER_VAL, -);
+      DISPATCH();
     }
+    CASE(OP_MULTIPLY_R) {
+      REGISTER_OP(NUMBER_VAL, *);
+      DISPATCH();
+    }
+    CASE(OP_DIVIDE_R) {
+      REGISTER_OP(NUMBER_VAL, /);
+      DISPATCH();
+    }
+    CASE(OP_EQUAL_JUMP_R) {
+      SPILL_TOS();
+      bool equal = RK_EQUAL(&RK(REGISTERS().b), &RK(REGISTERS().c));
+      SET_STACK_TOP(REGISTERS().top);
+      if (equal == REGISTERS().a) {
+        ip += REGISTERS().jump;
+      }
+      DISPATCH();
+    }
+    CASE(OP_GREATER_JUMP_R) {
+      COMPARE_JUMP(>);
+      DISPATCH();
+    }
+    CASE(OP_LESS_JUMP_R) {
+      COMPARE_JUMP(<);
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM) {
+      NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+      DISPATCH();
+    }
+    CASE(OP_ADD_STR) {
+      if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+        QUICKEN(OP_ADD);
+        ip--;
+        DISPATCH();
+      }
+      SAVE_STACK();
+      Concatenate(vm);
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_NUM) {
+      NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+      DISPATCH();
+    }
+    CASE(OP_MULTIPLY_NUM) {
+      NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+      DISPATCH();
+    }
+    CASE(OP_DIVIDE_NUM) {
+      NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+      DISPATCH();
+    }
+    CASE(OP_LESS_NUM) {
+      NUMBER_OP(BOOL_VAL, <, OP_LESS);
+      DISPATCH();
+    }
+    CASE(OP_GREATER_NUM) {
+      NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+      DISPATCH();
+    }
+    CASE(OP_LOOP_TRACE) {
+#ifdef JIT
+      SAVE_STACK();
+      Trace *trace = OPERAND().trace;
+      ip = ((TraceCode)trace->code)(slots, &vm->stack_top,
+                                      vm->global_values.values);
+      LOAD_STACK();
+#endif
+      DISPATCH();
     }
   }
 
-#undef READ_BYTE
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef SPILL_TOS
+#undef FILL_TOS
+#undef SAVE_STACK
+#undef LOAD_STACK
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef SET_TOP
+#undef RUNTIME_ERROR
+#undef STOPS_RUN
+#undef CALL_VALUE
+#undef OPERAND
+#undef GLOBAL
 #undef READ_CONSTANT
-#undef READ_SHORT
 #undef READ_STRING
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef REGISTERS
+#undef RK
+#undef SET_STACK_TOP
+#undef STORE_REGISTER
+#undef RK_EQUAL
+#undef REGISTER_OP
+#undef COMPARE_JUMP
+#undef QUICKEN
+#undef REWRITE
+#undef NEXT
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+}
+
+// Runs the running fiber's only frame, just called, to completion.
+static InterpretResult RunFiber(VM *vm) {
+#ifdef JIT
+  if (vm->frames[0].closure->function->jit_code != NULL) {
+    InterpretResult result = JitRun(vm, &vm->frames[0]);
+    if (result != INTERPRET_SWITCHED) {
+      return result;
+    }
+  }
+#endif
+  return Run(vm, 0);
+}
+
+bool RunCallback(VM *vm, ObjClosure *closure, int arg_count, Value *args) {
+  ObjFiber *host = vm->fiber;
+  ObjFiber *fiber = vm->spare_fiber;
+  vm->spare_fiber = NULL;
+  if (fiber == NULL) {
+    fiber = NewFiber(vm, NULL);
+  }
+  // With no caller, the fiber stops Run() when its call returns.
+  SwitchFiber(vm, fiber);
+  vm->stack_top = vm->stack;
+  vm->frame_count = 0;
+  if (vm->stack_capacity < arg_count + 1) {
+    GrowStack(vm, arg_count + 1);
+  }
+  Push(vm, OBJ_VAL(closure));
+  for (int i = 0; i < arg_count; i++) {
+    Push(vm, args[i]);
+  }
+  InterpretResult result = INTERPRET_RUNTIME_ERROR;
+  if (Call(vm, closure, arg_count)) {
+    result = RunFiber(vm);
+  }
+  SwitchFiber(vm, host);
+  if (vm->spare_fiber == NULL) {
+    vm->spare_fiber = fiber;
+  } else {
+    FreeFiberStacks(fiber);
+  }
+  if (result != INTERPRET_OK) {
+    UnwindError(vm);
+    return false;
+  }
+  return true;
 }
 
-InterpretResult Interpret(const char *source) {
-  ObjFunction *function = Compile(source);
+InterpretResult Interpret(VM *vm, const char *source) {
+  ObjFunction *function = Compile(vm, source);
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
-  Push(OBJ_VAL(function));
-  ObjClosure* closure = NewClosure(function);
-  Pop();
-  Push(OBJ_VAL(closure));
-  Call(closure, 0);
-  return Run();
+  DecodeFunction(vm, function);
+  Push(vm, OBJ_VAL(function));
+  ObjClosure* closure = NewClosure(vm, function);
+  Pop(vm);
+  Push(vm, OBJ_VAL(closure));
+  if (!Call(vm, closure, 0)) {
+    return INTERPRET_RUNTIME_ERROR;
+  }
+#ifdef PROFILE_OPS
+  if (vm->profile != NULL) {
+    RestartOpProfile(vm->profile);
+  }
+  if (vm->line_profile != NULL) {
+    vm->line_profile->last_tick = ReadTicks();
+  }
+#endif
+  return RunFiber(vm);
 }
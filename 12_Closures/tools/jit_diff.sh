@@ -0,0 +1,45 @@
+#!/bin/sh
+# Runs every .lox file in the repository through the interpreter and through
+# the JIT, once compiling each function on its first call and once tracing
+# each loop on its second iteration, and reports any difference in output or
+# exit status. Scripts that read clock() end with a
+# timing line, which is not compared.
+# Usage: tools/jit_diff.sh [cflags]   e.g. tools/jit_diff.sh -DNAN_BOXING
+cd "$(dirname "$0")/.."
+cmake -S . -B build/jit-diff -DCMAKE_BUILD_TYPE=Release \
+  -DCMAKE_C_FLAGS="$*" > /dev/null || exit 1
+cmake --build build/jit-diff > /dev/null 2>&1 || exit 1
+clox=build/jit-diff/clox
+
+run() {
+  script=$1
+  shift
+  output=$(timeout 60 "$clox" "$@" "$script" 2>&1; echo "exit $?")
+  if grep -q 'clock()' "$script"; then
+    echo "$output" | sed '$d' | sed '$d'
+    echo "$output" | tail -n 1
+  else
+    echo "$output"
+  fi
+}
+
+failed=0
+total=0
+for script in $(git ls-files --full-name ':/*.lox'); do
+  script="$(git rev-parse --show-toplevel)/$script"
+  total=$((total + 1))
+  expected=$(run "$script" --no-jit)
+  for mode in --jit-threshold=1 --trace-threshold=2; do
+    actual=$(run "$script" --jit $mode)
+    if [ "$expected" != "$actual" ]; then
+      echo "FAIL $script ($mode)"
+      printf '%s\n' "$expected" > build/jit-diff/expected
+      printf '%s\n' "$actual" > build/jit-diff/actual
+      diff build/jit-diff/expected build/jit-diff/actual | head -n 10
+      failed=$((failed + 1))
+      break
+    fi
+  done
+done
+echo "$((total - failed))/$total scripts match"
+[ "$failed" -eq 0 ]
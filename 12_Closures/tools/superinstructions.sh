@@ -0,0 +1,44 @@
+#!/bin/sh
+# Ranks the opcode pairs executed over a script corpus, or the triples with
+# LENGTH=3, as candidates for new superinstructions. Chunks are left unfused
+# so the counts reflect plain bytecode.
+# Usage: tools/superinstructions.sh [script.lox ...]   (defaults to bench/*.lox)
+set -e
+cd "$(dirname "$0")/.."
+cmake -S . -B build/pairs -DCMAKE_BUILD_TYPE=Release \
+  -DCMAKE_C_FLAGS="-DNO_SUPERINSTRUCTIONS -DPROFILE_OPS" > /dev/null
+cmake --build build/pairs > /dev/null 2>&1
+
+if [ $# -eq 0 ]; then
+  set -- bench/*.lox
+fi
+if [ "${LENGTH:-2}" -eq 3 ]; then
+  section=triples
+else
+  section=pairs
+fi
+for script in "$@"; do
+  ./build/pairs/clox --profile-ops=build/pairs/profile.json "$script" \
+    > /dev/null 2>&1 || true
+  # One {"opcodes": [...], "count": N} object per line, under its section.
+  awk -v section="\"$section\":" '
+    $1 == section { inside = 1; next }
+    /^  \]/ { inside = 0 }
+    inside {
+      line = $0
+      sub(/.*"opcodes": \[/, "", line)
+      split(line, parts, "]")
+      names = parts[1]
+      gsub(/[",]/, "", names)
+      count = parts[2]
+      gsub(/[^0-9]/, "", count)
+      print names, count
+    }' build/pairs/profile.json
+done | awk '
+  { count = $NF; $NF = ""; sub(/ $/, ""); counts[$0] += count; total += count }
+  END {
+    for (sequence in counts) {
+      printf "%12d %6.2f%%  %s\n", counts[sequence],
+        100 * counts[sequence] / total, sequence
+    }
+  }' | sort -rn | head -n "${TOP:-20}"